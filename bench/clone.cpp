@@ -0,0 +1,91 @@
+/* Cloning a booted sandbox against starting one cold: the time until
+ * each reaches the guest's first hypercall, and the memory each adds
+ * to the process while nSandboxes of them are alive. Every sandbox
+ * holds dataLen bytes of data, the clones share the template's */
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "test.hpp"
+#include "abi.h"
+#include "sandbox.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr size_t dataLen = 8 << 20;
+static constexpr size_t nSandboxes = 16;
+
+/* proportional set size, so pages the clones share count once */
+static size_t pssBytes()
+{
+	std::ifstream rollup("/proc/self/smaps_rollup");
+	std::string key;
+	size_t kb;
+
+	while (rollup >> key) {
+		if (key == "Pss:" && rollup >> kb) return kb << 10;
+		rollup.ignore(256, '\n');
+	}
+	return 0;
+}
+
+static void fillData(Sandbox &sandbox)
+{
+	MemoryPool *pool = sandbox.getMemoryPool();
+	addr_t data = pool->getPhysicalMemoryBlock(dataLen);
+
+	memset(pool->getHostVirtualFromPhysical(data), 'x', dataLen);
+}
+
+static void runToHypercall(Sandbox &sandbox)
+{
+	if (sandbox.run() != VCPU_HYPERCALL) {
+		console->error("Sandbox did not reach its first hypercall");
+		std::abort();
+	}
+}
+
+static void report(const char *what, double seconds, size_t pssBefore)
+{
+	printf("%-10s %8.0f us per sandbox %8.0f KiB per sandbox\n", what,
+			seconds / nSandboxes * 1e6,
+			(double)(pssBytes() - pssBefore) / nSandboxes / 1024);
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	{
+		std::vector<SandboxPtr> cold;
+		size_t before = pssBytes();
+		auto start = TestClock::now();
+
+		for (size_t i = 0; i < nSandboxes; i++) {
+			cold.emplace_back(new Sandbox(memorySize, kernel));
+			runToHypercall(*cold.back());
+			fillData(*cold.back());
+		}
+		report("cold start", secondsSince(start), before);
+	}
+
+	Sandbox tmpl(memorySize, kernel, true);
+	runToHypercall(tmpl);
+	fillData(tmpl);
+
+	{
+		std::vector<SandboxPtr> clones;
+		size_t before = pssBytes();
+		auto start = TestClock::now();
+
+		for (size_t i = 0; i < nSandboxes; i++) {
+			clones.push_back(tmpl.clone());
+			runToHypercall(*clones.back());
+		}
+		report("clone", secondsSince(start), before);
+	}
+
+	return 0;
+}
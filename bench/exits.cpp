@@ -0,0 +1,50 @@
+/* Exits per second through the guest kernel's idle loop, one
+ * HYPERCALL_NONE per entry. The host reads the hypercall number
+ * like Sandbox::handleHypercall() does, and in the second run also
+ * writes a result, which puts the register set back on the next entry.
+ * Then the same with every register set fetched and stored by ioctl
+ * around each entry, the way it was before sync regs */
+
+#include "test.hpp"
+#include "abi.h"
+#include "sandbox.hpp"
+
+static constexpr int exits = 200000;
+
+static double measure(Sandbox &sandbox, bool writeResult)
+{
+	vcpu_t *vcpu = sandbox.getVcpu();
+	auto start = TestClock::now();
+
+	for (int i = 0; i < exits; i++) {
+		if (sandbox.run() != VCPU_HYPERCALL ||
+			VCPU_REG_GET(vcpu, rax) != HYPERCALL_NONE) {
+			console->error("Unexpected exit from the idle loop");
+			std::abort();
+		}
+
+		if (writeResult)
+			VCPU_REG(vcpu, rax) = HYPERCALL_NONE;
+	}
+
+	return exits / secondsSince(start);
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+	Sandbox sandbox(16 << 20, kernel);
+
+	/* boot, and warm up */
+	measure(sandbox, false);
+
+	printf("exits/s, registers read:    %.0f\n", measure(sandbox, false));
+	printf("exits/s, registers written: %.0f\n", measure(sandbox, true));
+
+	vcpu_use_eager_regs(sandbox.getVcpu());
+	printf("exits/s, ioctls, read:      %.0f\n", measure(sandbox, false));
+	printf("exits/s, ioctls, written:   %.0f\n", measure(sandbox, true));
+	return 0;
+}
@@ -0,0 +1,75 @@
+/* Page faults per second resolved by one MemorySpace from 1, 2, 4
+ * and 8 threads, each first touching every page of a region of its
+ * own, the way vcpus of one guest fault in disjoint memory. With
+ * enough host cores the total should grow with the threads */
+
+#include <thread>
+#include <vector>
+#include "test.hpp"
+#include "memory.hpp"
+#include "region.hpp"
+
+static constexpr addr_t regionBase = 0x10000000;
+static constexpr size_t regionLen = 16 << 20;
+
+static double measure(AbstractMemoryPool &pool, unsigned nThreads)
+{
+	MemorySpace space(&pool);
+	std::vector<std::thread> threads;
+
+	for (unsigned t = 0; t < nThreads; t++) {
+		auto region = std::make_shared<AnonymousMemoryRegion>(&pool,
+				regionBase + t * regionLen, regionLen);
+
+		/* one page per fault */
+		region->setFaultAround(1, 1);
+		space.addRegion(region);
+	}
+
+	auto start = TestClock::now();
+
+	for (unsigned t = 0; t < nThreads; t++) {
+		threads.emplace_back([&space, t] {
+			addr_t base = regionBase + t * regionLen;
+
+			for (size_t off = 0; off < regionLen; off += PAGE_SIZE) {
+				if (!space.fault(base + off, PF_WRITE)) {
+					console->error("Fault at 0x{:x} refused",
+							base + off);
+					std::abort();
+				}
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	return nThreads * (regionLen / PAGE_SIZE) / secondsSince(start);
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	{
+		BuddyMemoryPool pool(&vm, 0, 16 << 20,
+				DefaultHostMemoryMapper::instance, 512 << 20);
+
+		/* grow the pool and fault its memory in first */
+		measure(pool, 8);
+
+		printf("threads  faults/s  per thread\n");
+		for (unsigned n = 1; n <= 8; n *= 2) {
+			double rate = measure(pool, n);
+
+			printf("%7u  %8.0f  %10.0f\n", n, rate, rate / n);
+		}
+	}
+
+	vm_destroy(&vm);
+	return 0;
+}
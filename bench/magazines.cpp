@@ -0,0 +1,65 @@
+/* Single page allocations per second from 1, 2, 4 and 8 threads,
+ * straight from a BuddyMemoryPool and through CachingMemoryPool's
+ * per-thread magazines. Each thread keeps a few pages allocated the
+ * way a vcpu's fault path does */
+
+#include <thread>
+#include <vector>
+#include "test.hpp"
+#include "memory.hpp"
+
+static constexpr size_t rounds = 20000;
+static constexpr size_t held = 16;
+
+static double measure(AbstractMemoryPool &pool, unsigned nThreads)
+{
+	std::vector<std::thread> threads;
+	auto start = TestClock::now();
+
+	for (unsigned t = 0; t < nThreads; t++) {
+		threads.emplace_back([&pool] {
+			addr_t pages[held];
+
+			for (size_t r = 0; r < rounds; r++) {
+				for (auto &page : pages)
+					page = pool.getPhysicalMemoryBlock(PAGE_SIZE);
+				for (auto page : pages)
+					pool.freePhysicalMemoryBlock(page, PAGE_SIZE);
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	return nThreads * rounds * held / secondsSince(start);
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	{
+		BuddyMemoryPool buddy(&vm, 0, 64 << 20);
+		CachingMemoryPool cached(buddy, 8);
+
+		printf("threads  buddy allocs/s  magazine allocs/s\n");
+		for (unsigned n = 1; n <= 8; n *= 2) {
+			double direct = measure(buddy, n);
+			double magazines = measure(cached, n);
+
+			printf("%7u  %14.0f  %17.0f\n", n, direct, magazines);
+		}
+
+		auto stats = cached.getStats();
+		printf("magazines: %lu hits, %lu misses, %lu refills, %lu drains\n",
+				stats.hits, stats.misses, stats.refills,
+				stats.drains);
+	}
+
+	vm_destroy(&vm);
+	return 0;
+}
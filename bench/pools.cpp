@@ -0,0 +1,77 @@
+/* Allocations and frees per second of the first-fit MemoryPool
+ * and of BuddyMemoryPool under the same mix: mostly single pages,
+ * some larger blocks up to 64 KiB, freed in random order so the
+ * pool fragments as it would under a long running guest */
+
+#include <random>
+#include <utility>
+#include <vector>
+#include "test.hpp"
+#include "memory.hpp"
+
+static constexpr size_t poolSize = 256 << 20;
+static constexpr size_t operations = 400000;
+/* blocks held at once, about a third of the pool */
+static constexpr size_t live = 8192;
+
+static size_t pickLen(std::mt19937 &rng)
+{
+	/* 3 in 4 single pages, the rest 2 to 16 pages */
+	unsigned r = rng() % 16;
+
+	if (r < 12) return PAGE_SIZE;
+	return PAGE_SIZE << (1 + r % 4);
+}
+
+static double measure(MemoryPool &pool)
+{
+	std::mt19937 rng(1);
+	std::vector<std::pair<addr_t, size_t>> held;
+	auto start = TestClock::now();
+
+	held.reserve(live);
+	for (size_t i = 0; i < operations; i++) {
+		if (held.size() < live && (held.empty() || rng() % 2)) {
+			size_t len = pickLen(rng);
+
+			held.emplace_back(pool.getPhysicalMemoryBlock(len), len);
+			continue;
+		}
+
+		size_t victim = rng() % held.size();
+
+		pool.freePhysicalMemoryBlock(held[victim].first,
+				held[victim].second);
+		held[victim] = held.back();
+		held.pop_back();
+	}
+
+	double rate = operations / secondsSince(start);
+
+	for (auto &block : held)
+		pool.freePhysicalMemoryBlock(block.first, block.second);
+	return rate;
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	{
+		MemoryPool firstFit(&vm, 0, poolSize);
+		BuddyMemoryPool buddy(&vm, poolSize, poolSize);
+
+		/* fault the frame tables in first */
+		measure(firstFit);
+		measure(buddy);
+
+		printf("first fit: %.0f ops/s\n", measure(firstFit));
+		printf("buddy:     %.0f ops/s\n", measure(buddy));
+	}
+
+	vm_destroy(&vm);
+	return 0;
+}
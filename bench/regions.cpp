@@ -0,0 +1,74 @@
+/* Setting up and tearing down anonymous regions of 1, 16 and 256
+ * MiB in a MemorySpace: adding the region and faulting in every
+ * page, then removing it, which drops each page's frame again */
+
+#include "test.hpp"
+#include "memory.hpp"
+#include "region.hpp"
+
+static constexpr addr_t regionBase = 0x10000000;
+static constexpr size_t totalLen = 1 << 30;
+
+struct Timing {
+	/* seconds per region */
+	double setup;
+	double teardown;
+};
+
+static Timing measure(AbstractMemoryPool &pool, size_t regionLen)
+{
+	MemorySpace space(&pool);
+	size_t nRegions = totalLen / regionLen / 4;
+	double setup = 0, teardown = 0;
+
+	for (size_t i = 0; i < nRegions; i++) {
+		auto start = TestClock::now();
+
+		space.addRegion(std::make_shared<AnonymousMemoryRegion>(&pool,
+				regionBase, regionLen));
+		for (size_t off = 0; off < regionLen; off += PAGE_SIZE) {
+			if (!space.fault(regionBase + off, PF_WRITE)) {
+				console->error("Fault at 0x{:x} refused",
+						regionBase + off);
+				std::abort();
+			}
+		}
+		setup += secondsSince(start);
+
+		start = TestClock::now();
+		space.removeRegion(regionBase);
+		teardown += secondsSince(start);
+	}
+
+	return { setup / nRegions, teardown / nRegions };
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	{
+		BuddyMemoryPool pool(&vm, 0, 16 << 20,
+				DefaultHostMemoryMapper::instance, 512 << 20);
+
+		/* grow the pool and fault its memory in first */
+		measure(pool, 256 << 20);
+
+		printf("region   setup                       teardown\n");
+		for (size_t len : { 1 << 20, 16 << 20, 256 << 20 }) {
+			Timing t = measure(pool, len);
+			size_t pages = len / PAGE_SIZE;
+
+			printf("%4zu MiB  %9.0f us %7.0f ns/page  "
+					"%9.0f us %7.0f ns/page\n", len >> 20,
+					t.setup * 1e6, t.setup / pages * 1e9,
+					t.teardown * 1e6, t.teardown / pages * 1e9);
+		}
+	}
+
+	vm_destroy(&vm);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/* Small writes through the syscall ring: total records of 256 bytes
+ * written to a host file one per HYPERCALL_RING, then as batches of
+ * up to a ring's worth per exit. Writes per second and exits */
+
+#include <fcntl.h>
+#include <string>
+#include "test.hpp"
+#include "guest.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr uint64_t total = 16384;
+
+static std::string filePath()
+{
+	return "/tmp/lightvirt-bench-" + std::to_string(getpid()) + "-ring";
+}
+
+static void measure(const KernelImage &kernel, uint64_t batch)
+{
+	std::string path = filePath();
+	Sandbox sandbox(memorySize, kernel);
+	SyscallRing *ring = sandbox.enableSyscallRing();
+	uint32_t fd = ring->addFile(std::make_unique<HostFile>(path,
+			O_WRONLY | O_CREAT | O_TRUNC));
+	addr_t entry = loadGuest(sandbox, GUEST_ELF("writes"));
+	uint64_t result = 0;
+
+	startGuest(sandbox, entry, batch, total, fd);
+
+	auto start = TestClock::now();
+	GuestStop stop = resumeGuest(sandbox, result);
+	double seconds = secondsSince(start);
+
+	if (stop != GUEST_REPORT || result != total) {
+		console->error("Guest wrote {} of {} records", result, total);
+		std::abort();
+	}
+
+	printf("batch %3lu: %9.0f writes/s, %lu exits\n", batch,
+			total / seconds, ring->getStats().enters);
+	unlink(path.c_str());
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	measure(kernel, 1);
+	measure(kernel, SYSCALL_RING_ENTRIES);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/* pread(2) against io_uring on a file in the host's page cache:
+ * 4 KiB random reads one at a time and in batches of queueDepth,
+ * and 1 MiB sequential reads. Throughput, and latency where one
+ * request is in flight at a time */
+
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "test.hpp"
+#include "fs.hpp"
+#include "memory.hpp"
+
+static constexpr size_t fileSize = 64 << 20;
+static constexpr size_t randomReads = 100000;
+static constexpr size_t queueDepth = 32;
+static constexpr size_t bigRead = 1 << 20;
+static constexpr size_t sequentialPasses = 8;
+
+static std::string filePath()
+{
+	return "/tmp/lightvirt-bench-" + std::to_string(getpid()) + "-uring";
+}
+
+static std::vector<off_t> randomOffsets()
+{
+	std::mt19937 rng(1);
+	std::vector<off_t> offsets(randomReads);
+
+	for (auto &off : offsets)
+		off = (off_t)(rng() % (fileSize / PAGE_SIZE)) * PAGE_SIZE;
+	return offsets;
+}
+
+static void check(ssize_t ret, size_t len)
+{
+	if (ret != (ssize_t)len) {
+		console->error("Short read: {} of {}", ret, len);
+		std::abort();
+	}
+}
+
+static void report(const char *what, size_t n, size_t len, double seconds,
+		bool latency)
+{
+	printf("%-26s %9.0f ops/s %8.1f MiB/s", what, n / seconds,
+			n * len / seconds / (1 << 20));
+	if (latency)
+		printf(" %7.2f us/op", seconds / n * 1e6);
+	printf("\n");
+}
+
+static void randomSync(HostFile &file, const std::vector<off_t> &offsets)
+{
+	std::vector<char> buf(PAGE_SIZE);
+	auto start = TestClock::now();
+
+	for (off_t off : offsets)
+		check(file.pread(buf.data(), PAGE_SIZE, off), PAGE_SIZE);
+	report("4k random, pread", offsets.size(), PAGE_SIZE,
+			secondsSince(start), true);
+}
+
+static void randomUring(AsyncHostFile &file, const std::vector<off_t> &offsets)
+{
+	std::vector<char> buf(PAGE_SIZE);
+	auto start = TestClock::now();
+
+	for (off_t off : offsets)
+		check(file.pread(buf.data(), PAGE_SIZE, off), PAGE_SIZE);
+	report("4k random, io_uring", offsets.size(), PAGE_SIZE,
+			secondsSince(start), true);
+}
+
+static void randomBatched(IoUring &uring, AsyncHostFile &file,
+		const std::vector<off_t> &offsets)
+{
+	std::vector<char> bufs(queueDepth * PAGE_SIZE);
+	IoUring::Completion completions[queueDepth];
+	auto start = TestClock::now();
+
+	for (size_t i = 0; i < offsets.size(); i += queueDepth) {
+		size_t n = std::min(queueDepth, offsets.size() - i);
+
+		for (size_t j = 0; j < n; j++)
+			file.submitRead(&bufs[j * PAGE_SIZE], PAGE_SIZE,
+					offsets[i + j], j);
+		uring.submit(n);
+
+		for (size_t done = 0; done < n; ) {
+			size_t got = uring.reap(completions, queueDepth);
+
+			for (size_t j = 0; j < got; j++)
+				check(completions[j].res, PAGE_SIZE);
+			done += got;
+			if (done < n) uring.submit(1);
+		}
+	}
+
+	std::string what = "4k random, io_uring x" + std::to_string(queueDepth);
+	report(what.c_str(), offsets.size(), PAGE_SIZE, secondsSince(start),
+			false);
+}
+
+template <typename File>
+static void sequential(const char *what, File &file)
+{
+	std::vector<char> buf(bigRead);
+	size_t n = 0;
+	auto start = TestClock::now();
+
+	for (size_t pass = 0; pass < sequentialPasses; pass++) {
+		for (off_t off = 0; off < (off_t)fileSize; off += bigRead, n++)
+			check(file.pread(buf.data(), bigRead, off), bigRead);
+	}
+	report(what, n, bigRead, secondsSince(start), true);
+}
+
+int main()
+{
+	testInit();
+
+	std::string path = filePath();
+
+	{
+		HostFile writer(path, O_RDWR | O_CREAT | O_TRUNC);
+		std::vector<char> chunk(bigRead, 'x');
+
+		for (off_t off = 0; off < (off_t)fileSize; off += bigRead)
+			check(writer.pwrite(chunk.data(), bigRead, off), bigRead);
+	}
+
+	std::vector<off_t> offsets = randomOffsets();
+	IoUring uring(queueDepth * 2);
+	HostFile sync(path, O_RDONLY);
+	AsyncHostFile async(&uring, path, O_RDONLY);
+
+	/* warm up the page cache */
+	sequential("1M sequential, pread", sync);
+
+	randomSync(sync, offsets);
+	randomUring(async, offsets);
+	randomBatched(uring, async, offsets);
+	sequential("1M sequential, pread", sync);
+	sequential("1M sequential, io_uring", async);
+
+	auto stats = uring.getStats();
+	printf("io_uring: %lu requests, %lu enters\n", stats.submitted,
+			stats.enters);
+
+	unlink(path.c_str());
+	return 0;
+}
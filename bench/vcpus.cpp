@@ -0,0 +1,55 @@
+/* Guest work per second with 1, 2, 4 and 8 vcpus on their own
+ * threads, each counting down from spins in a loop and making one
+ * hypercall per round. Exits are rare, so with enough host cores
+ * the total should grow with the vcpus */
+
+#include <atomic>
+#include <thread>
+#include "test.hpp"
+#include "abi.h"
+#include "codevm.hpp"
+
+static constexpr uint32_t spins = 100000;
+
+/* 1: mov $spins, %ecx; 2: dec %ecx; jnz 2b; out %eax, (%dx); jmp 1b */
+static const std::vector<uint8_t> countdown = {
+	0xb9, spins & 0xff, (spins >> 8) & 0xff, (spins >> 16) & 0xff,
+	spins >> 24, 0xff, 0xc9, 0x75, 0xfc, 0xef, 0xeb, 0xf4
+};
+
+static constexpr auto duration = std::chrono::seconds(2);
+
+int main()
+{
+	testInit();
+
+	printf("vcpus  spins/s  per vcpu  exits/s\n");
+	for (size_t n = 1; n <= 8; n *= 2) {
+		CodeVm vm(n, countdown);
+		VcpuManager &vcpus = vm.getVcpus();
+		std::atomic<uint64_t> exits(0);
+
+		for (size_t i = 0; i < n; i++) {
+			VCPU_REG(vcpus.getVcpu(i), rax) = HYPERCALL_NONE;
+			VCPU_REG(vcpus.getVcpu(i), rdx) = HYPERCALL_PORT;
+			vcpus.setExitHandler(i,
+				[&](vcpu_t *, enum vcpu_exit_reason reason) {
+					exits.fetch_add(1, std::memory_order_relaxed);
+					return reason == VCPU_HYPERCALL;
+				});
+		}
+
+		auto start = TestClock::now();
+
+		vcpus.start();
+		std::this_thread::sleep_for(duration);
+		vcpus.shutdown();
+
+		double rate = exits / secondsSince(start);
+
+		printf("%5zu  %7.2e  %8.2e  %7.0f\n", n, rate * spins,
+				rate * spins / n, rate);
+	}
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+#ifndef ABI_H
+#define ABI_H
+
+#include <stdint.h>
+
+/* layout shared between the host and the guest kernel */
+
+/* where kernel.bin is linked, see kernel.ld */
+#define KERNEL_BASE 0x1000
+
+#define KERNEL_STACK_TOP 0x800000
+#define KERNEL_STACK_SIZE 0x4000
+
+/* guest physical range for file mappings in their own
+ * memory slots, above any memory pool but below the
+ * 36 bit MAXPHYADDR the guest sees by default */
+#define FILE_WINDOW_BASE 0xc00000000ULL
+
+/* a hypercall is an outl %eax, (%dx) to HYPERCALL_PORT with the
+ * number in rax and the arguments in rdi and rsi. the result comes
+ * back in rax. hlt does not reach the host with the in-kernel APIC */
+#define HYPERCALL_PORT 0x500
+#define HYPERCALL_NONE 0
+/* guest physical [rdi, rdi + rsi) is free in the guest, its
+ * host memory can go. 0 on success, -1 if refused */
+#define HYPERCALL_BALLOON 1
+/* complete the syscall ring's submissions. returns the number
+ * completed, -1 if the sandbox has no ring */
+#define HYPERCALL_RING 2
+/* the guest took a page fault at rdi with the error code in rsi.
+ * 0 once the access can be retried, -1 if it is not allowed. the
+ * kernel then repeats the hypercall, the host should stop there */
+#define HYPERCALL_FAULT 3
+
+/* one page per vcpu for TLB flushes queued by the host.
+ * each vcpu's GS base points at its own. they end below the
+ * kernel stack, which caps the vcpu ids */
+#define TLB_MAILBOX_BASE 0x700000
+#define TLB_MAILBOX_MAX 252
+
+/* flushes of more pages than this reload CR3 instead */
+#define TLB_FLUSH_MAX 64
+
+struct tlb_mailbox {
+	/* the mailbox's own guest virtual address */
+	uint64_t self;
+	/* written by the host while the vcpu is stopped */
+	uint64_t generation;
+	uint64_t full;
+	uint64_t count;
+	uint64_t pages[TLB_FLUSH_MAX];
+	/* a CR3 for the guest to load before flushing, 0 if
+	 * none. the mailbox address stays the same, so after the
+	 * switch it is the new space's mailbox being drained */
+	uint64_t switch_cr3;
+	/* the generation the guest has flushed up to */
+	uint64_t flushed;
+};
+
+/* A ring of host-bound requests in one page of guest memory, in
+ * the style of io_uring. The guest fills sq[sq_tail % entries] and
+ * advances sq_tail. The host consumes from sq_head and posts one
+ * completion per request at cq[cq_tail % entries], in order. Counters
+ * only grow. While RING_NEED_WAKEUP is set nobody polls the ring, and
+ * the guest makes HYPERCALL_RING after queueing */
+#define SYSCALL_RING_BASE 0x600000
+#define SYSCALL_RING_ENTRIES 64
+
+#define RING_NEED_WAKEUP (1ULL << 0)
+/* a 4 byte out of the ring's doorbell value to RING_DOORBELL_PORT
+ * wakes the host instead of HYPERCALL_RING, without stopping the vcpu */
+#define RING_DOORBELL (1ULL << 1)
+/* completions raise RING_IRQ_VECTOR, the guest may wait in hlt */
+#define RING_IRQ (1ULL << 2)
+
+#define RING_DOORBELL_PORT 0x504
+#define RING_IRQ_VECTOR 0x40
+
+enum ring_op {
+	RING_NOP,
+	/* fd, buffer at addr of len bytes. res is the byte count */
+	RING_READ,
+	RING_WRITE,
+	/* fd, off, whence in len. res is the new offset */
+	RING_SEEK,
+	/* clock id in off. res is the time in nanoseconds */
+	RING_CLOCK,
+	/* anonymous memory at addr of len bytes, page aligned.
+	 * res is addr */
+	RING_MMAP,
+};
+
+struct ring_sqe {
+	uint32_t op;
+	uint32_t fd;
+	uint64_t addr;
+	uint64_t len;
+	uint64_t off;
+	/* handed back in the completion */
+	uint64_t user_data;
+};
+
+struct ring_cqe {
+	uint64_t user_data;
+	/* negative errno on failure */
+	int64_t res;
+};
+
+struct syscall_ring {
+	uint64_t sq_head;
+	uint64_t sq_tail;
+	uint64_t cq_head;
+	uint64_t cq_tail;
+	uint64_t flags;
+	/* tells the VM's rings apart at RING_DOORBELL_PORT */
+	uint64_t doorbell;
+	struct ring_sqe sq[SYSCALL_RING_ENTRIES];
+	struct ring_cqe cq[SYSCALL_RING_ENTRIES];
+};
+
+#endif
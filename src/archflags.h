@@ -39,6 +39,23 @@ typedef uint64_t addr_t;
 #define CR4_SMEP (1U << 20)
 #define CR4_SMAP (1U << 21)
 
+/* CR3 bits with CR4.PCIDE */
+#define CR3_PCID_MASK 0xfffULL
+#define CR3_NOFLUSH (1ULL << 63)
+
+/* CPUID leaf 1 ecx bits */
+#define CPUID_1_ECX_PCID (1U << 17)
+
+/* IA32_APIC_BASE bits */
+#define APIC_BASE_DEFAULT 0xfee00000ULL
+#define APIC_BASE_BSP (1U << 8)
+#define APIC_BASE_EXTD (1U << 10)
+#define APIC_BASE_ENABLE (1U << 11)
+
+/* local APIC registers, offsets into the xAPIC page */
+#define APIC_SVR 0xf0
+#define APIC_SVR_ENABLE (1U << 8)
+
 #define EFER_SCE 1
 #define EFER_LME (1U << 8)
 #define EFER_LMA (1U << 10)
@@ -59,6 +76,11 @@ typedef uint64_t addr_t;
 #define PDE64_PS (1U << 7)
 #define PDE64_G (1U << 8)
 
+/* page fault error code bits */
+#define PF_PRESENT 1
+#define PF_WRITE (1U << 1)
+#define PF_USER (1U << 2)
+
 struct PageTableEntry {
     bool present : 1;
     bool writable : 1;
@@ -0,0 +1,187 @@
+#include "compress.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <emmintrin.h>
+#include "memory.hpp"
+
+static constexpr size_t minMatch = 4;
+/* the last bytes are always literals, which keeps matches
+ * from running into the end of the input */
+static constexpr size_t lastLiterals = 5;
+static constexpr unsigned hashBits = 12;
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - hashBits);
+}
+
+/* lengths of 15 and more continue in bytes of 255 */
+static inline uint8_t *putLength(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255) *op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* one sequence, offset 0 for the final literals-only one.
+ * nullptr if it does not fit */
+static uint8_t *putSequence(uint8_t *op, uint8_t *end, const uint8_t *literals,
+		size_t nLiterals, size_t offset, size_t matchLen)
+{
+	/* token, offset, literals and both lengths at worst */
+	size_t worst = 1 + 2 + nLiterals + nLiterals / 255 + 1 +
+		matchLen / 255 + 1;
+
+	if ((size_t)(end - op) < worst) return nullptr;
+
+	size_t matchCode = offset ? matchLen - minMatch : 0;
+	uint8_t *token = op++;
+
+	*token = (std::min<size_t>(nLiterals, 15) << 4) |
+		std::min<size_t>(matchCode, 15);
+
+	if (nLiterals >= 15) op = putLength(op, nLiterals - 15);
+	memcpy(op, literals, nLiterals);
+	op += nLiterals;
+
+	if (!offset) return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (matchCode >= 15) op = putLength(op, matchCode - 15);
+
+	return op;
+}
+
+size_t lzCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	/* positions in src, which stays below 64 KiB */
+	uint16_t table[1 << hashBits];
+	const uint8_t *ip = src, *anchor = src;
+	const uint8_t *end = src + len;
+	uint8_t *op = dst, *opEnd = dst + cap;
+
+	memset(table, 0, sizeof(table));
+
+	if (len > 0xffff) return 0;
+
+	while (len >= lastLiterals + minMatch &&
+		ip + minMatch <= end - lastLiterals) {
+		uint32_t seq = load32(ip);
+		uint32_t h = hash(seq);
+		const uint8_t *ref = src + table[h];
+
+		table[h] = ip - src;
+
+		if (ref >= ip || load32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		size_t matchLen = minMatch;
+		while (ip + matchLen < end - lastLiterals &&
+			ref[matchLen] == ip[matchLen])
+			matchLen++;
+
+		op = putSequence(op, opEnd, anchor, ip - anchor, ip - ref,
+				matchLen);
+		if (!op) return 0;
+
+		ip += matchLen;
+		anchor = ip;
+	}
+
+	op = putSequence(op, opEnd, anchor, end - anchor, 0, 0);
+	if (!op) return 0;
+
+	return op - dst;
+}
+
+/* reads a length continued in bytes of 255, false past the end */
+static inline bool getLength(const uint8_t *&ip, const uint8_t *end,
+		size_t &len)
+{
+	uint8_t b;
+
+	do {
+		if (ip >= end) return false;
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+bool lzDecompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t len)
+{
+	const uint8_t *ip = src, *end = src + srcLen;
+	uint8_t *op = dst, *opEnd = dst + len;
+
+	while (ip < end) {
+		uint8_t token = *ip++;
+		size_t nLiterals = token >> 4;
+
+		if (nLiterals == 15 && !getLength(ip, end, nLiterals))
+			return false;
+		if ((size_t)(end - ip) < nLiterals ||
+			(size_t)(opEnd - op) < nLiterals)
+			return false;
+
+		memcpy(op, ip, nLiterals);
+		ip += nLiterals;
+		op += nLiterals;
+
+		/* the final sequence */
+		if (ip == end) break;
+
+		if (end - ip < 2) return false;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t matchLen = token & 15;
+		if (matchLen == 15 && !getLength(ip, end, matchLen))
+			return false;
+		matchLen += minMatch;
+
+		if (!offset || offset > (size_t)(op - dst) ||
+			(size_t)(opEnd - op) < matchLen)
+			return false;
+
+		/* a short offset repeats the bytes it produces */
+		const uint8_t *ref = op - offset;
+		if (offset >= matchLen) {
+			memcpy(op, ref, matchLen);
+		} else {
+			for (size_t i = 0; i < matchLen; i++)
+				op[i] = ref[i];
+		}
+		op += matchLen;
+	}
+
+	return op == opEnd;
+}
+
+bool isZeroPage(const void *page)
+{
+	const __m128i *p = static_cast<const __m128i *>(page);
+	__m128i acc = _mm_setzero_si128();
+
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(__m128i); i += 4) {
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i));
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i + 1));
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i + 2));
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i + 3));
+	}
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc,
+			_mm_setzero_si128())) == 0xffff;
+}
@@ -0,0 +1,21 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A small LZ77 codec in the spirit of LZ4, for guest pages. The
+ * output is a series of sequences: a token with the literal and
+ * match lengths, the literals, a 16-bit offset and the match.
+ * The last sequence has literals only. Inputs up to 64 KiB. */
+
+/* returns the compressed length, or 0 if it does not fit in cap */
+size_t lzCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/* false unless src decodes to exactly len bytes */
+bool lzDecompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t len);
+
+/* the PAGE_SIZE bytes at page are all zero, 16 bytes at a time */
+bool isZeroPage(const void *page);
+
+#endif
@@ -0,0 +1,88 @@
+#include "elf.hpp"
+
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include "log.hpp"
+#include "region.hpp"
+
+ElfLoader::ElfLoader(vm_t *_vm, MemorySpace *_memorySpace,
+		AbstractMemoryPool *_memoryPool, addr_t windowBase)
+	: vm(_vm), memorySpace(_memorySpace), memoryPool(_memoryPool),
+	nextWindow(windowBase), faultAround(1)
+{
+}
+
+static void readAt(int fd, void *buf, size_t len, off_t offset,
+		const std::string &path)
+{
+	if (pread(fd, buf, len, offset) != (ssize_t)len) {
+		console->error("Cannot read {} at offset {}", path, offset);
+		std::abort();
+	}
+}
+
+addr_t ElfLoader::load(const std::string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		console->error("Cannot open {}", path);
+		std::abort();
+	}
+
+	Elf64_Ehdr ehdr;
+	readAt(fd, &ehdr, sizeof(ehdr), 0, path);
+
+	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+		ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+		ehdr.e_machine != EM_X86_64 ||
+		(ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) ||
+		ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+		console->error("{} is not an x86_64 ELF64 executable", path);
+		std::abort();
+	}
+
+	std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+	readAt(fd, phdrs.data(), phdrs.size() * sizeof(Elf64_Phdr),
+			ehdr.e_phoff, path);
+
+	for (auto &phdr : phdrs) {
+		if (phdr.p_type != PT_LOAD || !phdr.p_memsz) continue;
+
+		if (phdr.p_vaddr % PAGE_SIZE != phdr.p_offset % PAGE_SIZE ||
+			phdr.p_filesz > phdr.p_memsz) {
+			console->error("Bad PT_LOAD segment at 0x{:x} in {}",
+					phdr.p_vaddr, path);
+			std::abort();
+		}
+
+		addr_t start = phdr.p_vaddr / PAGE_SIZE * PAGE_SIZE;
+		size_t skew = phdr.p_vaddr - start;
+		size_t len = alignUp(phdr.p_vaddr + phdr.p_memsz, PAGE_SIZE) - start;
+		size_t dataLen = phdr.p_filesz ? skew + phdr.p_filesz : 0;
+
+		/* like Linux, the rest of the last page of a read-only
+		 * segment without bss comes from the file. it can be
+		 * shared then, see PageCache */
+		if (!(phdr.p_flags & PF_W) && phdr.p_filesz == phdr.p_memsz)
+			dataLen = alignUp(dataLen, PAGE_SIZE);
+
+		auto region = std::make_shared<FileMemoryRegion>(vm, memoryPool,
+			start, len, fd, phdr.p_offset - skew, dataLen,
+			phdr.p_flags & PF_W, nextWindow);
+
+		region->setFaultAround(1, faultAround);
+		memorySpace->addRegion(region);
+
+		console->debug("{}: segment 0x{:x}+{} at window 0x{:x}",
+				path, start, len, nextWindow);
+		nextWindow += alignUp(dataLen, PAGE_SIZE);
+	}
+
+	/* the mappings keep the file alive */
+	close(fd);
+
+	return ehdr.e_entry;
+}
@@ -0,0 +1,32 @@
+#ifndef ELF_HPP
+#define ELF_HPP
+
+#include <string>
+#include "kvm.h"
+#include "memory.hpp"
+
+/* Loads an ELF64 executable into a MemorySpace with one
+ * FileMemoryRegion per PT_LOAD segment. Nothing is read
+ * beyond the headers until the guest touches its pages. */
+class ElfLoader {
+private:
+	vm_t *vm;
+	MemorySpace *memorySpace;
+	AbstractMemoryPool *memoryPool;
+	/* next free guest physical address for file windows */
+	addr_t nextWindow;
+	size_t faultAround;
+public:
+	ElfLoader(vm_t *_vm, MemorySpace *_memorySpace,
+		AbstractMemoryPool *_memoryPool, addr_t windowBase);
+
+	/* largest fault-around window of the loaded segments,
+	 * a power of two */
+	void setFaultAround(size_t maxPages)
+	{ faultAround = maxPages; }
+
+	/* returns the entry point */
+	addr_t load(const std::string &path);
+};
+
+#endif
@@ -1 +1,345 @@
 #include "fs.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <limits.h>
+#include <sys/stat.h>
+#include "log.hpp"
+#include "memory.hpp"
+
+/* io_uring lengths are 32 bit, a short count is fine */
+static constexpr size_t maxTransfer = 1 << 30;
+
+/* host iovecs for the extents, merged where the host side is
+ * contiguous too, which it is within a pool chunk */
+static void resolveExtents(AbstractMemoryPool *pool,
+		const GuestExtent *extents, size_t n, std::vector<struct iovec> &iov)
+{
+	iov.clear();
+
+	for (size_t i = 0; i < n; i++) {
+		addr_t guestPhysical = extents[i].guestPhysical;
+		size_t len = extents[i].len;
+
+		while (len) {
+			size_t chunk = std::min(len,
+				PAGE_SIZE - guestPhysical % PAGE_SIZE);
+			char *host = static_cast<char *>(
+				pool->getHostVirtualFromPhysical(guestPhysical));
+
+			if (!iov.empty() && static_cast<char *>(
+				iov.back().iov_base) + iov.back().iov_len == host)
+				iov.back().iov_len += chunk;
+			else
+				iov.push_back({ host, chunk });
+
+			guestPhysical += chunk;
+			len -= chunk;
+		}
+	}
+}
+
+/* the host wrote the first len bytes of the extents */
+static void markExtentsDirty(AbstractMemoryPool *pool,
+		const GuestExtent *extents, size_t n, size_t len)
+{
+	for (size_t i = 0; i < n && len; i++) {
+		size_t chunk = std::min(len, extents[i].len);
+
+		pool->markDirty(extents[i].guestPhysical, chunk);
+		len -= chunk;
+	}
+}
+
+ssize_t AbstractFile::readv(AbstractMemoryPool *pool,
+		const GuestExtent *extents, size_t n)
+{
+	std::vector<struct iovec> iov;
+	ssize_t done = 0;
+
+	resolveExtents(pool, extents, n, iov);
+	for (auto &piece : iov) {
+		ssize_t ret = read(static_cast<char *>(piece.iov_base),
+				piece.iov_len);
+
+		if (ret < 0) {
+			if (!done) return ret;
+			break;
+		}
+		done += ret;
+		if ((size_t)ret < piece.iov_len) break;
+	}
+
+	markExtentsDirty(pool, extents, n, done);
+	return done;
+}
+
+ssize_t AbstractFile::writev(AbstractMemoryPool *pool,
+		const GuestExtent *extents, size_t n)
+{
+	std::vector<struct iovec> iov;
+	ssize_t done = 0;
+
+	resolveExtents(pool, extents, n, iov);
+	for (auto &piece : iov) {
+		ssize_t ret = write(static_cast<char *>(piece.iov_base),
+				piece.iov_len);
+
+		if (ret < 0) return done ? done : ret;
+		done += ret;
+		if ((size_t)ret < piece.iov_len) break;
+	}
+
+	return done;
+}
+
+HostFile::HostFile(const std::string &_path, int flags, mode_t mode)
+	: path(_path), offset(0), append(flags & O_APPEND)
+{
+	hostFd = open(path.c_str(), flags | O_CLOEXEC, mode);
+	if (hostFd < 0) {
+		console->error("Cannot open {}: {}", path, strerror(errno));
+		std::abort();
+	}
+}
+
+HostFile::~HostFile()
+{
+	close(hostFd);
+}
+
+ssize_t HostFile::read(char *buf, size_t len)
+{
+	ssize_t n = pread(buf, len, offset);
+
+	if (n > 0) offset += n;
+	return n;
+}
+
+ssize_t HostFile::write(char *buf, size_t len)
+{
+	ssize_t n = pwrite(buf, len, offset);
+
+	/* pwrite(2) ignores the offset with O_APPEND */
+	if (n > 0)
+		offset = append ? lseek(hostFd, 0, SEEK_END) : offset + n;
+	return n;
+}
+
+ssize_t HostFile::seek(size_t off, int method)
+{
+	off_t base;
+
+	switch (method) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = offset;
+		break;
+	case SEEK_END: {
+		struct stat st;
+
+		if (fstat(hostFd, &st)) return -errno;
+		base = st.st_size;
+		break;
+	}
+	default:
+		return -EINVAL;
+	}
+
+	/* off is a signed delta for SEEK_CUR and SEEK_END */
+	off_t target = base + (off_t)off;
+
+	if (target < 0) return -EINVAL;
+	offset = target;
+	return offset;
+}
+
+ssize_t HostFile::pread(char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	do {
+		n = ::pread(hostFd, buf, len, off);
+	} while (n < 0 && errno == EINTR);
+
+	return n < 0 ? -errno : n;
+}
+
+ssize_t HostFile::pwrite(const char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	do {
+		n = ::pwrite(hostFd, buf, len, off);
+	} while (n < 0 && errno == EINTR);
+
+	return n < 0 ? -errno : n;
+}
+
+ssize_t HostFile::readv(AbstractMemoryPool *pool, const GuestExtent *extents,
+		size_t n)
+{
+	ssize_t done = preadv(pool, extents, n, offset);
+
+	if (done > 0) offset += done;
+	return done;
+}
+
+ssize_t HostFile::writev(AbstractMemoryPool *pool, const GuestExtent *extents,
+		size_t n)
+{
+	ssize_t done = pwritev(pool, extents, n, offset);
+
+	if (done > 0)
+		offset = append ? lseek(hostFd, 0, SEEK_END) : offset + done;
+	return done;
+}
+
+ssize_t HostFile::preadv(AbstractMemoryPool *pool, const GuestExtent *extents,
+		size_t n, off_t off)
+{
+	return transferExtents(pool, extents, n, off, false);
+}
+
+ssize_t HostFile::pwritev(AbstractMemoryPool *pool, const GuestExtent *extents,
+		size_t n, off_t off)
+{
+	return transferExtents(pool, extents, n, off, true);
+}
+
+ssize_t HostFile::transferExtents(AbstractMemoryPool *pool,
+		const GuestExtent *extents, size_t n, off_t off, bool write)
+{
+	static thread_local std::vector<struct iovec> iov;
+	ssize_t done = 0;
+
+	resolveExtents(pool, extents, n, iov);
+	for (size_t i = 0; i < iov.size(); i += IOV_MAX) {
+		int count = std::min<size_t>(iov.size() - i, IOV_MAX);
+		size_t len = 0;
+
+		for (int j = 0; j < count; j++)
+			len += iov[i + j].iov_len;
+
+		ssize_t ret = transferv(&iov[i], count, off + done, write);
+
+		if (ret < 0) {
+			if (!done) return ret;
+			break;
+		}
+		done += ret;
+		if ((size_t)ret < len) break;
+	}
+
+	if (!write)
+		markExtentsDirty(pool, extents, n, done);
+	return done;
+}
+
+ssize_t HostFile::transferv(const struct iovec *iov, int n, off_t off,
+		bool write)
+{
+	ssize_t ret;
+
+	do {
+		ret = write ? ::pwritev(hostFd, iov, n, off) :
+			::preadv(hostFd, iov, n, off);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+AsyncHostFile::AsyncHostFile(IoUring *_uring, const std::string &_path,
+		int flags, mode_t mode)
+	: HostFile(_path, flags, mode), uring(_uring)
+{
+	/* without a slot it goes by its plain fd */
+	fixedFd = uring->registerFile(hostFd);
+}
+
+AsyncHostFile::~AsyncHostFile()
+{
+	/* the kernel holds on to the file once a request is
+	 * submitted, queued ones still name it by fd */
+	if (uring->queued())
+		uring->submit();
+
+	if (fixedFd != IoUring::NONE)
+		uring->unregisterFile(fixedFd);
+}
+
+ssize_t AsyncHostFile::pread(char *buf, size_t len, off_t off)
+{
+	uint64_t userData = uring->tag();
+
+	prepare(false, buf, len, off, userData);
+	return uring->wait(userData);
+}
+
+ssize_t AsyncHostFile::pwrite(const char *buf, size_t len, off_t off)
+{
+	uint64_t userData = uring->tag();
+
+	prepare(true, buf, len, off, userData);
+	return uring->wait(userData);
+}
+
+ssize_t AsyncHostFile::transferv(const struct iovec *iov, int n, off_t off,
+		bool write)
+{
+	uint64_t userData = uring->tag();
+	bool fixed = fixedFd != IoUring::NONE;
+
+	uring->prepare(write ? IORING_OP_WRITEV : IORING_OP_READV,
+			fixed ? fixedFd : hostFd, iov, n, off, userData, fixed);
+	return uring->wait(userData);
+}
+
+void AsyncHostFile::submitRead(char *buf, size_t len, off_t off,
+		uint64_t userData)
+{
+	checkUserData(userData);
+	prepare(false, buf, len, off, userData);
+}
+
+void AsyncHostFile::submitWrite(const char *buf, size_t len, off_t off,
+		uint64_t userData)
+{
+	checkUserData(userData);
+	prepare(true, buf, len, off, userData);
+}
+
+void AsyncHostFile::checkUserData(uint64_t userData)
+{
+	/* it could be taken for the completion of a pread() */
+	if (userData & IoUring::INTERNAL) {
+		console->error("io_uring userData {:#x} is reserved",
+				userData);
+		std::abort();
+	}
+}
+
+void AsyncHostFile::prepare(bool write, const char *buf, size_t len,
+		off_t off, uint64_t userData)
+{
+	len = std::min(len, maxTransfer);
+
+	int index = uring->findBuffer(buf, len);
+	bool fixed = fixedFd != IoUring::NONE;
+	uint8_t opcode;
+
+	if (index != IoUring::NONE)
+		opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	struct io_uring_sqe *sqe = uring->prepare(opcode,
+			fixed ? fixedFd : hostFd, buf, len, off, userData, fixed);
+
+	if (index != IoUring::NONE)
+		sqe->buf_index = index;
+}
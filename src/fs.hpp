@@ -4,20 +4,125 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string>
+#include "uring.hpp"
 
+class AbstractMemoryPool;
+struct GuestExtent;
 
+/* Errors come back as -errno, which is what the guest sees */
 class AbstractFile {
 public:
 	virtual ssize_t read(char *buf, size_t len) = 0;
 	virtual ssize_t write(char *buf, size_t len) = 0;
 	virtual ssize_t seek(size_t offset, int method) = 0;
+
+	/* the same, straight from and to guest physical extents in
+	 * the pool. the default makes one read() or write() per host
+	 * contiguous piece */
+	virtual ssize_t readv(AbstractMemoryPool *pool,
+			const GuestExtent *extents, size_t n);
+	virtual ssize_t writev(AbstractMemoryPool *pool,
+			const GuestExtent *extents, size_t n);
+
 	virtual ~AbstractFile() {}
 };
 
+/* A file on the host, read and written with pread(2) and pwrite(2)
+ * from an offset of its own */
 class HostFile: public AbstractFile {
-private:
+protected:
 	int hostFd;
 	std::string path;
+	off_t offset;
+	bool append;
+public:
+	/* open(2) flags and mode, aborts if the file cannot be opened */
+	HostFile(const std::string &_path, int flags, mode_t mode = 0644);
+
+	HostFile(HostFile &) = delete;
+
+	virtual ~HostFile();
+
+	virtual ssize_t read(char *buf, size_t len);
+
+	virtual ssize_t write(char *buf, size_t len);
+
+	virtual ssize_t seek(size_t offset, int method);
+
+	/* at off, leaving the file offset alone */
+	virtual ssize_t pread(char *buf, size_t len, off_t off);
+
+	virtual ssize_t pwrite(const char *buf, size_t len, off_t off);
+
+	virtual ssize_t readv(AbstractMemoryPool *pool,
+			const GuestExtent *extents, size_t n);
+
+	virtual ssize_t writev(AbstractMemoryPool *pool,
+			const GuestExtent *extents, size_t n);
+
+	/* like preadv(2) and pwritev(2), the pages go to the host
+	 * kernel without a copy */
+	ssize_t preadv(AbstractMemoryPool *pool, const GuestExtent *extents,
+			size_t n, off_t off);
+
+	ssize_t pwritev(AbstractMemoryPool *pool, const GuestExtent *extents,
+			size_t n, off_t off);
+
+	int getFd() const
+	{ return hostFd; }
+
+	const std::string &getPath() const
+	{ return path; }
+
+protected:
+	/* one vectored transfer, n is at most IOV_MAX */
+	virtual ssize_t transferv(const struct iovec *iov, int n, off_t off,
+			bool write);
+
+private:
+	ssize_t transferExtents(AbstractMemoryPool *pool,
+			const GuestExtent *extents, size_t n, off_t off,
+			bool write);
+};
+
+/* A HostFile doing its I/O through an IoUring, which can be shared
+ * with other files to batch their requests. read() and friends wait
+ * for their own request, submitRead() and submitWrite() only queue
+ * one and leave submitting and reaping to the owner of the ring.
+ * The fd is registered with the ring, and buffers registered with
+ * it are used as such */
+class AsyncHostFile: public HostFile {
+private:
+	IoUring *uring;
+	/* in the ring's file table, or IoUring::NONE */
+	int fixedFd;
+public:
+	AsyncHostFile(IoUring *_uring, const std::string &_path, int flags,
+			mode_t mode = 0644);
+
+	virtual ~AsyncHostFile();
+
+	virtual ssize_t pread(char *buf, size_t len, off_t off);
+
+	virtual ssize_t pwrite(const char *buf, size_t len, off_t off);
+
+	/* queue a transfer at off, its completion carries userData,
+	 * which must leave IoUring::INTERNAL clear */
+	void submitRead(char *buf, size_t len, off_t off, uint64_t userData);
+
+	void submitWrite(const char *buf, size_t len, off_t off,
+			uint64_t userData);
+
+protected:
+	virtual ssize_t transferv(const struct iovec *iov, int n, off_t off,
+			bool write);
+
+private:
+	void checkUserData(uint64_t userData);
+
+	void prepare(bool write, const char *buf, size_t len, off_t off,
+			uint64_t userData);
 };
 #endif
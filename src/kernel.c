@@ -1,15 +1,133 @@
 #include "kernel.h"
+#include "abi.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
+#define VECTOR_PAGE_FAULT 14
+
+static void trap_init(void);
+static void tlb_drain(void);
+
 void
 __attribute__((section(".start")))
 _start(void) {
-	__asm("hlt");
+	trap_init();
+
+	for (;;) {
+		hypercall(HYPERCALL_NONE, 0, 0);
+		/* back from the host, pick up what it queued */
+		tlb_drain();
+	}
+}
+
+struct idt_gate {
+	uint16_t offset_low;
+	uint16_t selector;
+	uint8_t ist;
+	uint8_t type;
+	uint16_t offset_mid;
+	uint32_t offset_high;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct descriptor_table {
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed));
+
+/* the selectors the host loaded, 8 for code and 16 for data.
+ * interrupts and iretq read them from here */
+static uint64_t gdt[3] = {
+	0,
+	0x00af9a000000ffffULL,
+	0x00cf92000000ffffULL,
+};
+
+/* only page faults and the ring's vector have a gate, anything else
+ * still ends in a triple fault. in .data, kernel.bin has no bss */
+static struct idt_gate idt[RING_IRQ_VECTOR + 1]
+	__attribute__((section(".data")));
+
+/* the entry points from idt.S, linked in, not through the GOT */
+extern uint64_t vectors[] __attribute__((visibility("hidden")));
+
+static void set_gate(int vector)
+{
+	uint64_t handler = vectors[vector];
+	struct idt_gate *gate = &idt[vector];
+
+	gate->offset_low = handler;
+	gate->selector = 8;
+	/* present 64-bit interrupt gate, interrupts stay off */
+	gate->type = 0x8e;
+	gate->offset_mid = handler >> 16;
+	gate->offset_high = handler >> 32;
+}
+
+static void trap_init(void)
+{
+	struct descriptor_table gdtr = { sizeof(gdt) - 1, (uint64_t)gdt };
+	struct descriptor_table idtr = { sizeof(idt) - 1, (uint64_t)idt };
+
+	set_gate(VECTOR_PAGE_FAULT);
+	set_gate(RING_IRQ_VECTOR);
+
+	__asm volatile("lgdt %0" :: "m"(gdtr));
+	__asm volatile("lidt %0" :: "m"(idtr));
+}
+
+/* carry out the flushes the host left in this vcpu's mailbox */
+static void tlb_drain(void)
+{
+	volatile struct tlb_mailbox *mbox;
+	uint64_t cr3, i;
+
+	__asm volatile("mov %%gs:0, %0" : "=r"(mbox));
+
+	if (mbox->switch_cr3) {
+		cr3 = mbox->switch_cr3;
+		mbox->switch_cr3 = 0;
+		__asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+	}
+
+	if (mbox->flushed == mbox->generation)
+		return;
+
+	/* with PCIDs both only hit the current space's tag */
+	if (mbox->full) {
+		__asm volatile("mov %%cr3, %0\n\tmov %0, %%cr3"
+				: "=r"(cr3) :: "memory");
+	} else {
+		for (i = 0; i < mbox->count; i++)
+			__asm volatile("invlpg (%0)"
+					:: "r"(mbox->pages[i]) : "memory");
+	}
+
+	mbox->flushed = mbox->generation;
+}
+
+/* the host fills in the page. an access it does not allow
+ * never returns */
+static void page_fault(struct idt_frame *frame)
+{
+	uint64_t cr2;
+
+	__asm volatile("mov %%cr2, %0" : "=r"(cr2));
+
+	while (hypercall(HYPERCALL_FAULT, cr2, frame->errorcode))
+		;
+
+	tlb_drain();
 }
 
 void do_irq(struct idt_frame *frame)
 {
-	__asm("hlt");
+	if (frame->vector == VECTOR_PAGE_FAULT) {
+		page_fault(frame);
+		return;
+	}
+
+	/* a ring completion, ring_wait() looks at the queue */
+	apic_eoi();
 }
@@ -2,6 +2,100 @@
 #define KERNEL_H
 
 #include <stdint.h>
+#include "abi.h"
+
+static inline uint64_t hypercall(uint64_t nr, uint64_t arg0, uint64_t arg1)
+{
+	__asm volatile("outl %%eax, %%dx" : "+a"(nr)
+			: "d"(HYPERCALL_PORT), "D"(arg0), "S"(arg1) : "memory");
+	return nr;
+}
+
+/* x2APIC end of interrupt */
+#define MSR_X2APIC_EOI 0x80b
+
+static inline void apic_eoi(void)
+{
+	__asm volatile("wrmsr" :: "c"(MSR_X2APIC_EOI), "a"(0), "d"(0));
+}
+
+#define SYSCALL_RING ((volatile struct syscall_ring *)SYSCALL_RING_BASE)
+
+/* queue a request, 0 if the submission queue is full */
+static inline int ring_submit(uint32_t op, uint32_t fd, uint64_t addr,
+		uint64_t len, uint64_t off, uint64_t user_data)
+{
+	volatile struct syscall_ring *ring = SYSCALL_RING;
+	uint64_t tail = ring->sq_tail;
+	volatile struct ring_sqe *sqe;
+
+	if (tail - ring->sq_head == SYSCALL_RING_ENTRIES)
+		return 0;
+
+	sqe = &ring->sq[tail % SYSCALL_RING_ENTRIES];
+	sqe->op = op;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+
+	/* the entry before the tail */
+	__asm volatile("" ::: "memory");
+	ring->sq_tail = tail + 1;
+	return 1;
+}
+
+/* get the host to look at the queued requests. free while its
+ * poller runs or with a doorbell, one exit otherwise */
+static inline void ring_enter(void)
+{
+	/* the tail must be visible before the flag is read, the
+	 * poller orders the other way round before it sleeps */
+	uint64_t flags;
+
+	__asm volatile("mfence" ::: "memory");
+
+	flags = SYSCALL_RING->flags;
+	if (!(flags & RING_NEED_WAKEUP))
+		return;
+
+	if (flags & RING_DOORBELL)
+		__asm volatile("outl %%eax, %%dx"
+				:: "a"((uint32_t)SYSCALL_RING->doorbell),
+				"d"(RING_DOORBELL_PORT) : "memory");
+	else
+		hypercall(HYPERCALL_RING, 0, 0);
+}
+
+/* take the next completion, 0 if there is none */
+static inline int ring_reap(struct ring_cqe *cqe)
+{
+	volatile struct syscall_ring *ring = SYSCALL_RING;
+	uint64_t head = ring->cq_head;
+
+	if (head == ring->cq_tail)
+		return 0;
+
+	__asm volatile("" ::: "memory");
+	cqe->user_data = ring->cq[head % SYSCALL_RING_ENTRIES].user_data;
+	cqe->res = ring->cq[head % SYSCALL_RING_ENTRIES].res;
+	__asm volatile("" ::: "memory");
+	ring->cq_head = head + 1;
+	return 1;
+}
+
+/* take the next completion, halting until the host's interrupt
+ * while it sends one. interrupts are only on in here */
+static inline void ring_wait(struct ring_cqe *cqe)
+{
+	while (!ring_reap(cqe)) {
+		if (SYSCALL_RING->flags & RING_IRQ)
+			__asm volatile("sti; hlt; cli" ::: "memory");
+		else
+			__asm volatile("pause" ::: "memory");
+	}
+}
 
 struct idt_frame {
 	uint64_t rax;
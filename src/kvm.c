@@ -1,6 +1,8 @@
 #include "kvm.h"
+#include "abi.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -11,54 +13,57 @@
 #include <sys/mman.h>
 #include <linux/kvm.h>
 
-#define KVM_DEBUG 1
-
-static uint32_t max_slots;
-
-size_t vcpu_mmap_size;
-
-static uint64_t *slot_bitmap;
+/* build with -DKVM_DEBUG=1 to trace every exit */
+#ifndef KVM_DEBUG
+#define KVM_DEBUG 0
+#endif
 
-#define ACCESS_SLOT(i) (1 & (slot_bitmap[i / 64] >> (uint64_t)(i % 64)))
+#define ACCESS_SLOT(vm, i) \
+	(1 & ((vm)->slot_bitmap[(i) / 64] >> (uint64_t)((i) % 64)))
 
-static inline void slot_set(uint32_t i, int v)
+static inline void slot_set(vm_t *vm, uint32_t i, int v)
 {
-	if (v) slot_bitmap[i / 64] |= (1ULL << (uint64_t)(i % 64));
-	else slot_bitmap[i / 64] &= ~(1ULL << (uint64_t)(i % 64));
+	if (v) vm->slot_bitmap[i / 64] |= (1ULL << (uint64_t)(i % 64));
+	else vm->slot_bitmap[i / 64] &= ~(1ULL << (uint64_t)(i % 64));
 }
 
-static int slot_find_first_available(void)
+/* find a free slot and mark it used */
+static int slot_alloc(vm_t *vm)
 {
 	// max_slots should be a multiple of 64
-	uint32_t max_index = max_slots / 64;
-	uint32_t i;
+	uint32_t max_index = vm->max_slots / 64;
+	int slot = -1;
 
-	for (i = 0; i < max_index; i++) {
-		if (~slot_bitmap[i]) break;
-	}
+	pthread_mutex_lock(&vm->slot_lock);
 
-	if (i == max_index) {
-		goto failed;
+	for (uint32_t i = 0; i < max_index; i++) {
+		uint64_t available = ~vm->slot_bitmap[i];
+
+		if (available) {
+			slot = __builtin_ctzll(available) + 64 * i;
+			slot_set(vm, slot, 1);
+			break;
+		}
 	}
 
-	uint64_t qword = slot_bitmap[i];
+	pthread_mutex_unlock(&vm->slot_lock);
 
-	for (int j = 0; j < 64; j++) {
-		if ((1ULL & (qword >> (uint64_t)j)) == 0)
-			return j + 64 * i;
-	}
+	if (slot < 0)
+		fprintf(stderr, "Error: out of memory slots\n");
 
-failed:
-	fprintf(stderr, "Error: out of memory slots\n");
-	return -1;
+	return slot;
 }
 
-static inline void slot_free(int index)
+static inline void slot_free(vm_t *vm, uint32_t index)
 {
-	assert(index < max_slots);
-	assert(ACCESS_SLOT(index));
+	pthread_mutex_lock(&vm->slot_lock);
 
-	slot_set(index, 0);
+	assert(index < vm->max_slots);
+	assert(ACCESS_SLOT(vm, index));
+
+	slot_set(vm, index, 0);
+
+	pthread_mutex_unlock(&vm->slot_lock);
 }
 
 static void kvm_debug(const char *fmt, ...)
@@ -105,47 +110,95 @@ void vm_init(vm_t *vm)
 		exit(EXIT_FAILURE);
 	}
 
-	max_slots = ioctl(vm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_MEMSLOTS);
+	int max_slots = ioctl(vm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_MEMSLOTS);
 	if (max_slots < 0) {
 		perror("KVM_CHECK_EXTENSION");
 		exit(EXIT_FAILURE);
 	} else {
 		// round to multiple of 64
-		max_slots &= ~63;
-		kvm_debug("KVM: max_slots = %d\n", max_slots);
-		slot_bitmap = malloc(max_slots / 8);
-		memset(slot_bitmap, 0, max_slots / 8);
+		vm->max_slots = max_slots & ~63;
+		kvm_debug("KVM: max_slots = %d\n", vm->max_slots);
+		vm->slot_bitmap = calloc(vm->max_slots / 64, sizeof(uint64_t));
+		if (!vm->slot_bitmap) {
+			perror("calloc slot_bitmap");
+			exit(EXIT_FAILURE);
+		}
 	}
+
+	pthread_mutex_init(&vm->slot_lock, NULL);
+
+	memset(vm->pcid_bitmap, 0, sizeof(vm->pcid_bitmap));
+	/* PCID 0 is what runs untagged */
+	vm->pcid_bitmap[0] = 1;
+	pthread_mutex_init(&vm->pcid_lock, NULL);
+
+	vm->irqchip = 0;
 	
-	vcpu_mmap_size = ioctl(vm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+	int vcpu_mmap_size = ioctl(vm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
 
 	if (vcpu_mmap_size <= 0) {
 		perror("KVM_GET_VCPU_MMAP_SIZE");
 		exit(EXIT_FAILURE);
 	}
 
+	vm->vcpu_mmap_size = vcpu_mmap_size;
+}
+
+void vm_destroy(vm_t *vm)
+{
+	pthread_mutex_destroy(&vm->slot_lock);
+	pthread_mutex_destroy(&vm->pcid_lock);
+	free(vm->slot_bitmap);
+	vm->slot_bitmap = NULL;
+
+	if (close(vm->fd) < 0) {
+		perror("close vm fd");
+		exit(EXIT_FAILURE);
+	}
+
+	if (close(vm->sys_fd) < 0) {
+		perror("close /dev/kvm");
+		exit(EXIT_FAILURE);
+	}
 }
 
 mem_t *vm_map_guest_physical(vm_t *vm, void *host_vaddr, addr_t guest_paddr, size_t len)
+{
+	return vm_map_guest_physical_flags(vm, host_vaddr, guest_paddr, len, 0);
+}
+
+mem_t *vm_map_guest_physical_flags(vm_t *vm, void *host_vaddr,
+				addr_t guest_paddr, size_t len, uint32_t flags)
 {
 	mem_t *ret = malloc(sizeof(mem_t));
-	int slot = slot_find_first_available();
+	int slot;
+
+	if (!ret) {
+		perror("malloc mem_t");
+		exit(EXIT_FAILURE);
+	}
 
+	slot = slot_alloc(vm);
 	if (slot < 0) goto failed;
 
 	ret->slot = slot;
 	ret->valid = 1;
+	ret->flags = flags;
+	ret->guest_paddr = guest_paddr;
+	ret->host_vaddr = host_vaddr;
+	ret->len = len;
 
 	struct kvm_userspace_memory_region region;
 
 	region.slot = ret->slot;
-	region.flags = 0;
+	region.flags = flags;
 	region.guest_phys_addr = guest_paddr;
 	region.userspace_addr = (uint64_t)host_vaddr;
 	region.memory_size = len;
 
 	if (ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
 		perror("KVM_SET_USER_MEMORY_REGION");
+		slot_free(vm, slot);
 		goto failed;
 	}
 
@@ -158,12 +211,12 @@ failed:
 int vm_remap_guest_physical(vm_t *vm, mem_t *mem, void *host_vaddr,
 		addr_t guest_paddr, size_t len) {
 	assert(mem->valid);
-	assert(ACCESS_SLOT(mem->slot));
+	assert(ACCESS_SLOT(vm, mem->slot));
 
 	struct kvm_userspace_memory_region region;
 
 	region.slot = mem->slot;
-	region.flags = 0;
+	region.flags = mem->flags;
 	region.guest_phys_addr = guest_paddr;
 	region.userspace_addr = (uint64_t)host_vaddr;
 	region.memory_size = len;
@@ -173,16 +226,181 @@ int vm_remap_guest_physical(vm_t *vm, mem_t *mem, void *host_vaddr,
 		return 0;
 	}
 
+	mem->guest_paddr = guest_paddr;
+	mem->host_vaddr = host_vaddr;
+	mem->len = len;
+	return 1;
+}
+
+int vm_set_dirty_logging(vm_t *vm, mem_t *mem, int enable)
+{
+	uint32_t old_flags = mem->flags;
+
+	if (enable)
+		mem->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+	else
+		mem->flags &= ~KVM_MEM_LOG_DIRTY_PAGES;
+
+	if (mem->flags == old_flags)
+		return 1;
+
+	if (!vm_remap_guest_physical(vm, mem, mem->host_vaddr,
+				mem->guest_paddr, mem->len)) {
+		mem->flags = old_flags;
+		return 0;
+	}
+
+	return 1;
+}
+
+int vm_get_dirty_log(vm_t *vm, mem_t *mem, uint64_t *bitmap)
+{
+	assert(mem->valid);
+	assert(mem->flags & KVM_MEM_LOG_DIRTY_PAGES);
+
+	struct kvm_dirty_log log = {
+		.slot = mem->slot,
+		.dirty_bitmap = bitmap,
+	};
+
+	if (ioctl(vm->fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+		perror("KVM_GET_DIRTY_LOG");
+		return 0;
+	}
+
+	return 1;
+}
+
+int vm_route_irq(vm_t *vm, uint32_t gsi, uint8_t vector)
+{
+	struct kvm_irqchip chip = {
+		.chip_id = KVM_IRQCHIP_IOAPIC,
+	};
+
+	assert(gsi < KVM_IOAPIC_NUM_PINS);
+
+	if (ioctl(vm->fd, KVM_GET_IRQCHIP, &chip) < 0) {
+		perror("KVM_GET_IRQCHIP");
+		return 0;
+	}
+
+	/* fixed delivery to physical APIC id 0, unmasked */
+	chip.chip.ioapic.redirtbl[gsi].bits = 0;
+	chip.chip.ioapic.redirtbl[gsi].fields.vector = vector;
+
+	if (ioctl(vm->fd, KVM_SET_IRQCHIP, &chip) < 0) {
+		perror("KVM_SET_IRQCHIP");
+		return 0;
+	}
+
+	return 1;
+}
+
+int vm_set_irqfd(vm_t *vm, int fd, uint32_t gsi, int assign)
+{
+	struct kvm_irqfd irqfd = {
+		.fd = fd,
+		.gsi = gsi,
+		.flags = assign ? 0 : KVM_IRQFD_FLAG_DEASSIGN,
+	};
+
+	if (ioctl(vm->fd, KVM_IRQFD, &irqfd) < 0) {
+		perror("KVM_IRQFD");
+		return 0;
+	}
+
+	return 1;
+}
+
+int vm_set_ioeventfd(vm_t *vm, int fd, uint16_t port, uint32_t value,
+		int assign)
+{
+	struct kvm_ioeventfd ioeventfd = {
+		.datamatch = value,
+		.addr = port,
+		.len = 4,
+		.fd = fd,
+		.flags = KVM_IOEVENTFD_FLAG_PIO | KVM_IOEVENTFD_FLAG_DATAMATCH |
+			(assign ? 0 : KVM_IOEVENTFD_FLAG_DEASSIGN),
+	};
+
+	if (ioctl(vm->fd, KVM_IOEVENTFD, &ioeventfd) < 0) {
+		perror("KVM_IOEVENTFD");
+		return 0;
+	}
+
 	return 1;
 }
 
 void vm_unmap_guest_physical(vm_t *vm, mem_t *mem)
 {
 	assert(mem->valid == 1);
-	slot_free(mem->slot);
+
+	/* a zero sized region deletes the slot */
+	struct kvm_userspace_memory_region region = {
+		.slot = mem->slot,
+	};
+
+	if (ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+		perror("KVM_SET_USER_MEMORY_REGION");
+		exit(EXIT_FAILURE);
+	}
+
+	slot_free(vm, mem->slot);
 	free(mem);
 }
 
+uint32_t vm_alloc_pcid(vm_t *vm)
+{
+	uint32_t pcid = 0;
+
+	pthread_mutex_lock(&vm->pcid_lock);
+
+	for (uint32_t i = 0; i < VM_MAX_PCID / 64; i++) {
+		uint64_t available = ~vm->pcid_bitmap[i];
+
+		if (available) {
+			pcid = __builtin_ctzll(available) + 64 * i;
+			vm->pcid_bitmap[i] |= 1ULL << (pcid % 64);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&vm->pcid_lock);
+
+	return pcid;
+}
+
+int vm_reserve_pcid(vm_t *vm, uint32_t pcid)
+{
+	int reserved = 0;
+
+	assert(pcid > 0 && pcid < VM_MAX_PCID);
+
+	pthread_mutex_lock(&vm->pcid_lock);
+
+	if (!(vm->pcid_bitmap[pcid / 64] & (1ULL << (pcid % 64)))) {
+		vm->pcid_bitmap[pcid / 64] |= 1ULL << (pcid % 64);
+		reserved = 1;
+	}
+
+	pthread_mutex_unlock(&vm->pcid_lock);
+
+	return reserved;
+}
+
+void vm_free_pcid(vm_t *vm, uint32_t pcid)
+{
+	assert(pcid > 0 && pcid < VM_MAX_PCID);
+
+	pthread_mutex_lock(&vm->pcid_lock);
+
+	assert(vm->pcid_bitmap[pcid / 64] & (1ULL << (pcid % 64)));
+	vm->pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+
+	pthread_mutex_unlock(&vm->pcid_lock);
+}
+
 static void fill_segment(struct kvm_segment *segment, int selector,
 				int type, int dpl)
 {
@@ -207,24 +425,29 @@ void vcpu_set_segment(vcpu_t *vcpu, enum segment segment, int selector,
 {
 	struct kvm_segment *cur_seg = NULL;
 
+	if (!(vcpu->regs_valid & VCPU_SREGS))
+		vcpu_fetch_regs(vcpu, VCPU_SREGS);
+
+	vcpu->regs_dirty |= VCPU_SREGS;
+
 	switch(segment){
 	case CS:
-		cur_seg = &vcpu->sregs.cs;
+		cur_seg = &vcpu->sregs->cs;
 		break;
 	case DS:
-		cur_seg = &vcpu->sregs.ds;
+		cur_seg = &vcpu->sregs->ds;
 		break;
 	case ES:
-		cur_seg = &vcpu->sregs.es;
+		cur_seg = &vcpu->sregs->es;
 		break;
 	case FS:
-		cur_seg = &vcpu->sregs.fs;
+		cur_seg = &vcpu->sregs->fs;
 		break;
 	case GS:
-		cur_seg = &vcpu->sregs.gs;
+		cur_seg = &vcpu->sregs->gs;
 		break;
 	case SS:
-		cur_seg = &vcpu->sregs.ss;
+		cur_seg = &vcpu->sregs->ss;
 		break;
 	default:
 		assert(0);
@@ -233,43 +456,151 @@ void vcpu_set_segment(vcpu_t *vcpu, enum segment segment, int selector,
 	fill_segment(cur_seg, selector, type, dpl);
 }
 
-static void __vcpu_load_regs(vcpu_t *vcpu)
+static void __vcpu_load_regs(vcpu_t *vcpu, uint32_t which)
 {
-	if (ioctl(vcpu->fd, KVM_GET_SREGS, &vcpu->sregs) < 0) {
+	if ((which & VCPU_SREGS) &&
+		ioctl(vcpu->fd, KVM_GET_SREGS, vcpu->sregs) < 0) {
 		perror("KVM_GET_SREGS");
 		exit(EXIT_FAILURE);
 	}
 
-	if (ioctl(vcpu->fd, KVM_GET_REGS, &vcpu->regs) < 0) {
+	if ((which & VCPU_GPREGS) &&
+		ioctl(vcpu->fd, KVM_GET_REGS, vcpu->regs) < 0) {
 		perror("KVM_GET_REGS");
 		exit(EXIT_FAILURE);
 	}
 
+	vcpu->regs_valid |= which;
 }
 
-static void __vcpu_store_regs(vcpu_t *vcpu)
+static void __vcpu_store_regs(vcpu_t *vcpu, uint32_t which)
 {
-	if (ioctl(vcpu->fd, KVM_SET_SREGS, &vcpu->sregs) < 0) {
+	if ((which & VCPU_SREGS) &&
+		ioctl(vcpu->fd, KVM_SET_SREGS, vcpu->sregs) < 0) {
 		perror("KVM_SET_SREGS");
 		exit(EXIT_FAILURE);
 	}
 
-	if (ioctl(vcpu->fd, KVM_SET_REGS, &vcpu->regs) < 0) {
+	if ((which & VCPU_GPREGS) &&
+		ioctl(vcpu->fd, KVM_SET_REGS, vcpu->regs) < 0) {
 		perror("KVM_SET_REGS");
 		exit(EXIT_FAILURE);
 	}
 
 }
 
+/* translate VCPU_* bits into KVM_SYNC_X86_* bits */
+static inline uint64_t __vcpu_sync_bits(uint32_t which)
+{
+	uint64_t bits = 0;
+
+	if (which & VCPU_GPREGS) bits |= KVM_SYNC_X86_REGS;
+	if (which & VCPU_SREGS) bits |= KVM_SYNC_X86_SREGS;
+
+	return bits;
+}
+
+void vcpu_fetch_regs(vcpu_t *vcpu, uint32_t which)
+{
+	which &= ~vcpu->regs_valid;
+	if (!which) return;
+
+	/* with sync regs everything is valid after an exit,
+	 * so this is only reached on the lazy ioctl path */
+	__vcpu_load_regs(vcpu, which);
+}
+
+void vcpu_use_eager_regs(vcpu_t *vcpu)
+{
+	vcpu_fetch_regs(vcpu, VCPU_ALLREGS);
+
+	vcpu->regs_buf = *vcpu->regs;
+	vcpu->sregs_buf = *vcpu->sregs;
+	vcpu->regs = &vcpu->regs_buf;
+	vcpu->sregs = &vcpu->sregs_buf;
+	vcpu->kvm_run->kvm_valid_regs = 0;
+	vcpu->kvm_run->kvm_dirty_regs = 0;
+	vcpu->sync_regs = 0;
+	vcpu->eager_regs = 1;
+}
+
+/* hand the guest what the host and KVM support,
+ * and note whether that includes PCIDs */
+static void __vcpu_setup_cpuid(vcpu_t *vcpu)
+{
+	struct kvm_cpuid2 *cpuid = NULL;
+	int nent = 64;
+
+	for (;;) {
+		cpuid = realloc(cpuid, sizeof(*cpuid) +
+				nent * sizeof(struct kvm_cpuid_entry2));
+		if (!cpuid) {
+			perror("realloc kvm_cpuid2");
+			exit(EXIT_FAILURE);
+		}
+
+		cpuid->nent = nent;
+		if (ioctl(vcpu->vm->sys_fd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0)
+			break;
+
+		if (errno != E2BIG) {
+			perror("KVM_GET_SUPPORTED_CPUID");
+			exit(EXIT_FAILURE);
+		}
+
+		nent *= 2;
+	}
+
+	if (ioctl(vcpu->fd, KVM_SET_CPUID2, cpuid) < 0) {
+		perror("KVM_SET_CPUID2");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < cpuid->nent; i++)
+		if (cpuid->entries[i].function == 1)
+			vcpu->pcid = !!(cpuid->entries[i].ecx & CPUID_1_ECX_PCID);
+
+	kvm_debug("KVM: pcid = %d\n", vcpu->pcid);
+	free(cpuid);
+}
+
+/* software enable the local APIC in x2APIC mode, so the guest
+ * takes interrupts and acknowledges them with a wrmsr */
+static void __vcpu_setup_apic(vcpu_t *vcpu)
+{
+	struct kvm_lapic_state lapic;
+
+	if (ioctl(vcpu->fd, KVM_GET_LAPIC, &lapic) < 0) {
+		perror("KVM_GET_LAPIC");
+		exit(EXIT_FAILURE);
+	}
+
+	/* spurious interrupts go to vector 0xff */
+	*(uint32_t *)&lapic.regs[APIC_SVR] = APIC_SVR_ENABLE | 0xff;
+
+	if (ioctl(vcpu->fd, KVM_SET_LAPIC, &lapic) < 0) {
+		perror("KVM_SET_LAPIC");
+		exit(EXIT_FAILURE);
+	}
+
+	/* x2APIC needs to be in the guest's CPUID, which KVM always
+	 * supports. the switch happens with the sregs on entry */
+	vcpu->sregs->apic_base = APIC_BASE_DEFAULT | APIC_BASE_ENABLE |
+		APIC_BASE_EXTD | (vcpu->id == 0 ? APIC_BASE_BSP : 0);
+	vcpu->regs_dirty |= VCPU_SREGS;
+}
+
 /* sets up basic execution environment for long mode */
 static void __vcpu_setup_long_mode(vcpu_t *vcpu)
 {
-	//memset(&vcpu->sregs, 0, sizeof(vcpu->sregs));
-	memset(&vcpu->regs, 0, sizeof(vcpu->regs));
+	//memset(vcpu->sregs, 0, sizeof(*vcpu->sregs));
+	memset(vcpu->regs, 0, sizeof(*vcpu->regs));
 
-	vcpu->sregs.cr4 = CR4_PAE;
-	vcpu->sregs.cr0 = CR0_PE | CR0_MP | CR0_ET | CR0_NE | CR0_WP | CR0_AM | CR0_PG;
-	vcpu->sregs.efer = /*EFER_SCE |*/ EFER_LME | EFER_LMA;
+	vcpu->sregs->cr4 = CR4_PAE;
+	if (vcpu->pcid)
+		vcpu->sregs->cr4 |= CR4_PCIDE;
+	vcpu->sregs->cr0 = CR0_PE | CR0_MP | CR0_ET | CR0_NE | CR0_WP | CR0_AM | CR0_PG;
+	vcpu->sregs->efer = /*EFER_SCE |*/ EFER_LME | EFER_LMA;
 
 	/* load the default segment registers
 	 * might be overwritten when GDT is set up */
@@ -281,55 +612,172 @@ static void __vcpu_setup_long_mode(vcpu_t *vcpu)
 	vcpu_set_segment(vcpu, SS, 16, SEGMENT_TYPE_DATA, 0);
 
 	/* bit 1 of rflags is reserved and has to be 1 */
-	vcpu->regs.rflags = 1 << 1;
+	vcpu->regs->rflags = 1 << 1;
+
+	vcpu->regs_dirty |= VCPU_ALLREGS;
 }
 
-vcpu_t *vcpu_init(vm_t *vm)
+vcpu_t *vcpu_init(vm_t *vm, int id)
 {
-	vcpu_t *vcpu = calloc(1, sizeof(vcpu_t));
-	
+	vcpu_t *vcpu;
+
+	/* each vcpu needs a TLB mailbox page of its own */
+	if (id < 0 || id >= TLB_MAILBOX_MAX) {
+		fprintf(stderr, "vcpu id %d out of range\n", id);
+		exit(EXIT_FAILURE);
+	}
+
+	vcpu = calloc(1, sizeof(vcpu_t));
 	if (!vcpu) {
 		perror("calloc vcpu_t");
 		exit(EXIT_FAILURE);
 	}
 
-	vcpu->fd = ioctl(vm->fd, KVM_CREATE_VCPU, 0);
+	/* local APICs, PIC and IOAPIC in the kernel, before any vcpu.
+	 * HLT no longer exits with them, see HYPERCALL_PORT */
+	if (!vm->irqchip) {
+		if (ioctl(vm->fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+			perror("KVM_CREATE_IRQCHIP");
+			exit(EXIT_FAILURE);
+		}
+		vm->irqchip = 1;
+	}
+
+	vcpu->id = id;
+	vcpu->vm = vm;
+	vcpu->fd = ioctl(vm->fd, KVM_CREATE_VCPU, id);
 	if (vcpu->fd < 0) {
 		perror("KVM_CREATE_VCPU");
 		exit(EXIT_FAILURE);
 	}
 
-	vcpu->kvm_run = mmap(NULL, vcpu_mmap_size, PROT_READ | PROT_WRITE,
+	vcpu->kvm_run = mmap(NULL, vm->vcpu_mmap_size, PROT_READ | PROT_WRITE,
 			MAP_SHARED, vcpu->fd, 0);
 	if (vcpu->kvm_run <= 0) {
 		perror("mmap vcpu");
 		exit(EXIT_FAILURE);
 	}
 
-	__vcpu_load_regs(vcpu);
+	int sync_regs = ioctl(vm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+	uint64_t wanted = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS;
+
+	vcpu->sync_regs = sync_regs > 0 && (sync_regs & wanted) == wanted;
+	if (vcpu->sync_regs) {
+		vcpu->regs = &vcpu->kvm_run->s.regs.regs;
+		vcpu->sregs = &vcpu->kvm_run->s.regs.sregs;
+		vcpu->kvm_run->kvm_valid_regs = wanted;
+	} else {
+		vcpu->regs = &vcpu->regs_buf;
+		vcpu->sregs = &vcpu->sregs_buf;
+	}
+	kvm_debug("KVM: sync_regs = %d\n", vcpu->sync_regs);
+
+	__vcpu_setup_cpuid(vcpu);
+
+	/* the sync area is only filled on exits, so fetch once by hand */
+	__vcpu_load_regs(vcpu, VCPU_ALLREGS);
 	__vcpu_setup_long_mode(vcpu);
+	__vcpu_setup_apic(vcpu);
 
 	return vcpu;
 }
 
+void vcpu_reset(vcpu_t *vcpu)
+{
+	vcpu_fetch_regs(vcpu, VCPU_ALLREGS);
+	__vcpu_setup_long_mode(vcpu);
+}
+
+void vcpu_get_regfile(vcpu_t *vcpu, struct kvm_regs *regs,
+			struct kvm_sregs *sregs)
+{
+	vcpu_fetch_regs(vcpu, VCPU_ALLREGS);
+
+	*regs = *vcpu->regs;
+	*sregs = *vcpu->sregs;
+}
+
+void vcpu_set_regfile(vcpu_t *vcpu, const struct kvm_regs *regs,
+			const struct kvm_sregs *sregs)
+{
+	*vcpu->regs = *regs;
+	*vcpu->sregs = *sregs;
+	vcpu->regs_valid = VCPU_ALLREGS;
+	vcpu->regs_dirty = VCPU_ALLREGS;
+}
+
+void vcpu_copy_regs(vcpu_t *dst, vcpu_t *src)
+{
+	vcpu_fetch_regs(src, VCPU_ALLREGS);
+	vcpu_set_regfile(dst, src->regs, src->sregs);
+}
+
+void vcpu_flush_tlb(vcpu_t *vcpu)
+{
+	struct kvm_sregs sregs;
+	int i;
+
+	vcpu_fetch_regs(vcpu, VCPU_SREGS);
+	sregs = *vcpu->sregs;
+
+	/* KVM resets the MMU and flushes the guest's TLB when the
+	 * paging bits of CR4 change, so flip PGE and back */
+	for (i = 0; i < 2; i++) {
+		sregs.cr4 ^= CR4_PGE;
+		if (ioctl(vcpu->fd, KVM_SET_SREGS, &sregs) < 0) {
+			perror("KVM_SET_SREGS");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* what the vcpu has now is what userspace holds */
+	vcpu->regs_dirty &= ~VCPU_SREGS;
+}
+
 enum vcpu_exit_reason vcpu_run(vcpu_t *vcpu)
 {
-	/* sync the userspace register file with the kernel */
-	__vcpu_store_regs(vcpu);
+	/* write back only what was touched since the last exit */
+	if (vcpu->eager_regs)
+		__vcpu_store_regs(vcpu, VCPU_ALLREGS);
+	else if (vcpu->sync_regs)
+		vcpu->kvm_run->kvm_dirty_regs = __vcpu_sync_bits(vcpu->regs_dirty);
+	else
+		__vcpu_store_regs(vcpu, vcpu->regs_dirty);
+
+	vcpu->regs_dirty = 0;
+	vcpu->interrupted = 0;
+
+	int ret = ioctl(vcpu->fd, KVM_RUN, 0);
+
+	/* KVM stores the sync area on every return from KVM_RUN.
+	 * without it, registers are fetched lazily on first access */
+	vcpu->regs_valid = vcpu->sync_regs ? VCPU_ALLREGS : 0;
+	if (vcpu->eager_regs)
+		__vcpu_load_regs(vcpu, VCPU_ALLREGS);
+
+	if (ret < 0) {
+		if (errno == EINTR) {
+			vcpu->interrupted = 1;
+			return VCPU_INTERRUPTED;
+		}
 
-	if (ioctl(vcpu->fd, KVM_RUN, 0) < 0) {
 		perror("KVM_RUN");
 		return VCPU_KVM_RUN_FAILED;
 	}
 
-	__vcpu_load_regs(vcpu);
-
 	uint32_t exit_reason = vcpu->kvm_run->exit_reason;
 	kvm_debug("KVM: exit_reason %d\n", exit_reason);
 	switch (exit_reason) {
-	case KVM_EXIT_HLT:
-		kvm_debug("KVM: hypercall received\n");
-		return VCPU_HYPERCALL;
+	case KVM_EXIT_IO:
+		if (vcpu->kvm_run->io.direction == KVM_EXIT_IO_OUT &&
+			vcpu->kvm_run->io.port == HYPERCALL_PORT) {
+			/* KVM steps over the out itself */
+			kvm_debug("KVM: hypercall received\n");
+			return VCPU_HYPERCALL;
+		}
+
+		kvm_debug("KVM: unhandled port 0x%x\n", vcpu->kvm_run->io.port);
+		return VCPU_UNKNOWN;
 
 	case KVM_EXIT_EXCEPTION:
 		{
@@ -351,6 +799,10 @@ enum vcpu_exit_reason vcpu_run(vcpu_t *vcpu)
 			kvm_debug("Unhandled exception: %d\n", exception_vector);
 			return VCPU_UNKNOWN;
 		}
+	case KVM_EXIT_INTR:
+		vcpu->interrupted = 1;
+		return VCPU_INTERRUPTED;
+
 	case KVM_EXIT_UNKNOWN:
 		{
 			uint64_t hardware_exit_reason =
@@ -374,7 +826,7 @@ enum vcpu_exit_reason vcpu_run(vcpu_t *vcpu)
 
 void vcpu_destroy(vcpu_t *vcpu)
 {
-	if (munmap(vcpu->kvm_run, vcpu_mmap_size) < 0) {
+	if (munmap(vcpu->kvm_run, vcpu->vm->vcpu_mmap_size) < 0) {
 		perror("munmap kvm_run");
 		exit(EXIT_FAILURE);
 	}
@@ -8,6 +8,7 @@ extern "C"
 
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <linux/kvm.h>
 
 #include "archflags.h"
@@ -18,12 +19,35 @@ extern "C"
 #define VCPU_REG(v, r) (*(vcpu_access_gpregs(v, offsetof(struct kvm_regs, r))))
 #define VCPU_SREG(v, r) (*(vcpu_access_sregs(v, offsetof(struct kvm_sregs, r))))
 
+/* the same for reading, the set is not written back on entry */
+#define VCPU_REG_GET(v, r) (*(vcpu_read_gpregs(v, offsetof(struct kvm_regs, r))))
+#define VCPU_SREG_GET(v, r) (*(vcpu_read_sregs(v, offsetof(struct kvm_sregs, r))))
+
+/* number of PCIDs, CR3 has 12 bits for the tag */
+#define VM_MAX_PCID 4096
+
 struct kvm_vm {
 	/* the fd for /dev/kvm */
 	int sys_fd;
 
 	/* the fd for the VM */
 	int fd;
+
+	/* size of the kvm_run area of each vcpu */
+	size_t vcpu_mmap_size;
+
+	/* memory slot accounting, one bit per slot.
+	 * max_slots is a multiple of 64 */
+	pthread_mutex_t slot_lock;
+	uint32_t max_slots;
+	uint64_t *slot_bitmap;
+
+	/* PCID accounting, one bit per tag. 0 is never handed out */
+	pthread_mutex_t pcid_lock;
+	uint64_t pcid_bitmap[VM_MAX_PCID / 64];
+
+	/* set once the in-kernel irqchip exists, see vcpu_init() */
+	int irqchip;
 };
 
 typedef struct kvm_vm vm_t;
@@ -31,24 +55,62 @@ typedef struct kvm_vm vm_t;
 struct kvm_mem_region {
 	uint32_t valid;
 	uint32_t slot;
+	/* KVM_MEM_* flags the slot was registered with */
+	uint32_t flags;
+	/* what the slot maps, to re-register it with other flags */
+	addr_t guest_paddr;
+	void *host_vaddr;
+	size_t len;
 };
 
 typedef struct kvm_mem_region mem_t;
 
+/* register sets tracked by vcpu_t */
+#define VCPU_GPREGS (1U << 0)
+#define VCPU_SREGS (1U << 1)
+#define VCPU_ALLREGS (VCPU_GPREGS | VCPU_SREGS)
+
 struct kvm_vcpu {
+	/* the id passed to KVM_CREATE_VCPU */
+	int id;
+
+	vm_t *vm;
+
 	int fd;
 
 	/* control fields to be mmap'd */
 	struct kvm_run *kvm_run;
 
 	/* control register file.
-	 * they will be loaded on vmexits
-	 * and write back on vmentries */
-	struct kvm_sregs sregs;
+	 * points into kvm_run->s.regs when the host supports
+	 * KVM_CAP_SYNC_REGS, otherwise at sregs_buf */
+	struct kvm_sregs *sregs;
 
 	/* general purpose register file.
 	 * same as above */
-	struct kvm_regs regs;
+	struct kvm_regs *regs;
+
+	/* VCPU_* bits of the register sets that are up to date
+	 * in userspace, and of those written since the last entry */
+	uint32_t regs_valid;
+	uint32_t regs_dirty;
+
+	/* set if the register sets are exchanged through kvm_run */
+	int sync_regs;
+
+	/* set if every register set is fetched and stored around
+	 * each KVM_RUN instead, see vcpu_use_eager_regs() */
+	int eager_regs;
+
+	/* set if the guest sees PCID in CPUID and runs with CR4.PCIDE */
+	int pcid;
+
+	/* set if the last vcpu_run() came back before the guest
+	 * reached an exit of its own, e.g. on a kick */
+	int interrupted;
+
+	struct kvm_sregs sregs_buf;
+	struct kvm_regs regs_buf;
 };
 
 typedef struct kvm_vcpu vcpu_t;
@@ -56,31 +118,115 @@ typedef struct kvm_vcpu vcpu_t;
 /* initialize the vm struct */
 void vm_init(vm_t *vm);
 
+/* release the VM. all vcpus and memory must be gone */
+void vm_destroy(vm_t *vm);
+
 /* for a given VM, map guest physical memory */
 mem_t *vm_map_guest_physical(vm_t *vm, void *host_vaddr,
 				addr_t guest_paddr, size_t len);
 
+/* same, with KVM_MEM_* flags such as KVM_MEM_READONLY */
+mem_t *vm_map_guest_physical_flags(vm_t *vm, void *host_vaddr,
+				addr_t guest_paddr, size_t len, uint32_t flags);
+
 int vm_remap_guest_physical(vm_t *vm, mem_t *mem, void *host_vaddr,
 		addr_t guest_paddr, size_t len);
 
 void vm_unmap_guest_physical(vm_t *vm, mem_t *mem);
 
-/* create a VCPU. It sets up segments, etc. */
-vcpu_t *vcpu_init(vm_t *vm);
+/* turn KVM_MEM_LOG_DIRTY_PAGES on or off for the slot */
+int vm_set_dirty_logging(vm_t *vm, mem_t *mem, int enable);
+
+/* fetch and clear the pages guest writes dirtied since the last call,
+ * one bit per page. bitmap holds (len / PAGE_SIZE + 63) / 64 words */
+int vm_get_dirty_log(vm_t *vm, mem_t *mem, uint64_t *bitmap);
+
+/* deliver IOAPIC pin gsi, edge triggered, as vector to vcpu 0 */
+int vm_route_irq(vm_t *vm, uint32_t gsi, uint8_t vector);
+
+/* raise gsi on each write to the eventfd fd, or stop doing so */
+int vm_set_irqfd(vm_t *vm, int fd, uint32_t gsi, int assign);
+
+/* signal the eventfd fd on a 4 byte out of value to port instead
+ * of exiting to userspace, or stop doing so */
+int vm_set_ioeventfd(vm_t *vm, int fd, uint16_t port, uint32_t value,
+		int assign);
+
+/* a PCID no other user of the VM holds, 0 if they are all taken.
+ * freed tags are handed out again, so a new holder must flush
+ * the tag on every vcpu before relying on it */
+uint32_t vm_alloc_pcid(vm_t *vm);
+
+/* take a particular PCID, e.g. the one a vcpu's CR3 came with
+ * from another VM. 0 if it is held already */
+int vm_reserve_pcid(vm_t *vm, uint32_t pcid);
+
+void vm_free_pcid(vm_t *vm, uint32_t pcid);
+
+/* create a VCPU with the given id. It sets up segments, etc.
+ * the first one also creates the in-kernel irqchip, map the
+ * first memory slot before: one added after it takes ~7 ms */
+vcpu_t *vcpu_init(vm_t *vm, int id);
+
+/* put the vcpu back into the initial long mode state */
+void vcpu_reset(vcpu_t *vcpu);
+
+/* copy the register file of src into dst, e.g. for a cloned VM */
+void vcpu_copy_regs(vcpu_t *dst, vcpu_t *src);
+
+/* read or replace the whole register file */
+void vcpu_get_regfile(vcpu_t *vcpu, struct kvm_regs *regs,
+			struct kvm_sregs *sregs);
+
+void vcpu_set_regfile(vcpu_t *vcpu, const struct kvm_regs *regs,
+			const struct kvm_sregs *sregs);
 
 enum segment {CS, DS, ES, FS, GS, SS};
 
 void vcpu_set_segment(vcpu_t *vcpu, enum segment segment,
 			int selector, int type, int dpl);
 
+/* exchange the whole register file with KVM_GET_* and KVM_SET_*
+ * around every run, as before sync regs and dirty tracking. to
+ * compare against them */
+void vcpu_use_eager_regs(vcpu_t *vcpu);
+
+/* make the given VCPU_* register sets valid in userspace.
+ * only issues ioctls when the host lacks KVM_CAP_SYNC_REGS */
+void vcpu_fetch_regs(vcpu_t *vcpu, uint32_t which);
+
+static inline const uint64_t *vcpu_read_gpregs(vcpu_t *vcpu, size_t offset)
+{
+	if (!(vcpu->regs_valid & VCPU_GPREGS))
+		vcpu_fetch_regs(vcpu, VCPU_GPREGS);
+
+	return (const uint64_t *)(((char *)vcpu->regs) + offset);
+}
+
+static inline const uint64_t *vcpu_read_sregs(vcpu_t *vcpu, size_t offset)
+{
+	if (!(vcpu->regs_valid & VCPU_SREGS))
+		vcpu_fetch_regs(vcpu, VCPU_SREGS);
+
+	return (const uint64_t *)(((char *)vcpu->sregs) + offset);
+}
+
+/* the write accessors hand out writable references,
+ * so the register set is marked dirty on every access */
 static inline uint64_t *vcpu_access_gpregs(vcpu_t *vcpu, size_t offset)
 {
-	return (uint64_t *)(((char *)&vcpu->regs) + offset);
+	const uint64_t *reg = vcpu_read_gpregs(vcpu, offset);
+
+	vcpu->regs_dirty |= VCPU_GPREGS;
+	return (uint64_t *)reg;
 }
 
 static inline uint64_t *vcpu_access_sregs(vcpu_t *vcpu, size_t offset)
 {
-	return (uint64_t *)(((char *)&vcpu->sregs) + offset);
+	const uint64_t *reg = vcpu_read_sregs(vcpu, offset);
+
+	vcpu->regs_dirty |= VCPU_SREGS;
+	return (uint64_t *)reg;
 }
 
 enum vcpu_exit_reason {
@@ -89,12 +235,18 @@ enum vcpu_exit_reason {
 	VCPU_UD,
 	VCPU_GP,
 	VCPU_KVM_RUN_FAILED,
+	/* KVM_RUN was interrupted by a signal or immediate_exit */
+	VCPU_INTERRUPTED,
 	VCPU_UNKNOWN
 };
 
 /* run a vcpu until exit */
 enum vcpu_exit_reason vcpu_run(vcpu_t *cpu);
 
+/* drop the vcpu's whole TLB, every PCID, from the host. for
+ * a vcpu stopped wherever it was rather than in the kernel */
+void vcpu_flush_tlb(vcpu_t *vcpu);
+
 void vcpu_destroy(vcpu_t *vcpu);
 #ifdef __cplusplus
 }
@@ -12,7 +12,8 @@ int main(int argc, char **argv)
 	vm_t vm;
 	vm_init(&vm);
 	
-	MemoryPool memoryPool(&vm, 0x0, 1 << 30);
+	MemoryPool memoryPool(&vm, 0x0, 2 << 20,
+		DefaultHostMemoryMapper::instance, 1 << 30);
 
 	std::deque<addr_t> addrs;
 
@@ -26,7 +27,7 @@ int main(int argc, char **argv)
 		memoryPool.getPhysicalMemoryBlock(PAGE_SIZE * 2);
 
 
-	vcpu_t *vcpu = vcpu_init(&vm);
+	vcpu_t *vcpu = vcpu_init(&vm, 0);
 
 	VCPU_REG(vcpu, rax) = 1000;
 
@@ -1,12 +1,104 @@
 #include "memory.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <linux/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 #include "kvm.h"
+#include "abi.h"
+#include "compress.hpp"
 #include "archflags.h"
 #include "log.hpp"
 
 DefaultHostMemoryMapper DefaultHostMemoryMapper::instance;
 
+static_assert(sizeof(PageTableEntry) == sizeof(uint64_t),
+		"page table entries are accessed as one word");
+static_assert(TLB_MAILBOX_BASE + TLB_MAILBOX_MAX * PAGE_SIZE <=
+		KERNEL_STACK_TOP - KERNEL_STACK_SIZE,
+		"the TLB mailboxes stay clear of the kernel stack");
+
+/* page table entries may be read by one vcpu thread while another
+ * fills them in, so they are only ever accessed as a whole */
+static inline PageTableEntry loadEntry(const PageTableEntry *entry)
+{
+	uint64_t raw = __atomic_load_n(
+		reinterpret_cast<const uint64_t *>(entry), __ATOMIC_ACQUIRE);
+	PageTableEntry value;
+
+	memcpy(&value, &raw, sizeof(raw));
+	return value;
+}
+
+static inline void storeEntry(PageTableEntry *entry, PageTableEntry value)
+{
+	uint64_t raw;
+
+	memcpy(&raw, &value, sizeof(raw));
+	__atomic_store_n(reinterpret_cast<uint64_t *>(entry), raw,
+		__ATOMIC_RELEASE);
+}
+
+/* the guest may set the dirty bit meanwhile, so only the
+ * accessed bit is cleared. true if it was set */
+static inline bool clearAccessed(PageTableEntry *entry)
+{
+	PageTableEntry value = loadEntry(entry);
+	uint64_t raw;
+
+	memcpy(&raw, &value, sizeof(raw));
+	if (!(raw & PDE64_ACCESSED))
+		return false;
+
+	return __atomic_fetch_and(reinterpret_cast<uint64_t *>(entry),
+			~(uint64_t)PDE64_ACCESSED, __ATOMIC_ACQ_REL) &
+		PDE64_ACCESSED;
+}
+
+FrameIndex AbstractMemoryPool::claimFrame(addr_t guestPhysical,
+		FrameOwner owner, uint16_t flags)
+{
+	FrameIndex index = getFrameIndex(guestPhysical);
+	PageFrame &frame = getFrame(index);
+
+	frame.refcount = 1;
+	frame.flags = flags;
+	frame.owner = owner;
+
+	return index;
+}
+
+void AbstractMemoryPool::releaseFrame(FrameIndex index, size_t len)
+{
+	PageFrame &frame = getFrame(index);
+
+	if (!frame.refcount) {
+		console->error("Frame {} released twice", index);
+		std::abort();
+	}
+
+	if (--frame.refcount) return;
+
+	frame.flags = 0;
+	frame.owner = FRAME_FREE;
+	freePhysicalMemoryBlock(getFramePhysical(index), len);
+}
+
+void AbstractHostMemoryMapper::scrub(void *hostVirtual, size_t len)
+{
+	/* private anonymous memory reads back as zero after this */
+	if (madvise(hostVirtual, len, MADV_DONTNEED) < 0) {
+		console->error("Cannot scrub memory, length = {}", len);
+		std::abort();
+	}
+}
+
 void *DefaultHostMemoryMapper::operator()(size_t len)
 {
 	void *hostVirtualAddr = mmap(NULL, len, PROT_READ | PROT_WRITE,
@@ -20,42 +112,297 @@ void *DefaultHostMemoryMapper::operator()(size_t len)
 	return hostVirtualAddr;
 }
 
-MemoryPool::MemoryPool(vm_t *_vm, addr_t _physBase, size_t _size, Mapper &mapper)
-	: vm(_vm), size(_size), physBase(_physBase)
+void DefaultHostMemoryMapper::release(void *hostVirtual, size_t len)
+{
+	if (munmap(hostVirtual, len) < 0)
+		console->warn("Cannot munmap memory, length = {}", len);
+}
+
+HugePageHostMemoryMapper HugePageHostMemoryMapper::instance;
+
+void *HugePageHostMemoryMapper::operator()(size_t len)
+{
+	len = alignUp(len, PAGE_SIZE_2M);
+
+	/* address space only, commit() backs it chunk by chunk.
+	 * over-map so that the range can be trimmed to 2 MiB alignment */
+	char *raw = (char *)mmap(NULL, len + PAGE_SIZE_2M, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (raw == MAP_FAILED) {
+		console->error("Cannot reserve memory, length = {}", len);
+		return nullptr;
+	}
+
+	char *aligned = (char *)alignUp((addr_t)raw, PAGE_SIZE_2M);
+	size_t head = aligned - raw;
+
+	if (head) munmap(raw, head);
+	munmap(aligned + len, PAGE_SIZE_2M - head);
+
+	return aligned;
+}
+
+bool HugePageHostMemoryMapper::commit(void *hostVirtual, size_t len)
+{
+	/* the granule the last commit ended in is backed already */
+	char *start = (char *)alignUp((addr_t)hostVirtual, PAGE_SIZE_2M);
+	char *end = (char *)alignUp((addr_t)hostVirtual + len, PAGE_SIZE_2M);
+
+	if (start >= end) return true;
+	len = end - start;
+
+	/* no MAP_NORESERVE here: the chunk should fail up front
+	 * rather than SIGBUS once the hugetlb pool runs dry */
+	void *addr = mmap(start, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB |
+		MAP_FIXED, -1, 0);
+
+	if (addr != MAP_FAILED)
+		return true;
+
+	console->debug("No hugetlb pages for length {}, using THP", len);
+
+	addr = mmap(start, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+	if (addr == MAP_FAILED) {
+		console->error("Cannot mmap memory, length = {}", len);
+		return false;
+	}
+
+	if (madvise(addr, len, MADV_HUGEPAGE) < 0)
+		console->warn("madvise(MADV_HUGEPAGE) failed, length = {}", len);
+
+	return true;
+}
+
+void HugePageHostMemoryMapper::release(void *hostVirtual, size_t len)
+{
+	if (munmap(hostVirtual, alignUp(len, PAGE_SIZE_2M)) < 0)
+		console->warn("Cannot munmap memory, length = {}", len);
+}
+
+void *MemfdHostMemoryMapper::operator()(size_t len)
+{
+	if (fd >= 0) {
+		console->error("memfd mapper is already in use");
+		std::abort();
+	}
+
+	fd = memfd_create("lightvirt", MFD_CLOEXEC);
+	if (fd < 0) {
+		console->error("Cannot create memfd");
+		return nullptr;
+	}
+
+	void *hostVirtualAddr = MAP_FAILED;
+
+	if (ftruncate(fd, len) < 0)
+		console->error("Cannot resize memfd, length = {}", len);
+	else if ((hostVirtualAddr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0)) == MAP_FAILED)
+		console->error("Cannot mmap memfd, length = {}", len);
+
+	/* the mapper can be used again */
+	if (hostVirtualAddr == MAP_FAILED) {
+		close(fd);
+		fd = -1;
+		return nullptr;
+	}
+
+	return hostVirtualAddr;
+}
+
+void MemfdHostMemoryMapper::release(void *hostVirtual, size_t len)
+{
+	if (munmap(hostVirtual, len) < 0)
+		console->warn("Cannot munmap memory, length = {}", len);
+
+	close(fd);
+	fd = -1;
+}
+
+void MemfdHostMemoryMapper::scrub(void *hostVirtual, size_t len)
+{
+	/* MADV_DONTNEED keeps shared memory, punch the file instead */
+	if (madvise(hostVirtual, len, MADV_REMOVE) < 0) {
+		console->error("Cannot scrub memfd, length = {}", len);
+		std::abort();
+	}
+}
+
+void *PrivateFileHostMemoryMapper::operator()(size_t len)
+{
+	void *hostVirtualAddr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_NORESERVE, fd, offset);
+
+	if (hostVirtualAddr == MAP_FAILED) {
+		console->error("Cannot mmap file privately, length = {}", len);
+		return nullptr;
+	}
+
+	return hostVirtualAddr;
+}
+
+void PrivateFileHostMemoryMapper::release(void *hostVirtual, size_t len)
+{
+	if (munmap(hostVirtual, len) < 0)
+		console->warn("Cannot munmap memory, length = {}", len);
+}
+
+void PrivateFileHostMemoryMapper::scrub(void *hostVirtual, size_t len)
+{
+	/* dropping private copies would bring the file back,
+	 * so replace the range with zeroed anonymous memory */
+	void *addr = mmap(hostVirtual, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+	if (addr == MAP_FAILED) {
+		console->error("Cannot scrub file mapping, length = {}", len);
+		std::abort();
+	}
+}
+
+MemoryPool::MemoryPool(vm_t *_vm, addr_t _physBase, size_t _size,
+		Mapper &_mapper, size_t _maxSize)
+	: vm(_vm), mapper(_mapper), size(0),
+	maxSize(std::max(_size, _maxSize)), physBase(_physBase),
+	queuedBytes(0), lowWater(4 << 20), highWater(16 << 20),
+	reclaimScheduled(false), reclaimerUsed(false), reclaimedBytes(0),
+	dirtyLogging(false)
+{
+	virtBase = mapper(maxSize);
+	if (!virtBase || !mapper.commit(virtBase, _size)) std::abort();
+
+	if (maxSize / PAGE_SIZE >= NO_FRAME) {
+		console->error("Pool of {} bytes is too large", maxSize);
+		std::abort();
+	}
+
+	frames = static_cast<PageFrame *>(
+			calloc(maxSize / PAGE_SIZE, sizeof(PageFrame)));
+	if (!frames) {
+		console->error("Cannot allocate the frame table");
+		std::abort();
+	}
+
+	mem_t *mem = vm_map_guest_physical(vm, virtBase, physBase, _size);
+	if (!mem) {
+		console->error("Cannot map physical memory, exit");
+		std::abort();
+	}
+
+	chunks.push_back(mem);
+	size = _size;
+}
+
+MemoryPool::MemoryPool(vm_t *_vm, MemoryPool &other, Mapper &_mapper)
+	: MemoryPool(_vm, other.physBase, other.size, _mapper, other.maxSize)
+{
+	std::lock_guard<std::recursive_mutex> guard(other.lock);
+
+	blocks = other.blocks;
+	copyFrames(other);
+}
+
+void MemoryPool::copyFrames(const MemoryPool &other)
 {
-	virtBase = mapper(size);
-	if (!virtBase) std::abort();
+	memcpy(frames, other.frames, size / PAGE_SIZE * sizeof(PageFrame));
+}
+
+std::unique_ptr<MemoryPool> MemoryPool::clone(vm_t *_vm, Mapper &_mapper)
+{
+	return std::unique_ptr<MemoryPool>(new MemoryPool(_vm, *this, _mapper));
+}
+
+MemoryPool::~MemoryPool()
+{
+	if (reclaimerUsed)
+		MemoryReclaimer::instance().cancel(this);
+
+	for (mem_t *mem : chunks)
+		vm_unmap_guest_physical(vm, mem);
+	mapper.release(virtBase, maxSize);
+	free(frames);
+}
+
+bool MemoryPool::grow(size_t minSize)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (minSize > maxSize) return false;
+	if (minSize <= size) return true;
+
+	/* doubling keeps the number of slots logarithmic */
+	size_t newSize = std::max(minSize, size * 2);
+	newSize = std::min<size_t>(alignUp(newSize, mapper.granularity()),
+			maxSize);
+
+	addr_t start = physBase + size;
+	size_t len = newSize - size;
+
+	if (!mapper.commit((char *)virtBase + size, len)) {
+		console->error("Cannot back physical memory, exit");
+		std::abort();
+	}
 
-	mem = vm_map_guest_physical(vm, virtBase, physBase, size);
+	mem_t *mem = vm_map_guest_physical_flags(vm, (char *)virtBase + size,
+			start, len, dirtyLogging ? KVM_MEM_LOG_DIRTY_PAGES : 0);
 	if (!mem) {
 		console->error("Cannot map physical memory, exit");
 		std::abort();
 	}
+
+	chunks.push_back(mem);
+	size.store(newSize, std::memory_order_release);
+	addChunk(start, len);
+
+	console->debug("Memory pool grown to {} bytes, {} slots", newSize,
+			chunks.size());
+	return true;
 }
 
 addr_t MemoryPool::getPhysicalMemoryBlock(size_t len)
+{
+	return getAlignedPhysicalMemoryBlock(len, 1);
+}
+
+addr_t MemoryPool::getAlignedPhysicalMemoryBlock(size_t len, size_t align)
 {
 	std::lock_guard<std::recursive_mutex> guard(lock);
 
 	addr_t lastEnd = physBase;
+	addr_t start = alignUp(lastEnd, align);
 	auto blk = blocks.begin();
 
 	for (; blk != blocks.end(); blk++) {
-		if (blk->guestPhysical - lastEnd >= len) break;
+		if (blk->guestPhysical >= start &&
+			blk->guestPhysical - start >= len) break;
 		lastEnd = blk->guestPhysical + blk->len;
+		start = alignUp(lastEnd, align);
 	}
 
-	if (blk == blocks.begin()) {
-		/* create a new block in the beginning */
-		blocks.emplace_hint(blk, lastEnd, len);
+	if (start + len > physBase + size &&
+		!grow(start + len - physBase)) {
+		console->error("Out of physical memory, size = {}", len);
+		std::abort();
+	}
+
+	if (blk == blocks.begin() || start != lastEnd) {
+		/* create a new block in the gap */
+		blocks.emplace_hint(blk, start, len);
 	} else {
 		/* extend the previous block */
 		auto prev = std::prev(blk);
 		prev->len += len;
 	}
 
-	console->trace("Allocate physical block addr = 0x{:x}, size = {}", lastEnd, len);
-	return lastEnd;
+	unqueueReclaim(start, len);
+	markDirty(start, len);
+
+	console->trace("Allocate physical block addr = 0x{:x}, size = {}", start, len);
+	return start;
 }
 
 auto MemoryPool::getBlockIterator(addr_t addr, size_t len)
@@ -109,12 +456,14 @@ void MemoryPool::freePhysicalMemoryBlock(addr_t addr, size_t len)
 		blocks.emplace(addr + len,
 			temp.guestPhysical + temp.len - addr - len);
 	}
+
+	queueReclaim(addr, len);
 }
 
 void *MemoryPool::getHostVirtualFromPhysical(addr_t addr) const
 {
 	uint64_t offset = addr - physBase;
-	if (offset < 0 || offset >= size) {
+	if (offset >= size.load(std::memory_order_acquire)) {
 		console->error("Physical address 0x{:x} out of bound",
 				addr);
 		std::abort();
@@ -126,7 +475,7 @@ void *MemoryPool::getHostVirtualFromPhysical(addr_t addr) const
 addr_t MemoryPool::getPhysicalFromHostVirtual(void *hostVirtual) const
 {
 	uintptr_t offset = (char *)hostVirtual - (char *)virtBase;
-	if (offset < 0 || offset >= size) {
+	if (offset >= size.load(std::memory_order_acquire)) {
 		console->error("Physical address 0x{:x} out of bound",
 				(uintptr_t)hostVirtual);
 		std::abort();
@@ -135,72 +484,1933 @@ addr_t MemoryPool::getPhysicalFromHostVirtual(void *hostVirtual) const
 	return physBase + offset;
 }
 
-MemoryRegion::MemoryRegion(addr_t guestVirt, size_t _len)
-	: guestVirtualAddr(guestVirt), len(_len), isKernel(false)
+FrameIndex MemoryPool::getFrameIndex(addr_t guestPhysical) const
 {
+	if (guestPhysical < physBase ||
+		guestPhysical - physBase >= size.load(std::memory_order_acquire)) {
+		console->error("Physical address 0x{:x} out of bound",
+				guestPhysical);
+		std::abort();
+	}
 
-	checkPageMultiple(len);
-	size_t nPages = len / PAGE_SIZE;
-	physicalPages.resize(nPages);
+	return (guestPhysical - physBase) / PAGE_SIZE;
 }
 
-MemorySpace::MemorySpace(AbstractMemoryPool *_memoryPool)
-	: memoryPool(_memoryPool)
+addr_t MemoryPool::getFramePhysical(FrameIndex frame) const
 {
-	pageTableP = memoryPool->getPhysicalMemoryBlock(PAGE_SIZE);
-	pageTableV = memoryPool->getHostVirtualFromPhysical(pageTableP);
-	pageTablePages.emplace_back(pageTableP, pageTableV);
+	return physBase + (addr_t)frame * PAGE_SIZE;
 }
 
-bool MemorySpace::fault(addr_t guestVirtualPage, uint32_t errorcode)
+PageFrame &MemoryPool::getFrame(FrameIndex frame)
+{
+	return frames[frame];
+}
+
+void MemoryPool::getPhysicalPages(addr_t *pages, size_t n)
 {
 	std::lock_guard<std::recursive_mutex> guard(lock);
 
-	auto region = regions.upper_bound(guestVirtualPage);
-	if (region == regions.begin()) {
-		console->warn("Unresolved page fault at 0x{:x}",
-				guestVirtualPage);
-		return false;
+	for (size_t i = 0; i < n; i++)
+		pages[i] = getPhysicalMemoryBlock(PAGE_SIZE);
+}
+
+void MemoryPool::freePhysicalPages(const addr_t *pages, size_t n)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	for (size_t i = 0; i < n; i++)
+		freePhysicalMemoryBlock(pages[i], PAGE_SIZE);
+}
+
+void MemoryPool::reset()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!mapper.canScrub()) {
+		console->error("Cannot reset a pool with clones");
+		std::abort();
 	}
 
-	region--;
-	
-	std::lock_guard regionGuard = std::lock_guard((*region)->lock);
+	blocks.clear();
+	mapper.scrub(virtBase, size);
+	markDirty(physBase, size);
+	memset(frames, 0, size / PAGE_SIZE * sizeof(PageFrame));
 
+	clearReclaimQueue();
 }
 
+void MemoryPool::saveState(std::vector<uint64_t> &state)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	for (auto &blk : blocks) {
+		state.push_back(blk.guestPhysical);
+		state.push_back(blk.len);
+	}
+}
 
-PageTableEntry *MemorySpace::getPTE(addr_t guestVirtual, bool create)
+void MemoryPool::loadState(const std::vector<uint64_t> &state)
 {
 	std::lock_guard<std::recursive_mutex> guard(lock);
 
-	auto *cur = castGuestPhysical<PageTableEntry>(guestVirtual);
-	uint64_t nBits = 39;
+	blocks.clear();
+	for (size_t i = 0; i + 1 < state.size(); i += 2)
+		blocks.emplace(state[i], state[i + 1]);
 
-	while ((1ULL << nBits) >= PAGE_SIZE) {
-		uint64_t index = (guestVirtual >> nBits) & 0b111111111;
+	clearReclaimQueue();
+}
 
-		if ((1ULL << nBits) == PAGE_SIZE)
-			return &cur[index];
+size_t MemoryPool::residentPages() const
+{
+	size_t nPages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	std::vector<unsigned char> vec(nPages);
 
-		nBits -= 9;
-		PageTableEntry &entry = cur[index]; 
-		if (!entry.present) {
-			if (!create) return nullptr;
+	if (mincore(virtBase, size, vec.data()) < 0) {
+		console->warn("mincore failed on memory pool");
+		return 0;
+	}
+
+	size_t resident = 0;
+	for (auto v : vec) resident += v & 1;
+	return resident;
+}
+
+void MemoryPool::queueReclaim(addr_t addr, size_t len)
+{
+	addr_t end = addr + len;
+
+	queuedBytes += len;
+
+	/* merge with the neighbours */
+	auto next = reclaimQueue.lower_bound(addr);
+	if (next != reclaimQueue.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == addr) {
+			addr = prev->first;
+			reclaimQueue.erase(prev);
+		}
+	}
+
+	if (next != reclaimQueue.end() && next->first == end) {
+		end += next->second;
+		reclaimQueue.erase(next);
+	}
+
+	reclaimQueue[addr] = end - addr;
+
+	if (queuedBytes > highWater && !reclaimScheduled) {
+		reclaimScheduled = true;
+		reclaimerUsed = true;
+		MemoryReclaimer::instance().schedule(this);
+	}
+}
+
+void MemoryPool::clearReclaimQueue()
+{
+	reclaimQueue.clear();
+	queuedBytes = 0;
+}
+
+void MemoryPool::unqueueReclaim(addr_t addr, size_t len)
+{
+	if (reclaimQueue.empty()) return;
+
+	addr_t end = addr + len;
+	auto it = reclaimQueue.upper_bound(addr);
+	if (it != reclaimQueue.begin()) it--;
+
+	while (it != reclaimQueue.end() && it->first < end) {
+		addr_t start = it->first;
+		addr_t stop = start + it->second;
+
+		if (stop <= addr) {
+			it++;
+			continue;
+		}
+
+		it = reclaimQueue.erase(it);
+		queuedBytes -= stop - start;
+
+		/* keep what lies outside the allocation */
+		if (start < addr) {
+			reclaimQueue.emplace(start, addr - start);
+			queuedBytes += addr - start;
+		}
+		if (stop > end) {
+			it = reclaimQueue.emplace(end, stop - end).first;
+			queuedBytes += stop - end;
+		}
+	}
+}
+
+void MemoryPool::setReclaimThresholds(size_t _lowWater, size_t _highWater)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (_lowWater > _highWater) {
+		console->error("Reclaim low water {} above high water {}",
+				_lowWater, _highWater);
+		std::abort();
+	}
+
+	lowWater = _lowWater;
+	highWater = _highWater;
+}
+
+void MemoryPool::reclaim()
+{
+	/* at most this much per lock hold, allocations go in between */
+	constexpr size_t batch = 2 << 20;
+
+	std::unique_lock<std::recursive_mutex> guard(lock);
+	size_t granule = mapper.granularity();
 
-			/* allocate a new page */
-			addr_t newPage =
-				memoryPool->getPhysicalMemoryBlock(PAGETABLE_SIZE);
-			entry = DEFAULT_PTE;
-			entry.address = newPage / PAGETABLE_SIZE;
-			cur = castGuestPhysical<PageTableEntry>(newPage);
+	reclaimScheduled = false;
 
-			pageTablePages.emplace_back(newPage, cur);
+	while (queuedBytes > lowWater && !reclaimQueue.empty()) {
+		auto last = std::prev(reclaimQueue.end());
+		addr_t start = last->first;
+		size_t len = last->second;
+
+		if (len > batch) {
+			last->second -= batch;
+			start += len - batch;
+			len = batch;
 		} else {
-			cur = castGuestPhysical<PageTableEntry>(entry.address * PAGETABLE_SIZE);
+			reclaimQueue.erase(last);
+		}
+		queuedBytes -= len;
+
+		/* partial granules stay resident, and all of
+		 * it while clones map the memory */
+		addr_t from = alignUp(start, granule);
+		addr_t to = (start + len) / granule * granule;
+		if (from < to && mapper.canScrub()) {
+			mapper.scrub(getHostVirtualFromPhysical(from), to - from);
+			reclaimedBytes += to - from;
 		}
+
+		guard.unlock();
+		guard.lock();
+	}
+}
+
+bool MemoryPool::balloon(addr_t guestPhysical, size_t len)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!len || !mapper.canScrub() ||
+		guestPhysical % mapper.granularity() ||
+		len % mapper.granularity() || guestPhysical < physBase ||
+		guestPhysical - physBase > size ||
+		len > size - (guestPhysical - physBase))
+		return false;
+
+	/* never page tables or anything else the host set up */
+	for (addr_t addr = guestPhysical; addr < guestPhysical + len;
+			addr += PAGE_SIZE) {
+		PageFrame &frame = frames[getFrameIndex(addr)];
+
+		if (frame.owner != FRAME_REGION || frame.flags & FRAME_LARGE)
+			return false;
+	}
+
+	mapper.scrub(getHostVirtualFromPhysical(guestPhysical), len);
+	markDirty(guestPhysical, len);
+	reclaimedBytes += len;
+	return true;
+}
+
+void MemoryPool::startDirtyLog()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (dirtyLogging) return;
+
+	for (mem_t *mem : chunks) {
+		if (!vm_set_dirty_logging(vm, mem, 1)) {
+			console->error("Cannot log dirty pages of slot {}",
+					mem->slot);
+			std::abort();
+		}
+	}
+
+	hostDirty.assign((maxSize / PAGE_SIZE + 63) / 64, 0);
+	dirtyLogging = true;
+}
+
+void MemoryPool::stopDirtyLog()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!dirtyLogging) return;
+
+	for (mem_t *mem : chunks) {
+		if (!vm_set_dirty_logging(vm, mem, 0)) {
+			console->error("Cannot stop logging slot {}", mem->slot);
+			std::abort();
+		}
+	}
+
+	dirtyLogging = false;
+	DirtyBitmap().swap(hostDirty);
+}
+
+void MemoryPool::fetchDirtyLog(DirtyBitmap &bitmap)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!dirtyLogging) {
+		console->error("Dirty pages are not being logged");
+		std::abort();
+	}
+
+	bitmap.assign((size / PAGE_SIZE + 63) / 64, 0);
+
+	DirtyBitmap slotBitmap;
+	for (mem_t *mem : chunks) {
+		slotBitmap.assign((mem->len / PAGE_SIZE + 63) / 64, 0);
+		if (!vm_get_dirty_log(vm, mem, slotBitmap.data())) {
+			console->error("Cannot get dirty log of slot {}",
+					mem->slot);
+			std::abort();
+		}
+
+		/* chunks need not start on a word of the pool's bitmap */
+		size_t first = (mem->guest_paddr - physBase) / PAGE_SIZE;
+		for (size_t i = 0; i < slotBitmap.size(); i++) {
+			for (uint64_t word = slotBitmap[i]; word; word &= word - 1) {
+				size_t page = first + i * 64 + __builtin_ctzll(word);
+				bitmap[page / 64] |= 1ULL << (page % 64);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < bitmap.size(); i++) {
+		bitmap[i] |= hostDirty[i];
+		hostDirty[i] = 0;
+	}
+}
+
+void MemoryPool::markDirty(addr_t guestPhysical, size_t len)
+{
+	/* cheap enough for every allocation when nobody is logging */
+	if (!dirtyLogging || !len) return;
+
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (hostDirty.empty()) return;
+
+	size_t first = (guestPhysical - physBase) / PAGE_SIZE;
+	size_t last = (guestPhysical - physBase + len - 1) / PAGE_SIZE;
+	for (size_t page = first; page <= last; page++)
+		hostDirty[page / 64] |= 1ULL << (page % 64);
+}
+
+MemoryPool::ReclaimStats MemoryPool::getReclaimStats()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	return ReclaimStats{queuedBytes, reclaimedBytes};
+}
+
+MemoryReclaimer &MemoryReclaimer::instance()
+{
+	static MemoryReclaimer reclaimer;
+
+	return reclaimer;
+}
+
+MemoryReclaimer::MemoryReclaimer()
+	: busy(nullptr), stopping(false)
+{
+	thread = std::thread(&MemoryReclaimer::run, this);
+}
+
+MemoryReclaimer::~MemoryReclaimer()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	thread.join();
+}
+
+void MemoryReclaimer::schedule(MemoryPool *pool)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		pending.push_back(pool);
+	}
+	cond.notify_all();
+}
+
+void MemoryReclaimer::cancel(MemoryPool *pool)
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	pending.erase(std::remove(pending.begin(), pending.end(), pool),
+			pending.end());
+	cond.wait(guard, [&] { return busy != pool; });
+}
+
+void MemoryReclaimer::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	for (;;) {
+		cond.wait(guard, [&] { return stopping || !pending.empty(); });
+		if (stopping) break;
+
+		busy = pending.front();
+		pending.pop_front();
+		guard.unlock();
+
+		busy->reclaim();
+
+		guard.lock();
+		busy = nullptr;
+		cond.notify_all();
+	}
+}
+
+WorkingSetScanner &WorkingSetScanner::instance()
+{
+	static WorkingSetScanner scanner;
+
+	return scanner;
+}
+
+WorkingSetScanner::WorkingSetScanner()
+	: busy(nullptr), interval(1000), restart(false), stopping(false)
+{
+	thread = std::thread(&WorkingSetScanner::run, this);
+}
+
+WorkingSetScanner::~WorkingSetScanner()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	thread.join();
+}
+
+void WorkingSetScanner::add(MemorySpace *space)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	spaces.push_back(space);
+}
+
+void WorkingSetScanner::remove(MemorySpace *space)
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	spaces.erase(std::remove(spaces.begin(), spaces.end(), space),
+			spaces.end());
+	cond.wait(guard, [&] { return busy != space; });
+}
+
+void WorkingSetScanner::setInterval(std::chrono::milliseconds _interval)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		interval = _interval;
+		restart = true;
+	}
+	cond.notify_all();
+}
+
+void WorkingSetScanner::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	for (;;) {
+		cond.wait_for(guard, interval,
+			[&] { return stopping || restart; });
+		if (stopping) break;
+
+		if (restart) {
+			restart = false;
+			continue;
+		}
+
+		/* spaces may come and go while the lock is dropped */
+		std::vector<MemorySpace *> round(spaces);
+
+		for (MemorySpace *space : round) {
+			if (stopping) break;
+			if (std::find(spaces.begin(), spaces.end(), space) ==
+				spaces.end()) continue;
+
+			busy = space;
+			guard.unlock();
+
+			space->scanAccessed();
+
+			guard.lock();
+			busy = nullptr;
+			cond.notify_all();
+		}
+	}
+}
+
+BuddyMemoryPool::BuddyMemoryPool(vm_t *_vm, addr_t _physBase, size_t _size,
+		Mapper &_mapper, size_t _maxSize)
+	: MemoryPool(_vm, _physBase, _size, _mapper, _maxSize)
+{
+	addFreeRange(physBase, size);
+}
+
+BuddyMemoryPool::BuddyMemoryPool(vm_t *_vm, BuddyMemoryPool &other,
+		Mapper &_mapper)
+	: MemoryPool(_vm, other.physBase, other.size, _mapper, other.maxSize)
+{
+	std::lock_guard<std::recursive_mutex> guard(other.lock);
+
+	freeLists = other.freeLists;
+	copyFrames(other);
+}
+
+std::unique_ptr<MemoryPool> BuddyMemoryPool::clone(vm_t *_vm, Mapper &_mapper)
+{
+	return std::unique_ptr<MemoryPool>(
+			new BuddyMemoryPool(_vm, *this, _mapper));
+}
+
+void BuddyMemoryPool::saveState(std::vector<uint64_t> &state)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	for (unsigned order = 0; order <= maxOrder; order++) {
+		for (addr_t addr : freeLists[order]) {
+			state.push_back(addr);
+			state.push_back(order);
+		}
+	}
+
+	/* the allocated blocks too, so that they can be freed */
+	for (FrameIndex i = 0; i < size / PAGE_SIZE; i++) {
+		if (!frames[i].order) continue;
+
+		state.push_back(getFramePhysical(i));
+		state.push_back(frames[i].order | allocatedBlock);
+	}
+}
+
+void BuddyMemoryPool::loadState(const std::vector<uint64_t> &state)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	for (auto &freeList : freeLists)
+		freeList.clear();
+	for (FrameIndex i = 0; i < size / PAGE_SIZE; i++)
+		frames[i].order = 0;
+
+	clearReclaimQueue();
+
+	for (size_t i = 0; i + 1 < state.size(); i += 2) {
+		unsigned order = state[i + 1] & ~allocatedBlock;
+
+		if (order < minOrder || order > maxOrder) {
+			console->error("Bad buddy order {} in saved state",
+					order);
+			std::abort();
+		}
+
+		if (state[i + 1] & allocatedBlock)
+			frames[getFrameIndex(state[i])].order = order;
+		else
+			freeLists[order].insert(state[i]);
+	}
+}
+
+unsigned BuddyMemoryPool::orderOf(size_t len)
+{
+	unsigned order = minOrder;
+
+	while ((1ULL << order) < len) order++;
+	return order;
+}
+
+void BuddyMemoryPool::addFreeRange(addr_t start, size_t len)
+{
+	addr_t end = start + len;
+
+	/* carve the range into the largest naturally aligned blocks */
+	while (start < end) {
+		unsigned order = maxOrder;
+
+		while (order > minOrder &&
+			((start & ((1ULL << order) - 1)) ||
+			 start + (1ULL << order) > end))
+			order--;
+
+		freeLists[order].insert(start);
+		start += 1ULL << order;
+	}
+}
+
+addr_t BuddyMemoryPool::allocateOrder(unsigned order, unsigned alignOrder)
+{
+	unsigned cur = std::max(order, alignOrder);
+
+	while (cur <= maxOrder && freeLists[cur].empty()) cur++;
+
+	/* grow up to the end of the next naturally aligned block */
+	size_t blockSize = 1ULL << std::max(order, alignOrder);
+	if (cur > maxOrder && grow(alignUp(physBase + size, blockSize) +
+			blockSize - physBase))
+		return allocateOrder(order, alignOrder);
+
+	if (cur > maxOrder) {
+		console->error("Out of physical memory, order = {}", order);
+		std::abort();
+	}
+
+	addr_t addr = *freeLists[cur].begin();
+	freeLists[cur].erase(freeLists[cur].begin());
+
+	/* keep the lower half, which preserves the alignment */
+	while (cur > order) {
+		cur--;
+		freeLists[cur].insert(addr + (1ULL << cur));
+	}
+
+	return addr;
+}
+
+addr_t BuddyMemoryPool::getPhysicalMemoryBlock(size_t len)
+{
+	return getAlignedPhysicalMemoryBlock(len, PAGE_SIZE);
+}
+
+addr_t BuddyMemoryPool::getAlignedPhysicalMemoryBlock(size_t len, size_t align)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	unsigned order = orderOf(len);
+	if (order > maxOrder) {
+		console->error("Block too large for buddy allocator, size = {}", len);
+		std::abort();
+	}
+
+	addr_t addr = allocateOrder(order, orderOf(align));
+	frames[getFrameIndex(addr)].order = order;
+	unqueueReclaim(addr, 1ULL << order);
+	markDirty(addr, 1ULL << order);
+
+	console->trace("Allocate buddy block addr = 0x{:x}, order = {}", addr, order);
+	return addr;
+}
+
+void BuddyMemoryPool::freePhysicalMemoryBlock(addr_t addr, size_t len)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	unsigned order = orderOf(len);
+
+	/* a free block, part of one, or a block of another size */
+	if (addr & ((1ULL << order) - 1) ||
+		frames[getFrameIndex(addr)].order != order) {
+		console->error("Invalid free of buddy block 0x{:x}, size = {}",
+				addr, len);
+		std::abort();
+	}
+
+	frames[getFrameIndex(addr)].order = 0;
+	queueReclaim(addr, 1ULL << order);
+
+	/* coalesce with free buddies as far up as possible */
+	while (order < maxOrder) {
+		addr_t buddy = addr ^ (1ULL << order);
+		auto it = freeLists[order].find(buddy);
+
+		if (it == freeLists[order].end()) break;
+
+		freeLists[order].erase(it);
+		addr = std::min(addr, buddy);
+		order++;
+	}
+
+	freeLists[order].insert(addr);
+}
+
+CachingMemoryPool::CachingMemoryPool(AbstractMemoryPool &_backing,
+		size_t _nMagazines)
+	: backing(_backing), nMagazines(_nMagazines)
+{
+	if (!nMagazines) nMagazines = std::thread::hardware_concurrency();
+	if (!nMagazines) nMagazines = 1;
+
+	magazines.reset(new Magazine[nMagazines]);
+}
+
+CachingMemoryPool::~CachingMemoryPool()
+{
+	drain();
+}
+
+CachingMemoryPool::Magazine &CachingMemoryPool::currentMagazine()
+{
+	/* threads are spread over the magazines round-robin,
+	 * so each vcpu thread ends up with its own */
+	static std::atomic<size_t> nextThread(0);
+	static thread_local size_t threadIndex = nextThread++;
+
+	return magazines[threadIndex % nMagazines];
+}
+
+addr_t CachingMemoryPool::getPhysicalMemoryBlock(size_t len)
+{
+	if (len != PAGE_SIZE)
+		return backing.getPhysicalMemoryBlock(len);
+
+	Magazine &mag = currentMagazine();
+	std::lock_guard<std::mutex> guard(mag.lock);
+
+	if (mag.count == 0) {
+		backing.getPhysicalPages(mag.pages, batchSize);
+		mag.count = batchSize;
+		mag.stats.misses++;
+		mag.stats.refills++;
+	} else {
+		mag.stats.hits++;
+		/* it may have been cached before dirty logging began */
+		backing.markDirty(mag.pages[mag.count - 1], PAGE_SIZE);
+	}
+
+	return mag.pages[--mag.count];
+}
+
+addr_t CachingMemoryPool::getAlignedPhysicalMemoryBlock(size_t len, size_t align)
+{
+	if (len == PAGE_SIZE && PAGE_SIZE % align == 0)
+		return getPhysicalMemoryBlock(len);
+
+	return backing.getAlignedPhysicalMemoryBlock(len, align);
+}
+
+void CachingMemoryPool::freePhysicalMemoryBlock(addr_t addr, size_t len)
+{
+	if (len != PAGE_SIZE) {
+		backing.freePhysicalMemoryBlock(addr, len);
+		return;
+	}
+
+	Magazine &mag = currentMagazine();
+	std::lock_guard<std::mutex> guard(mag.lock);
+
+	if (mag.count == magazineSize) {
+		mag.count -= batchSize;
+		backing.freePhysicalPages(&mag.pages[mag.count], batchSize);
+		mag.stats.drains++;
+	}
+
+	mag.pages[mag.count++] = addr;
+}
+
+void CachingMemoryPool::drain()
+{
+	for (size_t i = 0; i < nMagazines; i++) {
+		Magazine &mag = magazines[i];
+		std::lock_guard<std::mutex> guard(mag.lock);
+
+		if (!mag.count) continue;
+
+		backing.freePhysicalPages(mag.pages, mag.count);
+		mag.count = 0;
+		mag.stats.drains++;
+	}
+}
+
+CachingMemoryPool::Stats CachingMemoryPool::getStats()
+{
+	Stats total = {};
+
+	for (size_t i = 0; i < nMagazines; i++) {
+		Magazine &mag = magazines[i];
+		std::lock_guard<std::mutex> guard(mag.lock);
+
+		total.hits += mag.stats.hits;
+		total.misses += mag.stats.misses;
+		total.refills += mag.stats.refills;
+		total.drains += mag.stats.drains;
+	}
+
+	return total;
+}
+
+void BuddyMemoryPool::reset()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	MemoryPool::reset();
+
+	for (auto &freeList : freeLists)
+		freeList.clear();
+	addFreeRange(physBase, size);
+}
+
+MemoryRegion::MemoryRegion(addr_t guestVirt, size_t _len, size_t _pageSize)
+	: minWindow(1), maxWindow(1), window(1), lastWindowEnd(0), stats(),
+	guestVirtualAddr(guestVirt), len(_len), pageSize(_pageSize),
+	writable(true), swapStats(), memorySpace(nullptr), isKernel(false)
+{
+	if (pageSize != PAGE_SIZE && pageSize != PAGE_SIZE_2M &&
+		pageSize != PAGE_SIZE_1G) {
+		console->error("Unsupported page size {}", pageSize);
+		std::abort();
+	}
+
+	if (guestVirt % pageSize || len % pageSize) {
+		console->error("Region 0x{:x}+{} is not aligned to {}",
+				guestVirt, len, pageSize);
+		std::abort();
+	}
+
+	frames.assign(len / pageSize, NO_FRAME);
+	idleAges.assign(len / pageSize, 0);
+}
+
+MemoryRegion::MemoryRegion(const MemoryRegion &other)
+	: minWindow(other.minWindow), maxWindow(other.maxWindow),
+	window(other.minWindow), lastWindowEnd(0), stats(),
+	guestVirtualAddr(other.guestVirtualAddr), len(other.len),
+	pageSize(other.pageSize), writable(other.writable),
+	frames(other.frames), idleAges(other.idleAges),
+	swapped(other.swapped), swapStats(other.swapStats), memorySpace(nullptr),
+	isKernel(other.isKernel)
+{
+}
+
+void MemoryRegion::setFaultAround(size_t minPages, size_t maxPages)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!minPages || minPages & (minPages - 1) ||
+		maxPages & (maxPages - 1) || minPages > maxPages) {
+		console->error("Bad fault-around window {}..{}",
+				minPages, maxPages);
+		std::abort();
+	}
+
+	minWindow = window = minPages;
+	maxWindow = maxPages;
+}
+
+MemoryRegion::FaultStats MemoryRegion::getFaultStats()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	return stats;
+}
+
+MemoryRegion::IdleHistogram MemoryRegion::getIdleHistogram()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	IdleHistogram histogram = {};
+
+	for (size_t i = 0; i < frames.size(); i++) {
+		if (frames[i] == NO_FRAME) continue;
+
+		size_t bucket = 0;
+		for (unsigned age = idleAges[i]; age; age >>= 1) bucket++;
+		histogram[std::min(bucket, IDLE_BUCKETS - 1)]++;
+	}
+
+	return histogram;
+}
+
+size_t MemoryRegion::getWorkingSetSize(unsigned idleScans)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	size_t pages = 0;
+
+	for (size_t i = 0; i < frames.size(); i++) {
+		if (frames[i] != NO_FRAME && idleAges[i] < idleScans)
+			pages++;
+	}
+
+	return pages * pageSize;
+}
+
+size_t MemoryRegion::swapOut(unsigned minIdleScans,
+		std::vector<FrameIndex> &released)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!canSwap()) return 0;
+
+	/* not worth keeping compressed above this */
+	constexpr size_t maxStored = PAGE_SIZE * 3 / 4;
+	uint8_t buffer[maxStored];
+	size_t n = 0;
+
+	for (size_t i = 0; i < frames.size(); i++) {
+		if (frames[i] == NO_FRAME || idleAges[i] < minIdleScans)
+			continue;
+
+		addr_t guestVirtual = guestVirtualAddr + i * PAGE_SIZE;
+		PageTableEntry *pte = memorySpace->getPTE(guestVirtual);
+		auto *page = memorySpace->castGuestPhysical<uint8_t>(
+				getPagePhysical(i));
+
+		bool zero = isZeroPage(page);
+		size_t stored = 0;
+		if (!zero) {
+			stored = lzCompress(page, PAGE_SIZE, buffer, maxStored);
+			if (!stored) {
+				swapStats.incompressible++;
+				continue;
+			}
+		}
+
+		if (pte) {
+			storeEntry(pte, PageTableEntry{});
+			memorySpace->invalidate(guestVirtual, PAGE_SIZE);
+		}
+
+		swapped[i].assign(buffer, buffer + stored);
+		released.push_back(frames[i]);
+		frames[i] = NO_FRAME;
+
+		swapStats.pagesOut++;
+		swapStats.zeroPagesOut += zero;
+		swapStats.swappedPages++;
+		swapStats.storedBytes += stored;
+		n++;
+	}
+
+	if (n) memorySpace->flushTlb();
+	return n;
+}
+
+bool MemoryRegion::swapIn(size_t index, void *page)
+{
+	auto it = swapped.find(index);
+	if (it == swapped.end()) return false;
+
+	auto start = std::chrono::steady_clock::now();
+	const std::vector<uint8_t> &data = it->second;
+
+	if (data.empty()) {
+		memset(page, 0, PAGE_SIZE);
+	} else if (!lzDecompress(data.data(), data.size(),
+			static_cast<uint8_t *>(page), PAGE_SIZE)) {
+		console->error("Swapped page {} of region 0x{:x} is corrupt",
+				index, guestVirtualAddr);
+		std::abort();
+	}
+
+	swapStats.pagesIn++;
+	swapStats.swappedPages--;
+	swapStats.storedBytes -= data.size();
+	swapStats.swapInNanos += std::chrono::duration_cast<
+		std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+				start).count();
+
+	swapped.erase(it);
+	return true;
+}
+
+MemoryRegion::SwapStats MemoryRegion::getSwapStats()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	return swapStats;
+}
+
+size_t MemoryRegion::faultWindow(size_t index, size_t &first)
+{
+	stats.faults++;
+
+	/* a fault right behind the last window is sequential access */
+	if (index == lastWindowEnd)
+		window = std::min(window * 2, maxWindow);
+	else
+		window = minWindow;
+
+	first = index & ~(window - 1);
+	size_t end = std::min(first + window, frames.size());
+	lastWindowEnd = end;
+
+	return end - first;
+}
+
+void MemoryRegion::populate(size_t first, size_t n)
+{
+	std::vector<size_t> indices;
+
+	for (size_t i = first; i < first + n; i++) {
+		if (frames[i] == NO_FRAME) indices.push_back(i);
+	}
+
+	if (indices.empty()) return;
+
+	getPages(indices.data(), indices.size());
+
+	std::vector<addr_t> virt(indices.size()), phys(indices.size());
+	for (size_t i = 0; i < indices.size(); i++) {
+		virt[i] = guestVirtualAddr + indices[i] * pageSize;
+		phys[i] = getPagePhysical(indices[i]);
+	}
+
+	memorySpace->mapPages(virt.data(), phys.data(), indices.size(),
+			pageSize, writable, !isKernel);
+	stats.pagesMapped += indices.size();
+
+	for (size_t index : indices)
+		idleAges[index] = 0;
+}
+
+PageTableEntry *MemoryRegion::installPage(size_t offset, addr_t guestPhysical,
+		bool writable)
+{
+	idleAges[offset / pageSize] = 0;
+
+	return memorySpace->mapPage(guestVirtualAddr + offset, guestPhysical,
+			pageSize, writable, !isKernel);
+}
+
+MemorySpace::RegionReader::RegionReader(MemorySpace &_space)
+	: space(_space)
+{
+	slot = space.regionEpoch.load() & 1;
+	space.regionReaders[slot]++;
+}
+
+MemorySpace::RegionReader::~RegionReader()
+{
+	space.regionReaders[slot]--;
+}
+
+const MemorySpace::RegionIndex &MemorySpace::RegionReader::index()
+{
+	return *space.regions.load();
+}
+
+MemorySpace::MemorySpace(AbstractMemoryPool *_memoryPool)
+	: regions(new RegionIndex()), regionEpoch(0), regionReaders{0, 0},
+	memoryPool(_memoryPool), tlbGeneration(0), tlbStats(),
+	scanned(false), pcidVm(nullptr), pcid(0)
+{
+	pageTableP = memoryPool->getPhysicalMemoryBlock(PAGE_SIZE);
+	pageTableV = memoryPool->getHostVirtualFromPhysical(pageTableP);
+	pageTablePages.emplace_back(pageTableP, pageTableV);
+}
+
+MemorySpace::MemorySpace(MemorySpace &other, AbstractMemoryPool *_memoryPool)
+	: regions(nullptr), regionEpoch(0), regionReaders{0, 0},
+	memoryPool(_memoryPool), tlbStats(), scanned(false),
+	pcidVm(nullptr), pcid(0)
+{
+	std::lock_guard<std::recursive_mutex> guard(other.lock);
+	std::lock_guard<std::mutex> regionGuard(other.regionLock);
+	std::lock_guard<std::mutex> tlbGuard(other.tlbLock);
+
+	/* the mailboxes came along too, keep their generations valid */
+	tlbGeneration = other.tlbGeneration;
+	tlbLog = other.tlbLog;
+
+	/* the page tables themselves came along with guest memory */
+	pageTableP = other.pageTableP;
+	pageTableV = memoryPool->getHostVirtualFromPhysical(pageTableP);
+
+	for (auto &page : other.pageTablePages)
+		pageTablePages.emplace_back(page.guestPhysical,
+			memoryPool->getHostVirtualFromPhysical(page.guestPhysical));
+
+	auto *index = new RegionIndex();
+
+	for (auto &region : *other.regions.load()) {
+		std::lock_guard<std::recursive_mutex> pageGuard(region->lock);
+		std::shared_ptr<MemoryRegion> copy = region->clone();
+
+		copy->rebind(this, memoryPool);
+		index->push_back(std::move(copy));
+	}
+
+	regions.store(index);
+}
+
+MemorySpace::MemorySpace(AbstractMemoryPool *_memoryPool,
+		const std::vector<uint64_t> &state)
+	: regions(new RegionIndex()), regionEpoch(0), regionReaders{0, 0},
+	memoryPool(_memoryPool), tlbGeneration(0), tlbStats(),
+	scanned(false), pcidVm(nullptr), pcid(0)
+{
+	if (state.empty()) {
+		console->error("Empty memory space state");
+		std::abort();
+	}
+
+	/* the root comes first */
+	pageTableP = state[0];
+	pageTableV = memoryPool->getHostVirtualFromPhysical(pageTableP);
+
+	for (addr_t page : state)
+		pageTablePages.emplace_back(page,
+			memoryPool->getHostVirtualFromPhysical(page));
+
+	/* carry on from the mailboxes' generations, so
+	 * what they flushed before still reads as old */
+	for (int id = 0; id < TLB_MAILBOX_MAX; id++) {
+		PageTableEntry *pte =
+			getPTE(TLB_MAILBOX_BASE + id * PAGE_SIZE);
+		if (!pte || !loadEntry(pte).present) continue;
+
+		auto *mbox = castGuestPhysical<struct tlb_mailbox>(
+				loadEntry(pte).address * PAGE_SIZE);
+		tlbGeneration = std::max<uint64_t>(tlbGeneration,
+				mbox->generation);
+	}
+}
+
+void MemorySpace::saveState(std::vector<uint64_t> &state)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	std::lock_guard<std::mutex> regionGuard(regionLock);
+
+	if (!regions.load()->empty()) {
+		console->error("Cannot save a memory space with regions");
+		std::abort();
+	}
+
+	for (auto &page : pageTablePages)
+		state.push_back(page.guestPhysical);
+}
+
+MemorySpace::~MemorySpace()
+{
+	if (scanned)
+		WorkingSetScanner::instance().remove(this);
+
+	if (pcid)
+		vm_free_pcid(pcidVm, pcid);
+
+	/* regions first, they may still free frames */
+	delete regions.load();
+	retired.clear();
+
+	for (auto &page : pageTablePages)
+		memoryPool->freePhysicalMemoryBlock(page.guestPhysical,
+				PAGETABLE_SIZE);
+}
+
+void MemorySpace::apply(vcpu_t *vcpu, MemorySpace *current)
+{
+	addr_t mailbox = TLB_MAILBOX_BASE + vcpu->id * PAGE_SIZE;
+
+	if (!getMailbox(vcpu)) {
+		std::lock_guard<std::recursive_mutex> guard(lock);
+
+		addr_t page = memoryPool->getPhysicalMemoryBlock(PAGE_SIZE);
+		auto *mbox = castGuestPhysical<struct tlb_mailbox>(page);
+
+		memset(mbox, 0, PAGE_SIZE);
+		mbox->self = mailbox;
+		{
+			std::lock_guard<std::mutex> tlbGuard(tlbLock);
+			mbox->generation = mbox->flushed = tlbGeneration;
+		}
+
+		mapPage(mailbox, page, PAGE_SIZE, true, false);
+		pageTablePages.emplace_back(page, mbox);
+	}
+
+	uint64_t cr3;
+	{
+		std::lock_guard<std::mutex> tlbGuard(tlbLock);
+
+		if (vcpu->pcid && !pcidVm) {
+			pcidVm = vcpu->vm;
+			pcid = vm_alloc_pcid(pcidVm);
+			if (!pcid)
+				console->warn("Out of PCIDs, space runs untagged");
+		}
+
+		cr3 = tagCr3(vcpu);
+	}
+
+	struct tlb_mailbox *from =
+		current && current != this ? current->getMailbox(vcpu) : nullptr;
+
+	if (vcpu->pcid && from) {
+		from->switch_cr3 = cr3;
+	} else {
+		/* KVM flushes on this anyway, and the no-flush
+		 * bit is not valid in the register itself */
+		VCPU_SREG(vcpu, cr3) = cr3 & ~CR3_NOFLUSH;
+	}
+
+	VCPU_SREG(vcpu, gs.base) = mailbox;
+
+	/* anything queued while the vcpu was elsewhere */
+	syncTlb(vcpu);
+}
+
+void MemorySpace::adoptPcid(vcpu_t *vcpu)
+{
+	uint32_t tag = VCPU_SREG_GET(vcpu, cr3) & CR3_PCID_MASK;
+
+	if (!vcpu->pcid || !(VCPU_SREG_GET(vcpu, cr4) & CR4_PCIDE) || !tag)
+		return;
+
+	std::lock_guard<std::mutex> tlbGuard(tlbLock);
+
+	if (pcidVm) {
+		console->error("Memory space has a PCID already");
+		std::abort();
+	}
+
+	if (!vm_reserve_pcid(vcpu->vm, tag)) {
+		console->error("PCID {} is taken in the VM", tag);
+		std::abort();
+	}
+
+	pcidVm = vcpu->vm;
+	pcid = tag;
+}
+
+struct tlb_mailbox *MemorySpace::getMailbox(vcpu_t *vcpu)
+{
+	PageTableEntry *pte = getPTE(TLB_MAILBOX_BASE + vcpu->id * PAGE_SIZE);
+	if (!pte) return nullptr;
+
+	PageTableEntry entry = loadEntry(pte);
+	if (!entry.present) return nullptr;
+
+	return castGuestPhysical<struct tlb_mailbox>(entry.address * PAGE_SIZE);
+}
+
+uint64_t MemorySpace::tagCr3(vcpu_t *vcpu)
+{
+	if (!vcpu->pcid || !pcid)
+		return pageTableP;
+
+	if (vcpu->vm != pcidVm) {
+		console->error("Memory space applied to vcpus of two VMs");
+		std::abort();
+	}
+
+	/* the tag may have had another holder before this space,
+	 * so the first load on each vcpu flushes it */
+	if (!pcidLoaded.insert(vcpu->id).second)
+		return pageTableP | pcid | CR3_NOFLUSH;
+
+	return pageTableP | pcid;
+}
+
+MemoryRegion *MemorySpace::findRegion(const RegionIndex &index, addr_t addr)
+{
+	auto next = std::upper_bound(index.begin(), index.end(), addr,
+		[](addr_t addr, const std::shared_ptr<MemoryRegion> &region) {
+			return addr < region->getKey();
+		});
+
+	if (next == index.begin()) return nullptr;
+
+	MemoryRegion *region = std::prev(next)->get();
+	if (addr >= region->getKey() + region->getLength()) return nullptr;
+
+	return region;
+}
+
+void MemorySpace::publishRegions(const RegionIndex *index)
+{
+	const RegionIndex *old = regions.exchange(index);
+
+	/* readers arriving after a flip count in the other slot and
+	 * can only see the new index. drain both slots in turn so
+	 * anyone who might still hold the old one is gone */
+	for (int i = 0; i < 2; i++) {
+		unsigned slot = regionEpoch.fetch_add(1) & 1;
+		while (regionReaders[slot].load())
+			std::this_thread::yield();
+	}
+
+	delete old;
+}
+
+void MemorySpace::addRegion(std::shared_ptr<MemoryRegion> region)
+{
+	addr_t start = region->getKey();
+	size_t len = region->getLength();
+
+	if (!tryAddRegion(std::move(region))) {
+		console->error("Region 0x{:x}+{} overlaps another", start, len);
+		std::abort();
+	}
+}
+
+bool MemorySpace::tryAddRegion(std::shared_ptr<MemoryRegion> region)
+{
+	std::lock_guard<std::mutex> guard(regionLock);
+
+	const RegionIndex &current = *regions.load();
+	addr_t start = region->getKey();
+	addr_t end = start + region->getLength();
+
+	auto next = std::lower_bound(current.begin(), current.end(), start,
+		[](const std::shared_ptr<MemoryRegion> &region, addr_t addr) {
+			return region->getKey() < addr;
+		});
+
+	if (next != current.end() && (*next)->getKey() < end)
+		return false;
+
+	if (next != current.begin()) {
+		auto prev = std::prev(next);
+		if ((*prev)->getKey() + (*prev)->getLength() > start)
+			return false;
+	}
+
+	region->setMemorySpace(this);
+
+	auto *index = new RegionIndex(current.begin(), next);
+	index->push_back(std::move(region));
+	index->insert(index->end(), next, current.end());
+
+	publishRegions(index);
+	return true;
+}
+
+void MemorySpace::removeRegion(addr_t guestVirtual)
+{
+	std::shared_ptr<MemoryRegion> region;
+
+	{
+		std::lock_guard<std::mutex> guard(regionLock);
+
+		const RegionIndex &current = *regions.load();
+		auto it = std::find_if(current.begin(), current.end(),
+			[guestVirtual](const std::shared_ptr<MemoryRegion> &region) {
+				return region->getKey() == guestVirtual;
+			});
+
+		if (it == current.end()) {
+			console->error("No region at 0x{:x}", guestVirtual);
+			std::abort();
+		}
+
+		region = *it;
+
+		auto *index = new RegionIndex(current.begin(), it);
+		index->insert(index->end(), std::next(it), current.end());
+
+		publishRegions(index);
+	}
+
+	/* no fault is inside the region any more */
+	size_t pageSize = region->getPageSize();
+	for (size_t off = 0; off < region->getLength(); off += pageSize) {
+		PageTableEntry *pte =
+			getPTE(region->getKey() + off, false, pageSize);
+
+		if (pte && loadEntry(pte).present)
+			storeEntry(pte, PageTableEntry{});
+	}
+
+	invalidate(region->getKey(), region->getLength());
+	flushTlb();
+
+	retire(std::move(region));
+	releaseRetired();
+}
+
+void MemorySpace::logFaultStats()
+{
+	RegionReader reader(*this);
+
+	for (auto &region : reader.index()) {
+		auto stats = region->getFaultStats();
+
+		console->info("Region 0x{:x}: {} faults, {} pages mapped, "
+				"{:.2f} pages per fault", region->getKey(),
+				stats.faults, stats.pagesMapped,
+				stats.faults ? (double)stats.pagesMapped /
+					stats.faults : 0.0);
+	}
+}
+
+void MemorySpace::scanAccessed()
+{
+	RegionReader reader(*this);
+	bool cleared = false;
+
+	for (auto &region : reader.index()) {
+		std::lock_guard<std::recursive_mutex> guard(region->lock);
+		size_t pageSize = region->pageSize;
+
+		/* 4 KiB pages in the same leaf table share a single walk */
+		PageTableEntry *table = nullptr;
+		addr_t tableBase = 1;
+
+		for (size_t i = 0; i < region->frames.size(); i++) {
+			if (region->frames[i] == NO_FRAME) continue;
+
+			addr_t guestVirtual = region->guestVirtualAddr + i * pageSize;
+			PageTableEntry *pte;
+
+			if (pageSize == PAGE_SIZE) {
+				addr_t base = guestVirtual & ~(PAGE_SIZE_2M - 1);
+				if (base != tableBase) {
+					table = getPTE(base);
+					tableBase = base;
+				}
+				pte = table ? &table[(guestVirtual / PAGE_SIZE) &
+					0b111111111] : nullptr;
+			} else {
+				pte = getPTE(guestVirtual, false, pageSize);
+			}
+
+			if (!pte || !loadEntry(pte).present) continue;
+
+			uint8_t &age = region->idleAges[i];
+			if (clearAccessed(pte)) {
+				/* the next access has to walk the tables again */
+				invalidate(guestVirtual, pageSize);
+				cleared = true;
+				age = 0;
+			} else if (age < UINT8_MAX) {
+				age++;
+			}
+		}
+	}
+
+	if (!cleared) return;
+
+	flushTlb();
+	if (tlbKick) tlbKick();
+}
+
+void MemorySpace::trackWorkingSet()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (scanned) return;
+
+	scanned = true;
+	WorkingSetScanner::instance().add(this);
+}
+
+size_t MemorySpace::getWorkingSetSize(unsigned idleScans)
+{
+	RegionReader reader(*this);
+	size_t bytes = 0;
+
+	for (auto &region : reader.index())
+		bytes += region->getWorkingSetSize(idleScans);
+
+	return bytes;
+}
+
+addr_t MemorySpace::translate(addr_t guestVirtual, bool write)
+{
+	auto *table = static_cast<PageTableEntry *>(pageTableV);
+
+	for (unsigned shift = 39; ; shift -= 9) {
+		PageTableEntry entry =
+			loadEntry(&table[(guestVirtual >> shift) & 0b111111111]);
+
+		if (!entry.present) return ~0ULL;
+
+		if (shift == 12 || entry.hugePage) {
+			if (write && !entry.writable) return ~0ULL;
+
+			addr_t mask = (1ULL << shift) - 1;
+
+			return (entry.address * PAGE_SIZE & ~mask) |
+				(guestVirtual & mask);
+		}
+
+		table = castGuestPhysical<PageTableEntry>(
+				entry.address * PAGETABLE_SIZE);
+	}
+}
+
+bool MemorySpace::copyGuest(addr_t guestVirtual, void *buf, size_t len,
+		bool write)
+{
+	auto *p = static_cast<char *>(buf);
+	/* keeps the region behind a file window page around */
+	RegionReader reader(*this);
+
+	while (len) {
+		size_t chunk = std::min(len, PAGE_SIZE - guestVirtual % PAGE_SIZE);
+		addr_t guestPhysical = translate(guestVirtual, write);
+
+		if (guestPhysical == ~0ULL) {
+			fault(guestVirtual & ~(PAGE_SIZE - 1), write ? PF_WRITE : 0);
+			guestPhysical = translate(guestVirtual, write);
+			if (guestPhysical == ~0ULL) return false;
+		}
+
+		char *host;
+		if (guestPhysical < FILE_WINDOW_BASE) {
+			host = castGuestPhysical<char>(guestPhysical);
+		} else {
+			/* file windows live in slots of their own */
+			MemoryRegion *region = findRegion(reader.index(),
+					guestVirtual);
+			host = region ? static_cast<char *>(
+				region->getWindowHostVirtual(guestPhysical)) :
+				nullptr;
+			if (!host) return false;
+		}
+
+		if (write) {
+			memcpy(host, p, chunk);
+			if (guestPhysical < FILE_WINDOW_BASE)
+				memoryPool->markDirty(guestPhysical, chunk);
+		} else {
+			memcpy(p, host, chunk);
+		}
+
+		guestVirtual += chunk;
+		p += chunk;
+		len -= chunk;
+	}
+
+	return true;
+}
+
+bool MemorySpace::getGuestExtents(addr_t guestVirtual, size_t len,
+		bool write, std::vector<GuestExtent> &extents)
+{
+	extents.clear();
+
+	while (len) {
+		size_t chunk = std::min(len, PAGE_SIZE - guestVirtual % PAGE_SIZE);
+		addr_t guestPhysical = translate(guestVirtual, write);
+
+		if (guestPhysical == ~0ULL) {
+			fault(guestVirtual & ~(PAGE_SIZE - 1), write ? PF_WRITE : 0);
+			guestPhysical = translate(guestVirtual, write);
+			if (guestPhysical == ~0ULL) return false;
+		}
+
+		if (guestPhysical >= FILE_WINDOW_BASE) return false;
+
+		if (!extents.empty() && extents.back().guestPhysical +
+			extents.back().len == guestPhysical)
+			extents.back().len += chunk;
+		else
+			extents.push_back({ guestPhysical, chunk });
+
+		guestVirtual += chunk;
+		len -= chunk;
+	}
+
+	return true;
+}
+
+bool MemorySpace::readGuest(addr_t guestVirtual, void *buf, size_t len)
+{
+	return copyGuest(guestVirtual, buf, len, false);
+}
+
+bool MemorySpace::writeGuest(addr_t guestVirtual, const void *buf, size_t len)
+{
+	return copyGuest(guestVirtual, const_cast<void *>(buf), len, true);
+}
+
+size_t MemorySpace::swapOut(unsigned minIdleScans)
+{
+	size_t n = 0;
+
+	{
+		RegionReader reader(*this);
+
+		for (auto &region : reader.index()) {
+			std::vector<FrameIndex> released;
+
+			n += region->swapOut(minIdleScans, released);
+			if (!released.empty())
+				retire(region, std::move(released));
+		}
+	}
+
+	releaseRetired();
+	return n;
+}
+
+MemoryRegion::SwapStats MemorySpace::getSwapStats()
+{
+	RegionReader reader(*this);
+	MemoryRegion::SwapStats total = {};
+
+	for (auto &region : reader.index()) {
+		auto stats = region->getSwapStats();
+
+		total.pagesOut += stats.pagesOut;
+		total.zeroPagesOut += stats.zeroPagesOut;
+		total.pagesIn += stats.pagesIn;
+		total.incompressible += stats.incompressible;
+		total.swappedPages += stats.swappedPages;
+		total.storedBytes += stats.storedBytes;
+		total.swapInNanos += stats.swapInNanos;
+	}
+
+	return total;
+}
+
+void MemorySpace::logSwapStats()
+{
+	auto stats = getSwapStats();
+	uint64_t swappedBytes = stats.swappedPages * PAGE_SIZE;
+
+	console->info("Swap: {} pages out ({} zero), {} in, {} kept. "
+			"{} pages held in {} bytes, ratio {:.2f}, {} bytes saved, "
+			"{:.2f} us per swap-in", stats.pagesOut,
+			stats.zeroPagesOut, stats.pagesIn, stats.incompressible,
+			stats.swappedPages, stats.storedBytes,
+			stats.storedBytes ? (double)swappedBytes /
+				stats.storedBytes : 0.0,
+			swappedBytes - stats.storedBytes,
+			stats.pagesIn ? stats.swapInNanos / 1000.0 /
+				stats.pagesIn : 0.0);
+}
+
+bool MemorySpace::fault(addr_t guestVirtualPage, uint32_t errorcode)
+{
+	RegionReader reader(*this);
+	bool write = errorcode & PF_WRITE;
+
+	MemoryRegion *region = findRegion(reader.index(), guestVirtualPage);
+	if (!region || (write && !region->writable)) {
+		console->warn("Unresolved page fault at 0x{:x}, error code 0x{:x}",
+				guestVirtualPage, errorcode);
+		return false;
+	}
+
+	{
+		std::lock_guard<std::recursive_mutex> regionGuard(region->lock);
+		region->fault(guestVirtualPage, errorcode);
+	}
+
+	flushTlb();
+
+	/* the guest would fault on it again forever, e.g. a page
+	 * that is present but read-only in a writable region */
+	if (translate(guestVirtualPage, write) == ~0ULL) {
+		console->warn("Page fault at 0x{:x}, error code 0x{:x}, "
+				"not resolved by its region",
+				guestVirtualPage, errorcode);
+		return false;
+	}
+
+	return true;
+}
+
+void MemorySpace::invalidate(addr_t guestVirtual, size_t len)
+{
+	addr_t start = guestVirtual & ~(PAGE_SIZE - 1);
+	addr_t end = alignUp(guestVirtual + len, PAGE_SIZE);
+
+	std::lock_guard<std::mutex> guard(tlbLock);
+
+	/* merge with every range it touches */
+	auto it = tlbPending.upper_bound(start);
+	if (it != tlbPending.begin()) {
+		auto prev = std::prev(it);
+		if (prev->second >= start) {
+			start = prev->first;
+			end = std::max(end, prev->second);
+			it = tlbPending.erase(prev);
+		}
+	}
+
+	while (it != tlbPending.end() && it->first <= end) {
+		end = std::max(end, it->second);
+		it = tlbPending.erase(it);
+	}
+
+	tlbPending.emplace(start, end);
+}
+
+void MemorySpace::flushTlb()
+{
+	std::lock_guard<std::mutex> guard(tlbLock);
+
+	if (tlbPending.empty()) return;
+
+	TlbBatch batch{++tlbGeneration, false, {}};
+	size_t n = 0;
+
+	for (auto &range : tlbPending)
+		n += (range.second - range.first) / PAGE_SIZE;
+
+	if (n > TLB_FLUSH_MAX) {
+		batch.full = true;
+		tlbStats.fullFlushes++;
+	} else {
+		for (auto &range : tlbPending)
+			for (addr_t va = range.first; va < range.second;
+					va += PAGE_SIZE)
+				batch.pages.push_back(va);
+		tlbStats.pages += n;
+	}
+
+	tlbPending.clear();
+	tlbStats.batches++;
+
+	tlbLog.push_back(std::move(batch));
+	if (tlbLog.size() > TLB_LOG_MAX)
+		tlbLog.pop_front();
+}
+
+void MemorySpace::syncTlb(vcpu_t *vcpu)
+{
+	auto *mbox = getMailbox(vcpu);
+	if (!mbox) return;
+
+	/* the vcpu is out of the guest, with what it flushed so far */
+	releaseRetired();
+
+	std::lock_guard<std::mutex> guard(tlbLock);
+
+	if (mbox->generation == tlbGeneration &&
+		mbox->flushed == mbox->generation) return;
+
+	if (vcpu->interrupted) {
+		vcpu_flush_tlb(vcpu);
+		mbox->full = false;
+		mbox->count = 0;
+		mbox->generation = mbox->flushed = tlbGeneration;
+		tlbStats.hostFlushes++;
+		return;
+	}
+
+	if (mbox->generation == tlbGeneration) return;
+
+	/* too far behind, or from before a snapshot restore */
+	bool full = mbox->generation > tlbGeneration || tlbLog.empty() ||
+		tlbLog.front().generation > mbox->generation + 1;
+	std::vector<addr_t> pages;
+
+	/* the guest has not got to the last delivery yet */
+	if (mbox->flushed != mbox->generation) {
+		if (mbox->full)
+			full = true;
+		else
+			pages.assign(mbox->pages, mbox->pages + mbox->count);
+	}
+
+	for (auto &batch : tlbLog) {
+		if (full) break;
+		if (batch.generation <= mbox->generation) continue;
+
+		if (batch.full)
+			full = true;
+		else
+			pages.insert(pages.end(), batch.pages.begin(),
+					batch.pages.end());
+	}
+
+	if (!full) {
+		std::sort(pages.begin(), pages.end());
+		pages.erase(std::unique(pages.begin(), pages.end()),
+				pages.end());
+		full = pages.size() > TLB_FLUSH_MAX;
+	}
+
+	mbox->full = full;
+	mbox->count = full ? 0 : pages.size();
+	if (!full)
+		std::copy(pages.begin(), pages.end(), mbox->pages);
+	mbox->generation = tlbGeneration;
+
+	tlbStats.deliveries++;
+}
+
+uint64_t MemorySpace::getFlushedGeneration()
+{
+	uint64_t flushed = ~0ULL;
+
+	/* mailboxes in the same space need not have dense ids */
+	for (int id = 0; id < TLB_MAILBOX_MAX; id++) {
+		PageTableEntry *pte =
+			getPTE(TLB_MAILBOX_BASE + id * PAGE_SIZE);
+		if (!pte) continue;
+
+		PageTableEntry entry = loadEntry(pte);
+		if (!entry.present) continue;
+
+		auto *mbox = castGuestPhysical<volatile struct tlb_mailbox>(
+				entry.address * PAGE_SIZE);
+		uint64_t acked = mbox->flushed;
+		flushed = std::min(flushed, acked);
+	}
+
+	return flushed;
+}
+
+void MemorySpace::retire(std::shared_ptr<MemoryRegion> region,
+		std::vector<FrameIndex> frames)
+{
+	std::lock_guard<std::mutex> guard(tlbLock);
+
+	retired.push_back(Retired{tlbGeneration, std::move(region),
+			std::move(frames)});
+}
+
+void MemorySpace::releaseRetired()
+{
+	std::deque<Retired> done;
+
+	{
+		std::lock_guard<std::mutex> guard(tlbLock);
+
+		if (retired.empty()) return;
+
+		uint64_t flushed = getFlushedGeneration();
+		while (!retired.empty() &&
+				retired.front().generation <= flushed) {
+			done.push_back(std::move(retired.front()));
+			retired.pop_front();
+		}
+	}
+
+	/* removed regions go with done */
+	for (auto &entry : done) {
+		std::lock_guard<std::recursive_mutex> guard(entry.region->lock);
+
+		for (FrameIndex frame : entry.frames)
+			entry.region->releaseFrame(frame);
+	}
+}
+
+MemorySpace::TlbStats MemorySpace::getTlbStats()
+{
+	std::lock_guard<std::mutex> guard(tlbLock);
+	return tlbStats;
+}
+
+
+PageTableEntry *MemorySpace::getPTE(addr_t guestVirtual, bool create,
+		size_t pageSize)
+{
+	auto *cur = static_cast<PageTableEntry *>(pageTableV);
+	uint64_t nBits = 39;
+
+	while ((1ULL << nBits) >= PAGE_SIZE) {
+		uint64_t index = (guestVirtual >> nBits) & 0b111111111;
+
+		if ((1ULL << nBits) == pageSize)
+			return &cur[index];
+
+		nBits -= 9;
+		PageTableEntry *entry = &cur[index];
+		PageTableEntry value = loadEntry(entry);
+
+		if (value.present && value.hugePage)
+			return entry;
+
+		if (!value.present) {
+			if (!create) return nullptr;
+
+			std::lock_guard<std::recursive_mutex> guard(lock);
+
+			/* somebody may have beaten us to it */
+			value = loadEntry(entry);
+			if (!value.present) {
+				/* allocate a new page */
+				addr_t newPage =
+					memoryPool->getPhysicalMemoryBlock(PAGETABLE_SIZE);
+				memset(castGuestPhysical<void>(newPage), 0,
+						PAGETABLE_SIZE);
+
+				value = DEFAULT_PTE;
+				value.address = newPage / PAGETABLE_SIZE;
+				storeEntry(entry, value);
+
+				pageTablePages.emplace_back(newPage,
+					castGuestPhysical<void>(newPage));
+			}
+		}
+
+		cur = castGuestPhysical<PageTableEntry>(value.address * PAGETABLE_SIZE);
+	}
+	
+	console->error("shouldn't have reached here!");
+	std::abort();
+}
+
+PageTableEntry *MemorySpace::mapPage(addr_t guestVirtual, addr_t guestPhysical,
+		size_t pageSize, bool writable, bool user)
+{
+	if (guestVirtual % pageSize || guestPhysical % pageSize) {
+		console->error("Mapping 0x{:x} -> 0x{:x} is not aligned to {}",
+				guestVirtual, guestPhysical, pageSize);
+		std::abort();
+	}
+
+	PageTableEntry *pte = getPTE(guestVirtual, true, pageSize);
+	PageTableEntry old = loadEntry(pte);
+	if (old.present && old.hugePage && pageSize == PAGE_SIZE) {
+		console->error("0x{:x} is already covered by a huge page",
+				guestVirtual);
+		std::abort();
+	}
+
+	/* replacing a live translation */
+	if (old.present)
+		invalidate(guestVirtual, pageSize);
+
+	PageTableEntry entry = DEFAULT_PTE;
+	entry.writable = writable;
+	entry.user = user;
+	entry.hugePage = pageSize != PAGE_SIZE;
+	entry.address = guestPhysical / PAGE_SIZE;
+	storeEntry(pte, entry);
+
+	return pte;
+}
+
+void MemorySpace::mapPages(const addr_t *guestVirtual,
+		const addr_t *guestPhysical, size_t n, size_t pageSize,
+		bool writable, bool user)
+{
+	if (pageSize != PAGE_SIZE) {
+		for (size_t i = 0; i < n; i++)
+			mapPage(guestVirtual[i], guestPhysical[i], pageSize,
+				writable, user);
+		return;
+	}
+
+	PageTableEntry entry = DEFAULT_PTE;
+	entry.writable = writable;
+	entry.user = user;
+
+	PageTableEntry *table = nullptr;
+	addr_t tableBase = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		addr_t base = guestVirtual[i] & ~(PAGE_SIZE_2M - 1);
+
+		/* one walk per leaf table */
+		if (!table || base != tableBase) {
+			table = getPTE(base, true);
+			PageTableEntry first = loadEntry(table);
+			if (first.present && first.hugePage) {
+				console->error("0x{:x} is already covered by a huge page",
+						guestVirtual[i]);
+				std::abort();
+			}
+			tableBase = base;
+		}
+
+		PageTableEntry *pte =
+			&table[(guestVirtual[i] / PAGE_SIZE) & 0b111111111];
+		if (loadEntry(pte).present)
+			invalidate(guestVirtual[i], PAGE_SIZE);
+
+		entry.address = guestPhysical[i] / PAGE_SIZE;
+		storeEntry(pte, entry);
 	}
-	
-	console->error("shouldn't have reached here!");
-	std::abort();
 }
@@ -1,18 +1,30 @@
 #ifndef MEMORY_HPP
 #define MEMORY_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <shared_mutex>
 #include <memory>
 #include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <type_traits>
+#include <sys/types.h>
 #include "kvm.h"
 #include "archflags.h"
 #include "log.hpp"
 #include "utils.hpp"
 
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_2M (2ULL << 20)
+#define PAGE_SIZE_1G (1ULL << 30)
 #define PAGETABLE_SIZE 4096
 
 inline void checkPageMultiple(size_t len)
@@ -26,20 +38,161 @@ inline void checkPageMultiple(size_t len)
 class AbstractHostMemoryMapper {
 public:
 	virtual void *operator()(size_t len) = 0;
+	/* undo operator() for the same length */
+	virtual void release(void *hostVirtual, size_t len) = 0;
+	/* make a mapped range read back as zero */
+	virtual void scrub(void *hostVirtual, size_t len);
+	/* back a range of a mapping before the pool hands it to KVM.
+	 * operator() may only reserve address space. false if the
+	 * host has no memory for it */
+	virtual bool commit(void *hostVirtual, size_t len)
+	{ return true; }
+	/* scrub() also gives the memory back to the host,
+	 * in aligned units of this size */
+	virtual size_t granularity() const
+	{ return PAGE_SIZE; }
+	/* false while scrub() would change memory mapped elsewhere
+	 * too. reclaiming then leaves the memory alone */
+	virtual bool canScrub() const
+	{ return true; }
+	virtual ~AbstractHostMemoryMapper() {}
 };
 
 class DefaultHostMemoryMapper: public AbstractHostMemoryMapper {
 public:
 	void *operator()(size_t len);
+	void release(void *hostVirtual, size_t len);
 	static DefaultHostMemoryMapper instance;
 };
 
+/* Maps 2 MiB aligned memory backed by hugetlbfs when the host has
+ * reserved huge pages, and by transparent huge pages otherwise.
+ * Only the chunks the pool has grown to take huge pages */
+class HugePageHostMemoryMapper: public AbstractHostMemoryMapper {
+public:
+	void *operator()(size_t len);
+	void release(void *hostVirtual, size_t len);
+	bool commit(void *hostVirtual, size_t len);
+	size_t granularity() const
+	{ return PAGE_SIZE_2M; }
+	static HugePageHostMemoryMapper instance;
+};
+
+/* Shared memory backed by a memfd, so that clones can map
+ * it privately. One instance backs exactly one pool. */
+class MemfdHostMemoryMapper: public AbstractHostMemoryMapper {
+private:
+	int fd;
+	/* one more reference per clone mapping the file */
+	std::shared_ptr<int> users;
+public:
+	MemfdHostMemoryMapper() : fd(-1), users(std::make_shared<int>(0)) {}
+	void *operator()(size_t len);
+	void release(void *hostVirtual, size_t len);
+	void scrub(void *hostVirtual, size_t len);
+
+	/* punching the file would zero the pages clones have
+	 * not written yet */
+	bool canScrub() const
+	{ return users.use_count() == 1; }
+
+	int getFd() const
+	{ return fd; }
+
+	/* for a clone's mapper to hold while it maps the file */
+	std::shared_ptr<void> share()
+	{ return users; }
+};
+
+/* Copy-on-write view of a file. Pages are read from the file
+ * on first touch and become private on first write. */
+class PrivateFileHostMemoryMapper: public AbstractHostMemoryMapper {
+private:
+	int fd;
+	off_t offset;
+	/* see MemfdHostMemoryMapper::share() */
+	std::shared_ptr<void> source;
+public:
+	PrivateFileHostMemoryMapper(int _fd, off_t _offset = 0,
+			std::shared_ptr<void> _source = nullptr)
+		: fd(_fd), offset(_offset), source(std::move(_source)) {}
+	void *operator()(size_t len);
+	void release(void *hostVirtual, size_t len);
+	void scrub(void *hostVirtual, size_t len);
+};
+
+/* index of a PAGE_SIZE frame, counted from the base of its pool */
+using FrameIndex = uint32_t;
+
+#define NO_FRAME ((FrameIndex)~0U)
+
+/* who holds a frame */
+enum FrameOwner : uint8_t {
+	FRAME_FREE,
+	FRAME_REGION,
+};
+
+/* the frame is the first of a 2 MiB or 1 GiB page */
+#define FRAME_LARGE (1U << 0)
+
+/* Per-frame bookkeeping in the pool's frame table. Only the first
+ * frame of an allocation is used. Changed under the holder's lock */
+struct PageFrame {
+	uint32_t refcount;
+	uint16_t flags;
+	uint8_t owner;
+	/* log2 of the size of the block allocated from here, 0 if
+	 * none starts at the frame. kept by BuddyMemoryPool */
+	uint8_t order;
+};
+
+static_assert(sizeof(PageFrame) == 8, "the frame table stays compact");
+
+/* a run of guest physical memory in the pool, for vectored I/O */
+struct GuestExtent {
+	addr_t guestPhysical;
+	size_t len;
+};
+
 class AbstractMemoryPool {
 public:
 	virtual addr_t getPhysicalMemoryBlock(size_t len) = 0;
+	virtual addr_t getAlignedPhysicalMemoryBlock(size_t len, size_t align) = 0;
 	virtual void freePhysicalMemoryBlock(addr_t addr, size_t len) = 0;
 	virtual void *getHostVirtualFromPhysical(addr_t addr) const = 0;
 	virtual addr_t getPhysicalFromHostVirtual(void *hostVirtual) const = 0;
+
+	/* batched PAGE_SIZE allocation. pools override these
+	 * to take their lock once per batch */
+	virtual void getPhysicalPages(addr_t *pages, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			pages[i] = getPhysicalMemoryBlock(PAGE_SIZE);
+	}
+
+	virtual void freePhysicalPages(const addr_t *pages, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			freePhysicalMemoryBlock(pages[i], PAGE_SIZE);
+	}
+
+	/* the frame table, one PageFrame per PAGE_SIZE frame */
+	virtual FrameIndex getFrameIndex(addr_t guestPhysical) const = 0;
+	virtual addr_t getFramePhysical(FrameIndex frame) const = 0;
+	virtual PageFrame &getFrame(FrameIndex frame) = 0;
+
+	/* take the first reference on a block just allocated */
+	FrameIndex claimFrame(addr_t guestPhysical, FrameOwner owner,
+			uint16_t flags = 0);
+
+	/* drop a reference, the last one frees the len byte block */
+	void releaseFrame(FrameIndex frame, size_t len);
+
+	/* the host wrote the range through its own mapping, which
+	 * KVM does not see. for pools that log dirty pages */
+	virtual void markDirty(addr_t guestPhysical, size_t len) {}
+
+	virtual ~AbstractMemoryPool() {}
 };
 
 struct GuestPhysicalPage {
@@ -53,12 +206,46 @@ struct GuestPhysicalPage {
 	}
 };
 
-using GuestPhysicalPagePtr = std::shared_ptr<GuestPhysicalPage>;
+inline addr_t alignUp(addr_t addr, size_t align)
+{
+	return (addr + align - 1) / align * align;
+}
 
 class MemoryPool: public AbstractMemoryPool {
-private:
+public:
+	struct ReclaimStats {
+		/* freed but still resident, waiting for the reclaimer */
+		uint64_t queuedBytes;
+		/* given back to the host by the reclaimer and the balloon */
+		uint64_t reclaimedBytes;
+	};
+
+	/* one bit per PAGE_SIZE frame, from the pool's base */
+	using DirtyBitmap = std::vector<uint64_t>;
+
+protected:
 	using Mapper = AbstractHostMemoryMapper;
 
+	std::recursive_mutex lock;
+	vm_t *vm;
+	/* one KVM slot per chunk, in guest physical order */
+	std::vector<mem_t *> chunks;
+	Mapper &mapper;
+	/* bytes registered with KVM, grows up to maxSize. only
+	 * changed under the lock, and never shrinks. translation
+	 * reads it without the lock: grow() publishes a new size
+	 * only once the chunk behind it is mapped */
+	std::atomic<size_t> size;
+	size_t maxSize;
+	/* maxSize bytes of host address space, so translation
+	 * stays a subtraction however many chunks there are */
+	void *virtBase;
+	addr_t physBase;
+	/* maxSize / PAGE_SIZE entries. zero pages of it are not
+	 * touched until a frame in their range is claimed */
+	PageFrame *frames;
+
+private:
 	struct MemoryBlock {
 		addr_t guestPhysical;
 		mutable size_t len;
@@ -68,19 +255,47 @@ private:
 		{ return guestPhysical; }
 	};
 
-	std::recursive_mutex lock;
-	vm_t *vm;
-	mem_t *mem;
-	size_t size;
-	void *virtBase;
-	addr_t physBase;
 	std::set<MemoryBlock, MemoryBlockComparator<MemoryBlock>> blocks;
+
+	/* freed ranges still backed by host memory, coalesced.
+	 * the allocators prefer low addresses, so the reclaimer
+	 * starts from the top and leaves the hot end alone */
+	std::map<addr_t, size_t> reclaimQueue;
+	size_t queuedBytes;
+	/* once more than highWater bytes are queued, the reclaimer
+	 * releases memory until lowWater bytes are left */
+	size_t lowWater;
+	size_t highWater;
+	bool reclaimScheduled;
+	bool reclaimerUsed;
+	uint64_t reclaimedBytes;
+
+	/* set while the slots log dirty pages. host writes go to
+	 * hostDirty, which covers maxSize, until the next fetch */
+	std::atomic<bool> dirtyLogging;
+	DirtyBitmap hostDirty;
 public:
+	/* starts with _size bytes and grows on demand up to _maxSize,
+	 * 0 keeps it at _size. the mapper maps _maxSize bytes up front,
+	 * which costs address space only unless it reserves memory */
 	MemoryPool(vm_t *_vm, addr_t _physBase, size_t _size,
-		Mapper &mapper = DefaultHostMemoryMapper::instance);
+		Mapper &_mapper = DefaultHostMemoryMapper::instance,
+		size_t _maxSize = 0);
+
+	MemoryPool(MemoryPool &) = delete;
+
+	/* removes the KVM slots and releases the host memory */
+	virtual ~MemoryPool();
+
+	/* a pool for another VM with the same allocations, backed
+	 * by mapper. with a private mapping of this pool's memfd
+	 * the clone shares memory until written */
+	virtual std::unique_ptr<MemoryPool> clone(vm_t *_vm, Mapper &_mapper);
 
 	virtual addr_t getPhysicalMemoryBlock(size_t len);
 
+	virtual addr_t getAlignedPhysicalMemoryBlock(size_t len, size_t align);
+
 	virtual void freePhysicalMemoryBlock(addr_t addr, size_t len);
 
 
@@ -88,30 +303,319 @@ public:
 
 	virtual addr_t getPhysicalFromHostVirtual(void *hostVirtual) const;
 
+	virtual void getPhysicalPages(addr_t *pages, size_t n);
+
+	virtual void freePhysicalPages(const addr_t *pages, size_t n);
+
+	virtual FrameIndex getFrameIndex(addr_t guestPhysical) const;
+	virtual addr_t getFramePhysical(FrameIndex frame) const;
+	virtual PageFrame &getFrame(FrameIndex frame);
+
+	/* drop every allocation and zero the backing memory */
+	virtual void reset();
+
+	/* the allocation state as a flat list, for snapshots.
+	 * loadState() expects the same pool type */
+	virtual void saveState(std::vector<uint64_t> &state);
+	virtual void loadState(const std::vector<uint64_t> &state);
+
+	size_t getSize() const
+	{ return size.load(std::memory_order_acquire); }
+
+	size_t getMaxSize() const
+	{ return maxSize; }
+
+	addr_t getPhysicalBase() const
+	{ return physBase; }
+
+	/* pages of the backing memory resident in the host */
+	size_t residentPages() const;
+
+	size_t residentBytes() const
+	{ return residentPages() * PAGE_SIZE; }
+
+	void setReclaimThresholds(size_t _lowWater, size_t _highWater);
+
+	/* release queued memory down to the low water mark,
+	 * normally called by MemoryReclaimer */
+	void reclaim();
+
+	/* the guest reported the range as free. it stays allocated
+	 * and mapped, and reads back as zero when touched again. only
+	 * 4 KiB region frames can be reported. false if the range
+	 * is not one the guest may give up */
+	bool balloon(addr_t guestPhysical, size_t len);
+
+	ReclaimStats getReclaimStats();
+
+	/* log guest writes in KVM, and host writes reported
+	 * through markDirty(), on every slot of the pool */
+	void startDirtyLog();
+	void stopDirtyLog();
+
+	bool isDirtyLogging() const
+	{ return dirtyLogging; }
+
+	/* the pages written since the last fetch or startDirtyLog(),
+	 * covering getSize() bytes. clears the log */
+	void fetchDirtyLog(DirtyBitmap &bitmap);
+
+	virtual void markDirty(addr_t guestPhysical, size_t len);
+
+	/* fn(guestPhysical) for every dirty page, in address order */
+	template<typename Fn>
+	void forEachDirtyPage(const DirtyBitmap &bitmap, Fn fn) const
+	{
+		for (size_t i = 0; i < bitmap.size(); i++) {
+			for (uint64_t word = bitmap[i]; word; word &= word - 1)
+				fn(physBase + (i * 64 + __builtin_ctzll(word)) *
+					PAGE_SIZE);
+		}
+	}
+
+protected:
+	/* copies the allocation state, not the memory */
+	MemoryPool(vm_t *_vm, MemoryPool &other, Mapper &_mapper);
+
+	/* take over other's frame table, for clones */
+	void copyFrames(const MemoryPool &other);
+
+	/* register another chunk so that at least minSize bytes are
+	 * usable. false if that is more than maxSize */
+	bool grow(size_t minSize);
+
+	/* a grown chunk, for the allocator to hand out */
+	virtual void addChunk(addr_t start, size_t len) {}
+
+	/* called with the lock held by the allocators on
+	 * every free and allocation */
+	void queueReclaim(addr_t addr, size_t len);
+	void unqueueReclaim(addr_t addr, size_t len);
+
+	/* when the allocation state is replaced */
+	void clearReclaimQueue();
+
 private:
 	auto getBlockIterator(addr_t addr, size_t len);
 };
 
+/* One thread that gives freed memory of all pools back to the host
+ * in the background, so freeing stays cheap for the vcpus */
+class MemoryReclaimer {
+private:
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<MemoryPool *> pending;
+	/* the pool being reclaimed right now */
+	MemoryPool *busy;
+	bool stopping;
+	std::thread thread;
+public:
+	static MemoryReclaimer &instance();
+
+	MemoryReclaimer(MemoryReclaimer &) = delete;
+
+	~MemoryReclaimer();
+
+	void schedule(MemoryPool *pool);
+
+	/* forget the pool, waiting for a reclaim in progress */
+	void cancel(MemoryPool *pool);
+
+private:
+	MemoryReclaimer();
+
+	void run();
+};
+
+/* Power-of-two buddy allocator over the same backing as MemoryPool.
+ * Blocks are naturally aligned in guest physical space and a block
+ * must be freed with the length it was allocated with, which the
+ * frame table records. */
+class BuddyMemoryPool: public MemoryPool {
+private:
+	static constexpr unsigned minOrder = 12;	/* PAGE_SIZE */
+	static constexpr unsigned maxOrder = 30;	/* 1 GiB */
+
+	/* marks an allocated block in the saved state */
+	static constexpr uint64_t allocatedBlock = 1ULL << 63;
+
+	/* free blocks of each order, keyed by guest physical address */
+	std::array<std::set<addr_t>, maxOrder + 1> freeLists;
+public:
+	BuddyMemoryPool(vm_t *_vm, addr_t _physBase, size_t _size,
+		Mapper &_mapper = DefaultHostMemoryMapper::instance,
+		size_t _maxSize = 0);
+
+	virtual addr_t getPhysicalMemoryBlock(size_t len);
+
+	virtual addr_t getAlignedPhysicalMemoryBlock(size_t len, size_t align);
+
+	virtual void freePhysicalMemoryBlock(addr_t addr, size_t len);
+
+	virtual void reset();
+
+	virtual std::unique_ptr<MemoryPool> clone(vm_t *_vm, Mapper &_mapper);
+
+	virtual void saveState(std::vector<uint64_t> &state);
+	virtual void loadState(const std::vector<uint64_t> &state);
+
+private:
+	BuddyMemoryPool(vm_t *_vm, BuddyMemoryPool &other, Mapper &_mapper);
+
+	static unsigned orderOf(size_t len);
+
+	addr_t allocateOrder(unsigned order, unsigned alignOrder);
+
+	void addFreeRange(addr_t start, size_t len);
+
+	virtual void addChunk(addr_t start, size_t len)
+	{ addFreeRange(start, len); }
+};
+
+
+/* Caches single frames of another pool in per-thread magazines,
+ * so PAGE_SIZE allocations on the fault path rarely take the
+ * backing pool's lock. Magazines are refilled and drained in batches. */
+class CachingMemoryPool: public AbstractMemoryPool {
+public:
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t refills;
+		uint64_t drains;
+	};
+
+private:
+	static constexpr size_t magazineSize = 64;
+	static constexpr size_t batchSize = 32;
+
+	struct alignas(64) Magazine {
+		std::mutex lock;
+		size_t count = 0;
+		addr_t pages[magazineSize];
+		Stats stats = {};
+	};
+
+	AbstractMemoryPool &backing;
+	size_t nMagazines;
+	std::unique_ptr<Magazine[]> magazines;
+public:
+	/* nMagazines = 0 picks one per hardware thread */
+	CachingMemoryPool(AbstractMemoryPool &_backing, size_t _nMagazines = 0);
+
+	CachingMemoryPool(CachingMemoryPool &) = delete;
+
+	virtual ~CachingMemoryPool();
+
+	virtual addr_t getPhysicalMemoryBlock(size_t len);
+
+	virtual addr_t getAlignedPhysicalMemoryBlock(size_t len, size_t align);
+
+	virtual void freePhysicalMemoryBlock(addr_t addr, size_t len);
+
+	virtual void *getHostVirtualFromPhysical(addr_t addr) const
+	{ return backing.getHostVirtualFromPhysical(addr); }
+
+	virtual addr_t getPhysicalFromHostVirtual(void *hostVirtual) const
+	{ return backing.getPhysicalFromHostVirtual(hostVirtual); }
+
+	virtual FrameIndex getFrameIndex(addr_t guestPhysical) const
+	{ return backing.getFrameIndex(guestPhysical); }
+
+	virtual void markDirty(addr_t guestPhysical, size_t len)
+	{ backing.markDirty(guestPhysical, len); }
+
+	virtual addr_t getFramePhysical(FrameIndex frame) const
+	{ return backing.getFramePhysical(frame); }
+
+	virtual PageFrame &getFrame(FrameIndex frame)
+	{ return backing.getFrame(frame); }
+
+	/* return every cached frame to the backing pool */
+	void drain();
+
+	Stats getStats();
+
+private:
+	Magazine &currentMagazine();
+};
 
 class MemorySpace;
 
 class MemoryRegion {
+public:
+	struct FaultStats {
+		uint64_t faults;
+		uint64_t pagesMapped;
+	};
+
+	/* populated pages by the number of scans they have been idle
+	 * for: 0, 1, 2-3, 4-7, ... and the last bucket from 128 on */
+	static constexpr size_t IDLE_BUCKETS = 9;
+	using IdleHistogram = std::array<uint64_t, IDLE_BUCKETS>;
+
+	struct SwapStats {
+		/* pages swapped out so far, and the zero pages among
+		 * them, which are stored without data */
+		uint64_t pagesOut;
+		uint64_t zeroPagesOut;
+		uint64_t pagesIn;
+		/* idle pages kept because they did not compress enough */
+		uint64_t incompressible;
+		/* swapped out now, and the compressed bytes they take */
+		uint64_t swappedPages;
+		uint64_t storedBytes;
+		/* spent decompressing on faults */
+		uint64_t swapInNanos;
+	};
+
 private:
 	std::recursive_mutex lock;
+
+	/* fault-around window in pages, between the configured
+	 * bounds. it doubles while faults stay sequential */
+	size_t minWindow;
+	size_t maxWindow;
+	size_t window;
+	size_t lastWindowEnd;
+	FaultStats stats;
+
+protected:
 	addr_t guestVirtualAddr;
 	size_t len;
+	/* PAGE_SIZE, PAGE_SIZE_2M or PAGE_SIZE_1G */
+	size_t pageSize;
+	bool writable;
 	
-	std::vector<GuestPhysicalPagePtr> physicalPages;
+	/* one entry per pageSize page, the index of its first
+	 * frame in the pool or NO_FRAME while it is not populated.
+	 * 4 bytes a page where a shared GuestPhysicalPage took 64 */
+	std::vector<FrameIndex> frames;
+	/* scans of the accessed bits each page has been idle for,
+	 * saturating. 0 when it is mapped */
+	std::vector<uint8_t> idleAges;
+	/* compressed copies of swapped out pages by index, their
+	 * frames are back in the pool. zero pages have no data */
+	std::unordered_map<size_t, std::vector<uint8_t>> swapped;
+	SwapStats swapStats;
 	MemorySpace *memorySpace;
 	bool isKernel;
 
 public:
-	MemoryRegion(addr_t guestVirt, size_t _len);
+	virtual ~MemoryRegion() {}
 
-	MemoryRegion(MemoryRegion &) = delete; // TODO: delete for now
+	/* 1 GiB pages also need PDPE1GB in the guest's CPUID */
+	MemoryRegion(addr_t guestVirt, size_t _len, size_t _pageSize = PAGE_SIZE);
+
+	MemoryRegion(MemoryRegion &) = delete;
 
 	virtual	void fault(addr_t guestVirtualPage, uint32_t errorcode) = 0;
 
+	/* a copy for a cloned MemorySpace. it is bound to
+	 * the new space and pool by MemorySpace */
+	virtual std::shared_ptr<MemoryRegion> clone() = 0;
+
 	void setMemorySpace(MemorySpace *_memorySpace)
 	{ memorySpace = _memorySpace; }
 	
@@ -121,35 +625,322 @@ public:
 	addr_t getKey() const
 	{ return guestVirtualAddr; }
 
+	size_t getLength() const
+	{ return len; }
+
+	size_t getPageSize() const
+	{ return pageSize; }
+
+	/* map up to maxPages aligned pages around each fault, starting
+	 * at minPages. both must be powers of two */
+	void setFaultAround(size_t minPages, size_t maxPages);
+
+	FaultStats getFaultStats();
+
+	IdleHistogram getIdleHistogram();
+
+	/* bytes in populated pages accessed within the last idleScans
+	 * scans. 0 counts only pages mapped since the last one */
+	size_t getWorkingSetSize(unsigned idleScans = 1);
+
+	/* compress the pages idle for at least minIdleScans scans and
+	 * unmap them. their frames are appended to released, for
+	 * releaseFrame() once no vcpu can reach them through its TLB.
+	 * the next fault brings them back in. returns the number of
+	 * pages. vcpus of the space must not be in the guest, they
+	 * could still write a page while it is compressed */
+	size_t swapOut(unsigned minIdleScans, std::vector<FrameIndex> &released);
+
+	SwapStats getSwapStats();
+
+protected:
+	/* for clone(). MemorySpace holds other's lock meanwhile */
+	MemoryRegion(const MemoryRegion &other);
+
+	/* count a fault at page index and pick the window to
+	 * populate for it. returns the number of pages */
+	size_t faultWindow(size_t index, size_t &first);
+
+	/* map the pages in [first, first + n) that are not mapped yet,
+	 * with one getPages() call and one page table walk */
+	void populate(size_t first, size_t n);
+
+	/* point the page at offset to guestPhysical,
+	 * using a huge page entry if the region has one */
+	PageTableEntry *installPage(size_t offset, addr_t guestPhysical,
+			bool writable);
+
+	/* move a clone to its space and pool */
+	virtual void rebind(MemorySpace *_memorySpace, AbstractMemoryPool *pool)
+	{ memorySpace = _memorySpace; }
+
+	/* fill page with the swapped out copy of the page at index
+	 * and drop the copy. false if the page is not swapped out */
+	bool swapIn(size_t index, void *page);
+
 private:
 	virtual PageTableEntry *mapPage(size_t offset) = 0;
 
+	/* fill frames[indices[i]] for n pages about to be mapped */
+	virtual void getPages(const size_t *indices, size_t n) = 0;
+
+	/* guest physical address of a populated page */
+	virtual addr_t getPagePhysical(size_t index) = 0;
+
+	/* regions whose pages swapOut() may take */
+	virtual bool canSwap() const
+	{ return false; }
+
+	/* give back the frame of a page swapped out */
+	virtual void releaseFrame(FrameIndex frame) {}
+
+	/* the host memory behind a guest physical address outside
+	 * the pool, for regions with slots of their own */
+	virtual void *getWindowHostVirtual(addr_t guestPhysical)
+	{ return nullptr; }
+
 	friend class MemorySpace;
 
 };
 
 class MemorySpace {
 private:
+	/* taken to add page table pages only. faults walk and
+	 * fill in the tables with single 64-bit atomic accesses */
 	std::recursive_mutex lock;
 	void *pageTableV;
 	addr_t pageTableP;
 
-	using MemoryRegionPtr = ComparablePointerAdapter<std::shared_ptr<MemoryRegion>>;
-	std::set<MemoryRegionPtr, MemoryBlockComparator<MemoryRegionPtr>> regions;
+	/* regions sorted by address. an update copies the index,
+	 * publishes the copy and frees the old one after every
+	 * reader that might still see it has left (see RegionReader).
+	 * faults never block on writers */
+	using RegionIndex = std::vector<std::shared_ptr<MemoryRegion>>;
+	std::atomic<const RegionIndex *> regions;
+	std::atomic<unsigned> regionEpoch;
+	std::atomic<uint64_t> regionReaders[2];
+	/* serializes writers */
+	std::mutex regionLock;
+
+	class RegionReader {
+	private:
+		MemorySpace &space;
+		unsigned slot;
+	public:
+		RegionReader(MemorySpace &_space);
+		~RegionReader();
+		const RegionIndex &index();
+	};
+
 	AbstractMemoryPool *memoryPool;
+	/* page tables and the vcpus' TLB mailboxes */
 	std::vector<GuestPhysicalPage> pageTablePages;
-	// TODO: we need a task list here to flush tlbs
-	
+
+public:
+	struct TlbStats {
+		/* flushTlb() calls that had something to flush */
+		uint64_t batches;
+		/* batches too large to flush page by page */
+		uint64_t fullFlushes;
+		/* pages flushed with invlpg */
+		uint64_t pages;
+		/* batches handed to a vcpu on entry */
+		uint64_t deliveries;
+		/* whole TLBs dropped from the host after a kick */
+		uint64_t hostFlushes;
+	};
+
+private:
+	/* a committed flush, vcpus pick up every batch
+	 * newer than the generation in their mailbox */
+	struct TlbBatch {
+		uint64_t generation;
+		bool full;
+		std::vector<addr_t> pages;
+	};
+
+	/* batches kept for vcpus that have not entered since. one
+	 * further behind than this gets a full flush */
+	static constexpr size_t TLB_LOG_MAX = 16;
+
+	std::mutex tlbLock;
+	/* invalidations not committed yet, coalesced start -> end */
+	std::map<addr_t, addr_t> tlbPending;
+	std::deque<TlbBatch> tlbLog;
+	uint64_t tlbGeneration;
+	TlbStats tlbStats;
+
+	/* a removed region, or frames swapped out of one, unmapped in
+	 * generation. vcpus may still reach them through their TLBs
+	 * until every mailbox has flushed that far */
+	struct Retired {
+		uint64_t generation;
+		std::shared_ptr<MemoryRegion> region;
+		/* empty for a removed region, which goes as a whole */
+		std::vector<FrameIndex> frames;
+	};
+	std::deque<Retired> retired;
+
+	/* registered with WorkingSetScanner */
+	bool scanned;
+	/* see setTlbKick() */
+	std::function<void()> tlbKick;
+
+	/* the space's PCID, taken from the VM of the first vcpu it is
+	 * applied to. 0 if that vcpu has no PCIDs or they ran out */
+	vm_t *pcidVm;
+	uint32_t pcid;
+	/* ids of the vcpus that may hold translations under the tag */
+	std::set<int> pcidLoaded;
+
 public:
 	MemorySpace(AbstractMemoryPool *_memoryPool);
 
-	void apply(vcpu_t *vcpu);
+	MemorySpace(MemorySpace &) = delete;
+
+	/* duplicate other's page tables and regions in a cloned pool.
+	 * guest physical addresses are the same in both pools */
+	MemorySpace(MemorySpace &other, AbstractMemoryPool *_memoryPool);
+
+	/* rebuild a space from saveState() in a restored pool */
+	MemorySpace(AbstractMemoryPool *_memoryPool,
+			const std::vector<uint64_t> &state);
+
+	/* returns the page table pages to the pool */
+	~MemorySpace();
+
+	/* page table pages for snapshots. regions are not
+	 * serializable yet, so the space must not have any */
+	void saveState(std::vector<uint64_t> &state);
+
+	/* point the vcpu's CR3 at this space and its GS base at the
+	 * vcpu's TLB mailbox. current is the space the vcpu is running
+	 * in, if any. with PCIDs the guest then does the switch on its
+	 * next resume and keeps the tagged translations of both spaces.
+	 * a CR3 set through KVM always drops the whole TLB */
+	void apply(vcpu_t *vcpu, MemorySpace *current = nullptr);
+
+	/* for a cloned or restored space: take over the PCID in the
+	 * vcpu's CR3, which came along from the other VM */
+	void adoptPcid(vcpu_t *vcpu);
+
+	/* regions must not overlap */
+	void addRegion(std::shared_ptr<MemoryRegion> region);
+
+	/* false, and nothing added, if the region overlaps another */
+	bool tryAddRegion(std::shared_ptr<MemoryRegion> region);
+
+	/* unmap the region starting at guestVirtual. vcpus stop
+	 * seeing it once they have entered the guest again, its
+	 * memory goes back to the pool after that */
+	void removeRegion(addr_t guestVirtual);
+
+	/* log the fault-around statistics of each region */
+	void logFaultStats();
+
+	/* one pass over the accessed bits of every populated page.
+	 * pages accessed since the last pass become 0 scans idle,
+	 * the others age by one. the bits are cleared and flushed
+	 * from the TLB in a single batch */
+	void scanAccessed();
+
+	/* have WorkingSetScanner call scanAccessed() periodically,
+	 * until the space is destroyed */
+	void trackWorkingSet();
+
+	/* called after a scan has queued its flush, to bring the
+	 * vcpus out of the guest for it, e.g. VcpuManager::kick().
+	 * otherwise a vcpu that never exits keeps using its TLB
+	 * and its pages look idle. set before trackWorkingSet() */
+	void setTlbKick(std::function<void()> kick)
+	{ tlbKick = std::move(kick); }
+
+	/* summed over the regions, see MemoryRegion */
+	size_t getWorkingSetSize(unsigned idleScans = 1);
+	size_t swapOut(unsigned minIdleScans);
+	MemoryRegion::SwapStats getSwapStats();
 
-	void flushTlb(addr_t guestVirtualPage);
+	/* log the compression ratio, bytes saved and swap-in
+	 * latency over the regions */
+	void logSwapStats();
 
+	PageTableEntry *mapPage(addr_t guestVirtual, addr_t guestPhysical,
+			size_t pageSize, bool writable, bool user);
+
+	/* map n pages, sorted by guest virtual address. 4 KiB pages
+	 * in the same leaf table share a single walk */
+	void mapPages(const addr_t *guestVirtual, const addr_t *guestPhysical,
+			size_t n, size_t pageSize, bool writable, bool user);
+
+	/* queue the range for invalidation at the next flushTlb() */
+	void invalidate(addr_t guestVirtual, size_t len);
+
+	/* commit the queued invalidations as one batch. vcpus are
+	 * not interrupted, each gets the batch at its next entry */
+	void flushTlb();
+
+	/* hand the vcpu the batches it has not seen yet, call
+	 * before entering the guest. a vcpu that was kicked is not
+	 * in the kernel to drain its mailbox, its TLB is flushed
+	 * from the host instead. also gives back retired memory
+	 * the vcpus have flushed */
+	void syncTlb(vcpu_t *vcpu);
+
+	TlbStats getTlbStats();
+
+	/* resolve a page fault with the PF_* error code. false if
+	 * no region covers the page or the access is not allowed */
 	bool fault(addr_t guestVirtualPage, uint32_t errorcode);
+
+	/* copy from or to guest virtual memory in the pool, faulting
+	 * region pages in on the way. false if part of the range is not
+	 * mapped, or not writable for writeGuest() */
+	bool readGuest(addr_t guestVirtual, void *buf, size_t len);
+	bool writeGuest(addr_t guestVirtual, const void *buf, size_t len);
+
+	/* the guest physical extents behind a guest virtual range,
+	 * faulting pages in like readGuest(), merged where they are
+	 * contiguous. false as well if part of it is not in the pool,
+	 * e.g. a file window */
+	bool getGuestExtents(addr_t guestVirtual, size_t len, bool write,
+			std::vector<GuestExtent> &extents);
 private:
-	PageTableEntry *getPTE(addr_t guestVirtual, bool create = false);
+	/* walks down to the entry mapping a page of pageSize.
+	 * huge page entries found on the way are returned as is */
+	PageTableEntry *getPTE(addr_t guestVirtual, bool create = false,
+			size_t pageSize = PAGE_SIZE);
+
+	/* the guest physical address guestVirtual maps to, or ~0 if
+	 * it is not mapped, or not writable when write is set */
+	addr_t translate(addr_t guestVirtual, bool write);
+
+	bool copyGuest(addr_t guestVirtual, void *buf, size_t len, bool write);
+
+	/* the vcpu's mailbox in this space, nullptr before apply() */
+	struct tlb_mailbox *getMailbox(vcpu_t *vcpu);
+
+	/* the oldest generation flushed over the mailboxes, ~0 if
+	 * there are none. called with tlbLock held */
+	uint64_t getFlushedGeneration();
+
+	/* keep region, or the frames it gave up, until the vcpus
+	 * have flushed the current generation */
+	void retire(std::shared_ptr<MemoryRegion> region,
+			std::vector<FrameIndex> frames = {});
+
+	/* give back what every mailbox has flushed */
+	void releaseRetired();
+
+	/* the CR3 to load for this space on the vcpu, with the no-flush
+	 * bit if the vcpu may still hold valid translations under the
+	 * tag. called with tlbLock held */
+	uint64_t tagCr3(vcpu_t *vcpu);
+
+	/* the region covering addr, or nullptr */
+	static MemoryRegion *findRegion(const RegionIndex &index, addr_t addr);
+
+	/* swap in a new index, called with regionLock held */
+	void publishRegions(const RegionIndex *index);
 
 	template <typename T>
 	T *castGuestPhysical(addr_t addr)
@@ -161,4 +952,40 @@ private:
 	friend class MemoryRegion;
 };
 
+/* One thread that scans the accessed bits of the registered spaces
+ * every interval, so their working sets can be read at any time */
+class WorkingSetScanner {
+private:
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<MemorySpace *> spaces;
+	/* the space being scanned right now */
+	MemorySpace *busy;
+	std::chrono::milliseconds interval;
+	/* the interval changed, wait again from now */
+	bool restart;
+	bool stopping;
+	std::thread thread;
+public:
+	static WorkingSetScanner &instance();
+
+	WorkingSetScanner(WorkingSetScanner &) = delete;
+
+	~WorkingSetScanner();
+
+	void add(MemorySpace *space);
+
+	/* forget the space, waiting for a scan in progress */
+	void remove(MemorySpace *space);
+
+	/* a page is idle for one scan when it has not been
+	 * accessed for this long */
+	void setInterval(std::chrono::milliseconds _interval);
+
+private:
+	WorkingSetScanner();
+
+	void run();
+};
+
 #endif
@@ -0,0 +1,166 @@
+#include "pagecache.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.hpp"
+#include "memory.hpp"
+
+PageCache &PageCache::instance()
+{
+	static PageCache pageCache;
+
+	return pageCache;
+}
+
+PageCache::PageCache()
+	: unusedBytes(0), capacity(defaultCapacity), stats()
+{
+}
+
+PageCache::~PageCache()
+{
+	/* files still in use belong to VMs torn down after us */
+	trim();
+}
+
+PageCache::File *PageCache::acquire(vm_t *vm, int fd, size_t len)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return nullptr;
+
+	Key key(st.st_dev, st.st_ino, st.st_size,
+		st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+
+	std::lock_guard<std::mutex> guard(lock);
+	Entry *entry;
+	auto it = entries.find(key);
+
+	if (it != entries.end()) {
+		entry = it->second;
+		if (entry->users.empty()) {
+			unused.erase(entry->lru);
+			unusedBytes -= entry->len;
+		}
+		stats.hits++;
+	} else {
+		size_t fileLen = alignUp(st.st_size, PAGE_SIZE);
+		void *hostVirtual = mmap(NULL, fileLen, PROT_READ, MAP_SHARED,
+				fd, 0);
+
+		if (hostVirtual == MAP_FAILED) {
+			console->warn("Cannot cache file {}:{}: {}", st.st_dev,
+					st.st_ino, strerror(errno));
+			return nullptr;
+		}
+
+		entry = new Entry();
+		entry->hostVirtual = hostVirtual;
+		entry->len = fileLen;
+		entry->key = key;
+		entries.emplace(key, entry);
+
+		stats.misses++;
+		stats.cachedBytes += fileLen;
+	}
+
+	entry->users[vm]++;
+	vms[vm].sharedBytes += len;
+	stats.sharedBytes += len;
+
+	return entry;
+}
+
+void PageCache::release(vm_t *vm, File *file, size_t len)
+{
+	auto *entry = static_cast<Entry *>(file);
+	std::lock_guard<std::mutex> guard(lock);
+	auto user = entry->users.find(vm);
+
+	if (user == entry->users.end()) {
+		console->error("Cached file released by a VM not using it");
+		std::abort();
+	}
+
+	if (!--user->second)
+		entry->users.erase(user);
+
+	vms[vm].sharedBytes -= len;
+	stats.sharedBytes -= len;
+	forget(vm);
+
+	if (!entry->users.empty()) return;
+
+	unused.push_front(entry);
+	entry->lru = unused.begin();
+	unusedBytes += entry->len;
+	evict(capacity);
+}
+
+void PageCache::addPrivate(vm_t *vm, ssize_t len)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	vms[vm].privateBytes += len;
+	stats.privateBytes += len;
+	forget(vm);
+}
+
+void PageCache::setCapacity(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	capacity = bytes;
+	evict(capacity);
+}
+
+void PageCache::trim()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	evict(0);
+}
+
+PageCache::Stats PageCache::getStats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return stats;
+}
+
+PageCache::VmStats PageCache::getVmStats(vm_t *vm)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = vms.find(vm);
+
+	return it == vms.end() ? VmStats() : it->second;
+}
+
+void PageCache::evict(size_t limit)
+{
+	while (unusedBytes > limit) {
+		Entry *entry = unused.back();
+
+		unused.pop_back();
+		unusedBytes -= entry->len;
+
+		munmap(entry->hostVirtual, entry->len);
+		entries.erase(entry->key);
+		stats.cachedBytes -= entry->len;
+		stats.evictions++;
+		delete entry;
+	}
+}
+
+void PageCache::forget(vm_t *vm)
+{
+	auto it = vms.find(vm);
+
+	/* the VM may be gone, and its address reused */
+	if (it != vms.end() && !it->second.sharedBytes &&
+		!it->second.privateBytes)
+		vms.erase(it);
+}
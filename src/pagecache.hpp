@@ -0,0 +1,105 @@
+#ifndef PAGECACHE_HPP
+#define PAGECACHE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include "kvm.h"
+
+/* Read-only host files mapped once for the whole process. The VMs
+ * put the same host pages behind their own KVM_MEM_READONLY slots,
+ * so a file read by many sandboxes is mapped, and has its host page
+ * tables filled in, only once. Files no VM holds stay mapped for the
+ * next one, the least recently used go beyond the capacity */
+class PageCache {
+public:
+	/* a cached file, mapped whole */
+	struct File {
+		void *hostVirtual;
+		size_t len;
+	};
+
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		/* host bytes mapped by the cache, in use or not */
+		uint64_t cachedBytes;
+		/* read-only file bytes the VMs map from the cache,
+		 * each VM counted. what it costs without the cache */
+		uint64_t sharedBytes;
+		/* file bytes the VMs map privately, copy-on-write */
+		uint64_t privateBytes;
+	};
+
+	struct VmStats {
+		uint64_t sharedBytes;
+		uint64_t privateBytes;
+	};
+
+	static constexpr size_t defaultCapacity = 1ULL << 30;
+
+private:
+	/* device, inode, size and modification time. a file changed
+	 * on disk gets a new entry */
+	using Key = std::tuple<dev_t, ino_t, off_t, int64_t>;
+
+	struct Entry: File {
+		Key key;
+		/* the regions using the file, by VM */
+		std::unordered_map<vm_t *, unsigned> users;
+		/* in the LRU while nobody uses it */
+		std::list<Entry *>::iterator lru;
+	};
+
+	std::mutex lock;
+	std::map<Key, Entry *> entries;
+	/* unused entries, most recently used first */
+	std::list<Entry *> unused;
+	size_t unusedBytes;
+	size_t capacity;
+	std::unordered_map<vm_t *, VmStats> vms;
+	Stats stats;
+
+public:
+	static PageCache &instance();
+
+	PageCache(PageCache &) = delete;
+
+	~PageCache();
+
+	/* the whole of fd, for a region of len bytes in vm. nullptr if
+	 * it cannot be mapped. hand it back with release() */
+	File *acquire(vm_t *vm, int fd, size_t len);
+
+	void release(vm_t *vm, File *file, size_t len);
+
+	/* account len bytes of a private file mapping to vm, negative
+	 * when it goes */
+	void addPrivate(vm_t *vm, ssize_t len);
+
+	/* bytes kept mapped for files nobody uses */
+	void setCapacity(size_t bytes);
+
+	/* unmap every file nobody uses */
+	void trim();
+
+	Stats getStats();
+
+	VmStats getVmStats(vm_t *vm);
+
+private:
+	PageCache();
+
+	/* down to capacity, called with the lock held */
+	void evict(size_t limit);
+
+	void forget(vm_t *vm);
+};
+
+#endif
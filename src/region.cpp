@@ -0,0 +1,233 @@
+#include "region.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include "log.hpp"
+#include "pagecache.hpp"
+
+AnonymousMemoryRegion::AnonymousMemoryRegion(AbstractMemoryPool *_memoryPool,
+		addr_t guestVirt, size_t _len, size_t _pageSize)
+	: MemoryRegion(guestVirt, _len, _pageSize), memoryPool(_memoryPool)
+{
+}
+
+AnonymousMemoryRegion::~AnonymousMemoryRegion()
+{
+	for (FrameIndex frame : frames)
+		if (frame != NO_FRAME)
+			memoryPool->releaseFrame(frame, pageSize);
+}
+
+std::shared_ptr<MemoryRegion> AnonymousMemoryRegion::clone()
+{
+	/* the frames come along with the cloned pool */
+	return std::shared_ptr<MemoryRegion>(new AnonymousMemoryRegion(*this));
+}
+
+void AnonymousMemoryRegion::getPages(const size_t *indices, size_t n)
+{
+	std::vector<addr_t> pages(n);
+
+	if (pageSize == PAGE_SIZE) {
+		memoryPool->getPhysicalPages(pages.data(), n);
+	} else {
+		for (auto &page : pages)
+			page = memoryPool->getAlignedPhysicalMemoryBlock(
+					pageSize, pageSize);
+	}
+
+	uint16_t flags = pageSize == PAGE_SIZE ? 0 : FRAME_LARGE;
+
+	for (size_t i = 0; i < n; i++) {
+		void *page = memoryPool->getHostVirtualFromPhysical(pages[i]);
+
+		if (!swapIn(indices[i], page))
+			memset(page, 0, pageSize);
+		frames[indices[i]] =
+			memoryPool->claimFrame(pages[i], FRAME_REGION, flags);
+	}
+}
+
+void AnonymousMemoryRegion::releaseFrame(FrameIndex frame)
+{
+	memoryPool->releaseFrame(frame, pageSize);
+}
+
+void AnonymousMemoryRegion::rebind(MemorySpace *_memorySpace,
+		AbstractMemoryPool *pool)
+{
+	/* the cloned pool has a copy of the frame table,
+	 * so the frames and their references carry over */
+	MemoryRegion::rebind(_memorySpace, pool);
+	memoryPool = pool;
+}
+
+addr_t AnonymousMemoryRegion::getPagePhysical(size_t index)
+{
+	return memoryPool->getFramePhysical(frames[index]);
+}
+
+PageTableEntry *AnonymousMemoryRegion::mapPage(size_t offset)
+{
+	size_t index = offset / pageSize;
+
+	if (frames[index] == NO_FRAME) getPages(&index, 1);
+
+	return installPage(index * pageSize, getPagePhysical(index), writable);
+}
+
+void AnonymousMemoryRegion::fault(addr_t guestVirtualPage, uint32_t errorcode)
+{
+	size_t first;
+	size_t n = faultWindow((guestVirtualPage - guestVirtualAddr) / pageSize,
+			first);
+
+	populate(first, n);
+}
+
+FileMemoryRegion::FileMemoryRegion(vm_t *_vm, AbstractMemoryPool *_memoryPool,
+		addr_t guestVirt, size_t _len, int fd, off_t offset,
+		size_t dataLen, bool _writable, addr_t _window)
+	: MemoryRegion(guestVirt, _len), vm(_vm), memoryPool(_memoryPool),
+	hostVirtual(nullptr), mappedLen(alignUp(dataLen, PAGE_SIZE)),
+	window(_window), mem(nullptr), cached(nullptr)
+{
+	writable = _writable;
+
+	if (mappedLen > len || offset % PAGE_SIZE) {
+		console->error("Bad file region 0x{:x}+{}, data {} at {}",
+				guestVirt, len, dataLen, offset);
+		std::abort();
+	}
+
+	if (!mappedLen) return;
+
+	/* bss has to read as zero, so the tail of the
+	 * last data page needs a private copy */
+	shared = !writable && mappedLen == len && mappedLen == dataLen;
+
+	/* the same host pages for every VM reading the file */
+	if (shared) {
+		cached = PageCache::instance().acquire(vm, fd, mappedLen);
+		if (cached && (size_t)offset + mappedLen > cached->len) {
+			PageCache::instance().release(vm, cached, mappedLen);
+			cached = nullptr;
+		}
+	}
+
+	if (cached) {
+		hostVirtual = static_cast<char *>(cached->hostVirtual) + offset;
+	} else {
+		hostVirtual = mmap(NULL, mappedLen,
+			shared ? PROT_READ : PROT_READ | PROT_WRITE,
+			shared ? MAP_SHARED : MAP_PRIVATE, fd, offset);
+		if (hostVirtual == MAP_FAILED) {
+			console->error("Cannot mmap file at {}, length = {}",
+					offset, mappedLen);
+			std::abort();
+		}
+		if (!shared)
+			PageCache::instance().addPrivate(vm, mappedLen);
+	}
+
+	if (dataLen < mappedLen)
+		memset((char *)hostVirtual + dataLen, 0, mappedLen - dataLen);
+
+	mem = vm_map_guest_physical_flags(vm, hostVirtual, window, mappedLen,
+			shared ? KVM_MEM_READONLY : 0);
+	if (!mem) {
+		console->error("Cannot map file window 0x{:x}", window);
+		std::abort();
+	}
+}
+
+FileMemoryRegion::~FileMemoryRegion()
+{
+	for (size_t i = mappedLen / PAGE_SIZE; i < frames.size(); i++)
+		if (frames[i] != NO_FRAME)
+			memoryPool->releaseFrame(frames[i], PAGE_SIZE);
+
+	if (mem) vm_unmap_guest_physical(vm, mem);
+	if (cached) {
+		PageCache::instance().release(vm, cached, mappedLen);
+	} else if (hostVirtual) {
+		munmap(hostVirtual, mappedLen);
+		if (!shared)
+			PageCache::instance().addPrivate(vm, -(ssize_t)mappedLen);
+	}
+}
+
+void FileMemoryRegion::getPages(const size_t *indices, size_t n)
+{
+	std::vector<size_t> anonymous;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t offset = indices[i] * PAGE_SIZE;
+
+		if (offset < mappedLen)
+			frames[indices[i]] = FILE_FRAME;
+		else
+			anonymous.push_back(indices[i]);
+	}
+
+	if (anonymous.empty()) return;
+
+	/* bss pages, one batch from the pool */
+	std::vector<addr_t> pages(anonymous.size());
+	memoryPool->getPhysicalPages(pages.data(), pages.size());
+
+	for (size_t i = 0; i < anonymous.size(); i++) {
+		memset(memoryPool->getHostVirtualFromPhysical(pages[i]), 0,
+				PAGE_SIZE);
+		frames[anonymous[i]] =
+			memoryPool->claimFrame(pages[i], FRAME_REGION);
+	}
+}
+
+addr_t FileMemoryRegion::getPagePhysical(size_t index)
+{
+	if (frames[index] == FILE_FRAME)
+		return window + index * PAGE_SIZE;
+
+	return memoryPool->getFramePhysical(frames[index]);
+}
+
+void *FileMemoryRegion::getWindowHostVirtual(addr_t guestPhysical)
+{
+	if (guestPhysical < window || guestPhysical - window >= mappedLen)
+		return nullptr;
+
+	return static_cast<char *>(hostVirtual) + (guestPhysical - window);
+}
+
+PageTableEntry *FileMemoryRegion::mapPage(size_t offset)
+{
+	size_t index = offset / PAGE_SIZE;
+
+	if (frames[index] == NO_FRAME) getPages(&index, 1);
+
+	return installPage(index * PAGE_SIZE, getPagePhysical(index), writable);
+}
+
+void FileMemoryRegion::fault(addr_t guestVirtualPage, uint32_t errorcode)
+{
+	size_t first;
+	size_t n = faultWindow((guestVirtualPage - guestVirtualAddr) / PAGE_SIZE,
+			first);
+	size_t start = first * PAGE_SIZE;
+	size_t end = std::min((first + n) * PAGE_SIZE, mappedLen);
+
+	/* start reading the file for the rest of the window */
+	if (n > 1 && start < end)
+		madvise((char *)hostVirtual + start, end - start, MADV_WILLNEED);
+
+	populate(first, n);
+}
+
+std::shared_ptr<MemoryRegion> FileMemoryRegion::clone()
+{
+	/* the window slot belongs to this VM */
+	console->error("File backed regions cannot be cloned");
+	std::abort();
+}
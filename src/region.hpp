@@ -0,0 +1,86 @@
+#ifndef REGION_HPP
+#define REGION_HPP
+
+#include <sys/types.h>
+#include "kvm.h"
+#include "memory.hpp"
+#include "pagecache.hpp"
+
+/* Zero-filled memory from the pool, e.g. heap and stacks.
+ * Frames are allocated on fault, a fault-around window at a time */
+class AnonymousMemoryRegion: public MemoryRegion {
+private:
+	AbstractMemoryPool *memoryPool;
+public:
+	AnonymousMemoryRegion(AbstractMemoryPool *_memoryPool,
+		addr_t guestVirt, size_t _len, size_t _pageSize = PAGE_SIZE);
+
+	virtual ~AnonymousMemoryRegion();
+
+	virtual void fault(addr_t guestVirtualPage, uint32_t errorcode);
+
+	virtual std::shared_ptr<MemoryRegion> clone();
+
+private:
+	AnonymousMemoryRegion(const AnonymousMemoryRegion &other) = default;
+
+	virtual PageTableEntry *mapPage(size_t offset);
+
+	virtual void getPages(const size_t *indices, size_t n);
+
+	virtual addr_t getPagePhysical(size_t index);
+
+	virtual void rebind(MemorySpace *_memorySpace, AbstractMemoryPool *pool);
+
+	virtual bool canSwap() const
+	{ return pageSize == PAGE_SIZE; }
+
+	virtual void releaseFrame(FrameIndex frame);
+};
+
+/* Maps part of a host file into guest virtual memory. The file data
+ * lives in its own memory slot at a guest physical window: read-only
+ * ranges come from the PageCache through a KVM_MEM_READONLY slot,
+ * anything writable or followed by bss is a private copy-on-write
+ * mapping. Pages past the file data are zeroed frames from the pool.
+ * Nothing is mapped until the guest faults on it. */
+class FileMemoryRegion: public MemoryRegion {
+private:
+	vm_t *vm;
+	AbstractMemoryPool *memoryPool;
+
+	/* the file backed part, page aligned */
+	void *hostVirtual;
+	size_t mappedLen;
+	addr_t window;
+	mem_t *mem;
+	bool shared;
+	/* where hostVirtual is from, if shared */
+	PageCache::File *cached;
+
+	/* marks a page backed by the file at window + offset */
+	static constexpr FrameIndex FILE_FRAME = NO_FRAME - 1;
+public:
+	/* maps dataLen bytes of fd at offset to the start of the region.
+	 * offset and guestVirt must be page aligned */
+	FileMemoryRegion(vm_t *_vm, AbstractMemoryPool *_memoryPool,
+		addr_t guestVirt, size_t _len, int fd, off_t offset,
+		size_t dataLen, bool _writable, addr_t _window);
+
+	virtual ~FileMemoryRegion();
+
+	virtual void fault(addr_t guestVirtualPage, uint32_t errorcode);
+
+	virtual std::shared_ptr<MemoryRegion> clone();
+
+private:
+	virtual PageTableEntry *mapPage(size_t offset);
+
+	virtual void getPages(const size_t *indices, size_t n);
+
+	virtual addr_t getPagePhysical(size_t index);
+
+	virtual void *getWindowHostVirtual(addr_t guestPhysical);
+};
+
+#endif
@@ -0,0 +1,499 @@
+#include "ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+#include <emmintrin.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "log.hpp"
+#include "region.hpp"
+
+static_assert(sizeof(struct syscall_ring) <= PAGE_SIZE,
+		"the syscall ring must fit in a page");
+
+/* the guest's own layout is below, the canonical lower half above */
+static constexpr addr_t mmapBase = KERNEL_STACK_TOP;
+static constexpr addr_t mmapLimit = 1ULL << 47;
+
+static constexpr size_t bounceSize = 64 << 10;
+
+SyscallRing::SyscallRing(MemorySpace *_memorySpace,
+		AbstractMemoryPool *_memoryPool)
+	: memorySpace(_memorySpace), memoryPool(_memoryPool), sqHead(0),
+	cqTail(0), bounce(bounceSize), irqFd(-1), serviced(false), stats(),
+	pollIdle(0), polling(false),
+	stopping(false), wakeup(false)
+{
+	page = memoryPool->getPhysicalMemoryBlock(PAGE_SIZE);
+	ring = static_cast<struct syscall_ring *>(
+			memoryPool->getHostVirtualFromPhysical(page));
+
+	memset(ring, 0, PAGE_SIZE);
+	ring->flags = RING_NEED_WAKEUP;
+	memoryPool->markDirty(page, PAGE_SIZE);
+
+	memorySpace->mapPage(SYSCALL_RING_BASE, page, PAGE_SIZE, true, false);
+}
+
+SyscallRing::~SyscallRing()
+{
+	if (serviced)
+		IoThread::instance().remove(this);
+
+	stopPoller();
+	memoryPool->freePhysicalMemoryBlock(page, PAGE_SIZE);
+}
+
+uint32_t SyscallRing::addFile(std::unique_ptr<AbstractFile> file)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	files.push_back(std::move(file));
+	return files.size() - 1;
+}
+
+size_t SyscallRing::process()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return drain();
+}
+
+size_t SyscallRing::enter()
+{
+	return kick(stats.enters);
+}
+
+size_t SyscallRing::doorbell()
+{
+	return kick(stats.doorbells);
+}
+
+size_t SyscallRing::kick(uint64_t &counter)
+{
+	if (polling.load(std::memory_order_relaxed)) {
+		{
+			std::lock_guard<std::mutex> guard(pollLock);
+			wakeup = true;
+		}
+		pollCond.notify_all();
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	counter++;
+	return drain();
+}
+
+void SyscallRing::attachIoThread(vm_t *vm)
+{
+	if (serviced) return;
+
+	IoThread::instance().add(vm, this);
+	serviced = true;
+	__atomic_fetch_or(&ring->flags, RING_DOORBELL, __ATOMIC_SEQ_CST);
+}
+
+void SyscallRing::setIrqFd(int fd)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	irqFd = fd;
+	if (fd >= 0)
+		__atomic_fetch_or(&ring->flags, RING_IRQ, __ATOMIC_SEQ_CST);
+	else
+		__atomic_fetch_and(&ring->flags, ~RING_IRQ, __ATOMIC_SEQ_CST);
+}
+
+void SyscallRing::setDoorbell(uint32_t value)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	__atomic_store_n(&ring->doorbell, value, __ATOMIC_RELEASE);
+	memoryPool->markDirty(page, PAGE_SIZE);
+}
+
+bool SyscallRing::pending() const
+{
+	return __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE) !=
+		__atomic_load_n(&ring->sq_head, __ATOMIC_RELAXED);
+}
+
+size_t SyscallRing::drain()
+{
+	uint64_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+	size_t n = 0;
+
+	if (tail - sqHead > SYSCALL_RING_ENTRIES) {
+		console->warn("Syscall ring tail {} is {} ahead, dropping",
+				tail, tail - sqHead);
+		sqHead = tail;
+		__atomic_store_n(&ring->sq_head, sqHead, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	while (sqHead != tail) {
+		uint64_t cqHead = __atomic_load_n(&ring->cq_head,
+				__ATOMIC_ACQUIRE);
+		if (cqTail - cqHead >= SYSCALL_RING_ENTRIES) break;
+
+		struct ring_sqe sqe;
+		memcpy(&sqe, &ring->sq[sqHead % SYSCALL_RING_ENTRIES],
+				sizeof(sqe));
+
+		/* the guest may queue the next one in this slot now */
+		__atomic_store_n(&ring->sq_head, ++sqHead, __ATOMIC_RELEASE);
+
+		struct ring_cqe &cqe = ring->cq[cqTail % SYSCALL_RING_ENTRIES];
+		cqe.user_data = sqe.user_data;
+		cqe.res = execute(sqe);
+		__atomic_store_n(&ring->cq_tail, ++cqTail, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	if (n) {
+		/* the dirty log does not see host writes */
+		memoryPool->markDirty(page, PAGE_SIZE);
+		stats.completed += n;
+
+		if (irqFd >= 0) {
+			uint64_t one = 1;
+
+			if (write(irqFd, &one, sizeof(one)) < 0)
+				console->warn("Cannot raise the ring interrupt: {}",
+						strerror(errno));
+			stats.irqs++;
+		}
+	}
+
+	return n;
+}
+
+int64_t SyscallRing::execute(const struct ring_sqe &sqe)
+{
+	AbstractFile *file = nullptr;
+
+	if (sqe.op == RING_READ || sqe.op == RING_WRITE ||
+		sqe.op == RING_SEEK) {
+		if (sqe.fd >= files.size() || !files[sqe.fd])
+			return -EBADF;
+		file = files[sqe.fd].get();
+	}
+
+	switch (sqe.op) {
+	case RING_NOP:
+		return 0;
+
+	case RING_READ:
+	case RING_WRITE:
+		return transfer(file, sqe.addr, sqe.len, sqe.op == RING_WRITE);
+
+	case RING_SEEK:
+		return file->seek(sqe.off, sqe.len);
+
+	case RING_CLOCK: {
+		struct timespec ts;
+
+		if (clock_gettime(sqe.off, &ts)) return -errno;
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
+	case RING_MMAP:
+		return map(sqe.addr, sqe.len);
+
+	default:
+		return -ENOSYS;
+	}
+}
+
+int64_t SyscallRing::transfer(AbstractFile *file, addr_t guestVirtual,
+		size_t len, bool write)
+{
+	int64_t done = 0;
+
+	/* straight between the file and the guest's pages, unless
+	 * some are outside the pool */
+	if (memorySpace->getGuestExtents(guestVirtual, len, !write, extents)) {
+		if (write)
+			return file->writev(memoryPool, extents.data(),
+					extents.size());
+		return file->readv(memoryPool, extents.data(), extents.size());
+	}
+
+	while (len) {
+		size_t chunk = std::min(len, bounce.size());
+		ssize_t n;
+
+		if (write) {
+			if (!memorySpace->readGuest(guestVirtual, bounce.data(),
+					chunk))
+				return done ? done : -EFAULT;
+			n = file->write(bounce.data(), chunk);
+		} else {
+			n = file->read(bounce.data(), chunk);
+			if (n > 0 && !memorySpace->writeGuest(guestVirtual,
+					bounce.data(), n))
+				return done ? done : -EFAULT;
+		}
+
+		/* a short count ends the transfer, like read(2) */
+		if (n < 0) return done ? done : n;
+		done += n;
+		guestVirtual += n;
+		len -= n;
+		if ((size_t)n < chunk) break;
+	}
+
+	return done;
+}
+
+int64_t SyscallRing::map(addr_t guestVirtual, size_t len)
+{
+	if (!len || guestVirtual % PAGE_SIZE || len % PAGE_SIZE ||
+		guestVirtual < mmapBase || guestVirtual > mmapLimit ||
+		len > mmapLimit - guestVirtual)
+		return -EINVAL;
+
+	auto region = std::make_shared<AnonymousMemoryRegion>(memoryPool,
+			guestVirtual, len);
+
+	/* MAP_FIXED_NOREPLACE */
+	if (!memorySpace->tryAddRegion(std::move(region)))
+		return -EEXIST;
+
+	return guestVirtual;
+}
+
+void SyscallRing::startPoller(std::chrono::microseconds idle)
+{
+	stopPoller();
+
+	pollIdle = idle;
+	stopping = false;
+	polling = true;
+	poller = std::thread(&SyscallRing::poll, this);
+}
+
+void SyscallRing::stopPoller()
+{
+	if (!poller.joinable()) return;
+
+	{
+		std::lock_guard<std::mutex> guard(pollLock);
+		stopping = true;
+	}
+	pollCond.notify_all();
+	poller.join();
+
+	polling = false;
+	__atomic_fetch_or(&ring->flags, RING_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+}
+
+SyscallRing::Stats SyscallRing::getStats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return stats;
+}
+
+void SyscallRing::poll()
+{
+	using clock = std::chrono::steady_clock;
+	auto lastWork = clock::now();
+
+	__atomic_fetch_and(&ring->flags, ~RING_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+
+	while (!stopping.load(std::memory_order_relaxed)) {
+		if (pending() && process()) {
+			lastWork = clock::now();
+			continue;
+		}
+
+		if (clock::now() - lastWork < pollIdle) {
+			_mm_pause();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(pollLock);
+
+		/* the guest reads the flag after publishing its tail,
+		 * so a request queued before this either shows up in
+		 * the recheck or comes with a hypercall */
+		__atomic_fetch_or(&ring->flags, RING_NEED_WAKEUP,
+				__ATOMIC_SEQ_CST);
+
+		if (!pending()) {
+			{
+				std::lock_guard<std::mutex> statsGuard(lock);
+				stats.pollerSleeps++;
+			}
+			pollCond.wait(guard, [&] { return stopping || wakeup; });
+		}
+
+		wakeup = false;
+		__atomic_fetch_and(&ring->flags, ~RING_NEED_WAKEUP,
+				__ATOMIC_SEQ_CST);
+		lastWork = clock::now();
+	}
+}
+
+IoThread &IoThread::instance()
+{
+	static IoThread ioThread;
+
+	return ioThread;
+}
+
+IoThread::IoThread()
+	: busy(nullptr)
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (epollFd < 0 || stopFd < 0) {
+		console->error("Cannot set up the I/O thread: {}",
+				strerror(errno));
+		std::abort();
+	}
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = stopFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &event);
+
+	thread = std::thread(&IoThread::run, this);
+}
+
+IoThread::~IoThread()
+{
+	uint64_t one = 1;
+
+	if (write(stopFd, &one, sizeof(one)) < 0)
+		std::abort();
+	thread.join();
+
+	close(stopFd);
+	close(epollFd);
+}
+
+void IoThread::add(vm_t *vm, SyscallRing *ring)
+{
+	Binding binding = { vm, ring, 0, -1, -1 };
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	/* the lowest value no other ring of the VM rings with */
+	for (bool taken = true; taken; ) {
+		taken = false;
+		for (auto &entry : bindings) {
+			if (entry.second.vm == vm &&
+				entry.second.doorbell == binding.doorbell) {
+				binding.doorbell++;
+				taken = true;
+			}
+		}
+	}
+
+	binding.doorbellFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	binding.irqFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (binding.doorbellFd < 0 || binding.irqFd < 0) {
+		console->error("Cannot create ring eventfds: {}",
+				strerror(errno));
+		std::abort();
+	}
+
+	if (!vm_route_irq(vm, IRQ_GSI, RING_IRQ_VECTOR) ||
+		!vm_set_irqfd(vm, binding.irqFd, IRQ_GSI, 1) ||
+		!vm_set_ioeventfd(vm, binding.doorbellFd, RING_DOORBELL_PORT,
+			binding.doorbell, 1)) {
+		console->error("Cannot wire up the ring's doorbell and irq");
+		std::abort();
+	}
+
+	ring->setIrqFd(binding.irqFd);
+	ring->setDoorbell(binding.doorbell);
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = binding.doorbellFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, binding.doorbellFd, &event) < 0) {
+		console->error("Cannot poll the ring's doorbell: {}",
+				strerror(errno));
+		std::abort();
+	}
+
+	bindings.emplace(binding.doorbellFd, binding);
+}
+
+void IoThread::remove(SyscallRing *ring)
+{
+	Binding binding;
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		auto it = std::find_if(bindings.begin(), bindings.end(),
+			[&](const std::pair<const int, Binding> &entry) {
+				return entry.second.ring == ring;
+			});
+		if (it == bindings.end()) return;
+
+		binding = it->second;
+		bindings.erase(it);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, binding.doorbellFd, nullptr);
+
+		cond.wait(guard, [&] { return busy != ring; });
+
+		/* before add() may hand the value out again */
+		vm_set_ioeventfd(binding.vm, binding.doorbellFd,
+			RING_DOORBELL_PORT, binding.doorbell, 0);
+	}
+
+	ring->setIrqFd(-1);
+	vm_set_irqfd(binding.vm, binding.irqFd, IRQ_GSI, 0);
+	close(binding.doorbellFd);
+	close(binding.irqFd);
+}
+
+void IoThread::run()
+{
+	struct epoll_event events[16];
+
+	for (;;) {
+		int n = epoll_wait(epollFd, events, 16, -1);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			console->error("epoll_wait: {}", strerror(errno));
+			std::abort();
+		}
+
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == stopFd) return;
+
+			std::unique_lock<std::mutex> guard(lock);
+
+			/* the ring may have gone since epoll_wait() */
+			auto it = bindings.find(fd);
+			if (it == bindings.end()) continue;
+
+			SyscallRing *ring = it->second.ring;
+			busy = ring;
+			guard.unlock();
+
+			uint64_t count;
+			if (read(fd, &count, sizeof(count)) == sizeof(count))
+				ring->doorbell();
+
+			guard.lock();
+			busy = nullptr;
+			cond.notify_all();
+		}
+	}
+}
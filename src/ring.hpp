@@ -0,0 +1,176 @@
+#ifndef RING_HPP
+#define RING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "abi.h"
+#include "fs.hpp"
+#include "memory.hpp"
+
+/* The host side of the guest's syscall ring (see abi.h). The ring
+ * page comes from the pool and is mapped at SYSCALL_RING_BASE. The
+ * guest queues requests and makes one HYPERCALL_RING per batch, or
+ * none at all while the poller thread is watching the ring. With
+ * the IoThread it rings a doorbell instead and keeps running */
+class SyscallRing {
+public:
+	struct Stats {
+		/* requests completed */
+		uint64_t completed;
+		/* HYPERCALL_RING exits */
+		uint64_t enters;
+		/* doorbells the IoThread answered */
+		uint64_t doorbells;
+		/* completion interrupts raised */
+		uint64_t irqs;
+		/* times the poller went idle and asked for wakeups */
+		uint64_t pollerSleeps;
+	};
+
+private:
+	/* serializes draining the ring */
+	std::mutex lock;
+	MemorySpace *memorySpace;
+	AbstractMemoryPool *memoryPool;
+	addr_t page;
+	struct syscall_ring *ring;
+	/* the host's own copies, the guest could scribble over
+	 * the ones in the ring */
+	uint64_t sqHead;
+	uint64_t cqTail;
+	/* guest buffers not in the pool go through here */
+	std::vector<char> bounce;
+	std::vector<GuestExtent> extents;
+	std::vector<std::unique_ptr<AbstractFile>> files;
+	/* an eventfd KVM turns into RING_IRQ_VECTOR, or -1 */
+	int irqFd;
+	/* with the IoThread */
+	bool serviced;
+	Stats stats;
+
+	std::mutex pollLock;
+	std::condition_variable pollCond;
+	std::chrono::microseconds pollIdle;
+	std::atomic<bool> polling;
+	std::atomic<bool> stopping;
+	bool wakeup;
+	std::thread poller;
+
+public:
+	/* maps the ring into the space. it stays mapped until the
+	 * space goes, which must not outlive the ring */
+	SyscallRing(MemorySpace *_memorySpace, AbstractMemoryPool *_memoryPool);
+
+	SyscallRing(SyscallRing &) = delete;
+
+	~SyscallRing();
+
+	/* the guest reaches the file by the returned fd */
+	uint32_t addFile(std::unique_ptr<AbstractFile> file);
+
+	/* complete what the guest has queued, as far as there is room
+	 * for completions. returns the number completed */
+	size_t process();
+
+	/* HYPERCALL_RING: wake the poller, if there is one, and
+	 * process the ring in the caller */
+	size_t enter();
+
+	/* the same for a doorbell from the guest */
+	size_t doorbell();
+
+	/* have the IoThread answer the guest's doorbells and send
+	 * interrupts on completions, until the ring goes */
+	void attachIoThread(vm_t *vm);
+
+	/* write to fd after posting completions, -1 for none. sets
+	 * RING_IRQ for the guest accordingly */
+	void setIrqFd(int fd);
+
+	/* the value the guest rings the doorbell with */
+	void setDoorbell(uint32_t value);
+
+	/* poll the ring from a thread of its own. after idle without
+	 * requests it sets RING_NEED_WAKEUP and sleeps until the next
+	 * HYPERCALL_RING */
+	void startPoller(std::chrono::microseconds idle);
+
+	void stopPoller();
+
+	Stats getStats();
+
+private:
+	/* requests the host has not taken yet */
+	bool pending() const;
+
+	size_t drain();
+
+	size_t kick(uint64_t &counter);
+
+	int64_t execute(const struct ring_sqe &sqe);
+
+	int64_t transfer(AbstractFile *file, addr_t guestVirtual, size_t len,
+			bool write);
+
+	int64_t map(addr_t guestVirtual, size_t len);
+
+	void poll();
+};
+
+/* Answers the doorbells of syscall rings from one epoll loop. Each
+ * ring gets an ioeventfd on RING_DOORBELL_PORT matching a value of
+ * its own, so a VM may have several, which KVM signals
+ * without stopping the vcpu, and an irqfd raising RING_IRQ_VECTOR in
+ * the guest once its requests are completed. The vcpu runs on while
+ * the host does the I/O */
+class IoThread {
+public:
+	/* the IOAPIC pin behind the irqfd, one not wired to the PIC */
+	static constexpr uint32_t IRQ_GSI = 16;
+
+private:
+	struct Binding {
+		vm_t *vm;
+		SyscallRing *ring;
+		/* the ioeventfd's datamatch, unique within the VM */
+		uint32_t doorbell;
+		int doorbellFd;
+		int irqFd;
+	};
+
+	std::mutex lock;
+	std::condition_variable cond;
+	/* by doorbell fd */
+	std::unordered_map<int, Binding> bindings;
+	/* the ring being processed right now */
+	SyscallRing *busy;
+	int epollFd;
+	/* wakes the loop to stop */
+	int stopFd;
+	std::thread thread;
+public:
+	static IoThread &instance();
+
+	IoThread(IoThread &) = delete;
+
+	~IoThread();
+
+	void add(vm_t *vm, SyscallRing *ring);
+
+	/* unregister the ring's eventfds, waiting for
+	 * processing in progress */
+	void remove(SyscallRing *ring);
+
+private:
+	IoThread();
+
+	void run();
+};
+
+#endif
@@ -0,0 +1,317 @@
+#include "sandbox.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+#include "abi.h"
+#include "log.hpp"
+
+KernelImage readKernelImage(const std::string &path)
+{
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file) {
+		console->error("Cannot open kernel image {}", path);
+		std::abort();
+	}
+
+	return KernelImage(std::istreambuf_iterator<char>(file),
+			std::istreambuf_iterator<char>());
+}
+
+/* what a sandbox starts with, the pool grows up to memorySize */
+static constexpr size_t initialMemorySize = 4 << 20;
+
+Sandbox::Sandbox(size_t memorySize, const KernelImage &kernel, bool cloneable)
+	: snapshotFd(-1), running(false)
+{
+	vm_init(&vm);
+
+	size_t initialSize = std::min(memorySize, initialMemorySize);
+
+	if (cloneable) {
+		mapper = std::make_unique<MemfdHostMemoryMapper>();
+		memoryPool = std::make_unique<BuddyMemoryPool>(&vm, 0x0,
+				initialSize, *mapper, memorySize);
+	} else {
+		memoryPool = std::make_unique<BuddyMemoryPool>(&vm, 0x0,
+				initialSize, DefaultHostMemoryMapper::instance,
+				memorySize);
+	}
+
+	/* after the pool's first slot, see vcpu_init() */
+	vcpu = vcpu_init(&vm, 0);
+	boot(kernel);
+}
+
+Sandbox::Sandbox(Sandbox &tmpl, MemfdHostMemoryMapper &memfd)
+	: snapshotFd(-1), running(false)
+{
+	vm_init(&vm);
+
+	mapper = std::make_unique<PrivateFileHostMemoryMapper>(memfd.getFd(),
+			0, memfd.share());
+	memoryPool = tmpl.memoryPool->clone(&vm, *mapper);
+	vcpu = vcpu_init(&vm, 0);
+	memorySpace = std::make_unique<MemorySpace>(*tmpl.memorySpace,
+			memoryPool.get());
+
+	vcpu_copy_regs(vcpu, tmpl.vcpu);
+	memorySpace->adoptPcid(vcpu);
+}
+
+std::unique_ptr<Sandbox> Sandbox::clone()
+{
+	auto *memfd = dynamic_cast<MemfdHostMemoryMapper *>(mapper.get());
+
+	if (!memfd) {
+		console->error("Sandbox is not cloneable");
+		std::abort();
+	}
+
+	return std::unique_ptr<Sandbox>(new Sandbox(*this, *memfd));
+}
+
+Sandbox::~Sandbox()
+{
+	syscallRing.reset();
+	memorySpace.reset();
+	memoryPool.reset();
+	vcpu_destroy(vcpu);
+	vm_destroy(&vm);
+
+	if (snapshotFd >= 0) close(snapshotFd);
+}
+
+void Sandbox::boot(const KernelImage &kernel)
+{
+	memorySpace = std::make_unique<MemorySpace>(memoryPool.get());
+
+	size_t kernelLen = alignUp(kernel.size(), PAGE_SIZE);
+	addr_t kernelPhys = memoryPool->getPhysicalMemoryBlock(kernelLen);
+
+	memcpy(memoryPool->getHostVirtualFromPhysical(kernelPhys),
+			kernel.data(), kernel.size());
+
+	for (size_t off = 0; off < kernelLen; off += PAGE_SIZE)
+		memorySpace->mapPage(KERNEL_BASE + off, kernelPhys + off,
+				PAGE_SIZE, true, false);
+
+	addr_t stackPhys = memoryPool->getPhysicalMemoryBlock(KERNEL_STACK_SIZE);
+	addr_t stackBase = KERNEL_STACK_TOP - KERNEL_STACK_SIZE;
+
+	for (size_t off = 0; off < KERNEL_STACK_SIZE; off += PAGE_SIZE)
+		memorySpace->mapPage(stackBase + off, stackPhys + off,
+				PAGE_SIZE, true, false);
+
+	memorySpace->apply(vcpu);
+	VCPU_REG(vcpu, rip) = KERNEL_BASE;
+	VCPU_REG(vcpu, rsp) = KERNEL_STACK_TOP;
+}
+
+SyscallRing *Sandbox::enableSyscallRing()
+{
+	if (!syscallRing)
+		syscallRing = std::make_unique<SyscallRing>(memorySpace.get(),
+				memoryPool.get());
+
+	return syscallRing.get();
+}
+
+SyscallRing *Sandbox::enableIoThread()
+{
+	SyscallRing *ring = enableSyscallRing();
+
+	ring->attachIoThread(&vm);
+	return ring;
+}
+
+enum vcpu_exit_reason Sandbox::run()
+{
+	enum vcpu_exit_reason reason;
+
+	runner = pthread_self();
+	running = true;
+
+	for (;;) {
+		memorySpace->syncTlb(vcpu);
+		reason = vcpu_run(vcpu);
+		if (reason != VCPU_INTERRUPTED) break;
+
+		vcpu->kvm_run->immediate_exit = 0;
+	}
+
+	running = false;
+	return reason;
+}
+
+void Sandbox::kick()
+{
+	if (running)
+		VcpuManager::kick(vcpu, runner);
+}
+
+void Sandbox::trackWorkingSet()
+{
+	memorySpace->setTlbKick([this] { kick(); });
+	memorySpace->trackWorkingSet();
+}
+
+bool Sandbox::handleHypercall()
+{
+	switch (VCPU_REG_GET(vcpu, rax)) {
+	case HYPERCALL_BALLOON:
+		VCPU_REG(vcpu, rax) = memoryPool->balloon(VCPU_REG_GET(vcpu, rdi),
+				VCPU_REG_GET(vcpu, rsi)) ? 0 : -1;
+		return true;
+
+	case HYPERCALL_RING:
+		VCPU_REG(vcpu, rax) = syscallRing ? syscallRing->enter() : -1;
+		return true;
+
+	case HYPERCALL_FAULT:
+		VCPU_REG(vcpu, rax) = memorySpace->fault(
+				VCPU_REG_GET(vcpu, rdi) & ~(PAGE_SIZE - 1),
+				VCPU_REG_GET(vcpu, rsi)) ? 0 : -1;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+void Sandbox::reset(const KernelImage &kernel)
+{
+	syscallRing.reset();
+	memorySpace.reset();
+	memoryPool->reset();
+	vcpu_reset(vcpu);
+	boot(kernel);
+}
+
+SandboxPool::SandboxPool(size_t _target, size_t _memorySize,
+		const std::string &kernelPath)
+	: target(_target), memorySize(_memorySize),
+	kernel(readKernelImage(kernelPath)), stopping(false),
+	latencies(latencySamples), nLatencies(0)
+{
+	worker = std::thread([this] { run(); });
+}
+
+SandboxPool::~SandboxPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+
+	cond.notify_all();
+	worker.join();
+}
+
+SandboxPtr SandboxPool::acquire()
+{
+	auto start = std::chrono::steady_clock::now();
+	SandboxPtr sandbox;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (!ready.empty()) {
+			sandbox = std::move(ready.front());
+			ready.pop_front();
+		}
+	}
+
+	/* wake the worker to top the pool up again */
+	cond.notify_all();
+
+	if (!sandbox) {
+		console->debug("Sandbox pool empty, cold start");
+		sandbox = std::make_unique<Sandbox>(memorySize, kernel);
+	}
+
+	std::chrono::duration<double, std::micro> elapsed =
+		std::chrono::steady_clock::now() - start;
+
+	std::lock_guard<std::mutex> guard(lock);
+	latencies[nLatencies++ % latencySamples] = elapsed.count();
+
+	return sandbox;
+}
+
+void SandboxPool::release(SandboxPtr sandbox)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		dirty.push_back(std::move(sandbox));
+	}
+
+	cond.notify_all();
+}
+
+double SandboxPool::getLatencyPercentile(double p)
+{
+	std::vector<double> samples;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		size_t n = std::min(nLatencies, latencySamples);
+		samples.assign(latencies.begin(), latencies.begin() + n);
+	}
+
+	if (samples.empty()) return 0;
+
+	size_t index = std::min(samples.size() - 1,
+			(size_t)(p / 100 * samples.size()));
+	std::nth_element(samples.begin(), samples.begin() + index,
+			samples.end());
+
+	return samples[index];
+}
+
+size_t SandboxPool::readyCount()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return ready.size();
+}
+
+void SandboxPool::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!stopping) {
+		if (!dirty.empty()) {
+			SandboxPtr sandbox = std::move(dirty.front());
+			dirty.pop_front();
+			bool keep = ready.size() < target;
+
+			/* scrub or tear down outside the lock */
+			guard.unlock();
+			if (keep) sandbox->reset(kernel);
+			else sandbox.reset();
+			guard.lock();
+
+			if (sandbox) ready.push_back(std::move(sandbox));
+			continue;
+		}
+
+		if (ready.size() < target) {
+			guard.unlock();
+			auto sandbox = std::make_unique<Sandbox>(memorySize, kernel);
+			guard.lock();
+
+			ready.push_back(std::move(sandbox));
+			continue;
+		}
+
+		cond.wait(guard);
+	}
+
+	/* the sandboxes are torn down with the pool */
+	ready.clear();
+	dirty.clear();
+}
@@ -0,0 +1,184 @@
+#ifndef SANDBOX_HPP
+#define SANDBOX_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kvm.h"
+#include "memory.hpp"
+#include "ring.hpp"
+#include "vcpu.hpp"
+
+using KernelImage = std::vector<char>;
+
+KernelImage readKernelImage(const std::string &path);
+
+/* A VM with one vcpu, its memory pool and the kernel loaded,
+ * ready to enter the guest at KERNEL_BASE */
+class Sandbox {
+private:
+	vm_t vm;
+	vcpu_t *vcpu;
+	/* set when the sandbox owns its mapper */
+	std::unique_ptr<AbstractHostMemoryMapper> mapper;
+	/* the snapshot file behind a restored sandbox */
+	int snapshotFd;
+	/* the last snapshot saved or restored, absolute. guest memory
+	 * has been dirty logged since */
+	std::string lastSnapshot;
+	/* it and the snapshots it builds on, none of which may be
+	 * saved over */
+	std::vector<std::string> snapshotChain;
+	/* the thread in run(), for kicks */
+	std::atomic<bool> running;
+	pthread_t runner;
+	std::unique_ptr<MemoryPool> memoryPool;
+	std::unique_ptr<MemorySpace> memorySpace;
+	/* goes before the space it is mapped in */
+	std::unique_ptr<SyscallRing> syscallRing;
+public:
+	/* a cloneable sandbox keeps guest memory in a memfd */
+	Sandbox(size_t memorySize, const KernelImage &kernel,
+		bool cloneable = false);
+
+	Sandbox(Sandbox &) = delete;
+
+	~Sandbox();
+
+	vm_t *getVm()
+	{ return &vm; }
+
+	vcpu_t *getVcpu()
+	{ return vcpu; }
+
+	MemoryPool *getMemoryPool()
+	{ return memoryPool.get(); }
+
+	MemorySpace *getMemorySpace()
+	{ return memorySpace.get(); }
+
+	/* map a syscall ring into the guest until the next reset,
+	 * or return the one there is */
+	SyscallRing *enableSyscallRing();
+
+	SyscallRing *getSyscallRing()
+	{ return syscallRing.get(); }
+
+	/* the ring, answered by the IoThread. the vcpu keeps running
+	 * while its requests are carried out */
+	SyscallRing *enableIoThread();
+
+	/* enter the guest until the next exit, handing the vcpu
+	 * any TLB flushes queued since it last ran. kicks are
+	 * handled here and do not count as exits */
+	enum vcpu_exit_reason run();
+
+	/* bring the vcpu out of the guest and back in, if it is
+	 * in run(), e.g. to take TLB flushes */
+	void kick();
+
+	/* carry out the hypercall the vcpu exited with. false
+	 * if it is not one the sandbox handles */
+	bool handleHypercall();
+
+	/* scrub guest memory and registers and boot again */
+	void reset(const KernelImage &kernel);
+
+	/* scan the guest's accessed bits in the background from now
+	 * until the next reset, see WorkingSetScanner. the vcpu is
+	 * kicked after each scan to flush the bits from its TLB */
+	void trackWorkingSet();
+
+	/* bytes of region memory the guest accessed within the
+	 * last idleScans scans */
+	size_t getWorkingSetSize(unsigned idleScans = 1)
+	{ return memorySpace->getWorkingSetSize(idleScans); }
+
+	/* compress guest pages idle for at least minIdleScans scans,
+	 * see MemoryRegion::swapOut(). the vcpu must not be running */
+	size_t swapOut(unsigned minIdleScans)
+	{ return memorySpace->swapOut(minIdleScans); }
+
+	/* a new VM sharing this sandbox's memory copy-on-write.
+	 * only for cloneable sandboxes, which must not run again
+	 * while they have clones: their writes would show through
+	 * in pages a clone has not written yet. their pools are not
+	 * reclaimed meanwhile, and cannot be reset */
+	std::unique_ptr<Sandbox> clone();
+
+	/* write registers, allocation state and guest memory to path.
+	 * an incremental snapshot holds only the pages changed since
+	 * the last snapshot saved or restored, and refers to that one,
+	 * which must stay in place. without a last snapshot it is a
+	 * full one. either way dirty logging stays on afterwards.
+	 * path must not be one of the snapshots the sandbox builds on.
+	 * the vcpu must not be running */
+	void saveSnapshot(const std::string &path, bool incremental = false);
+
+	/* map a snapshot back in. guest memory of the full snapshot is
+	 * not read up front, pages come from the file's page cache as the
+	 * guest touches them. the pages of incremental ones are read */
+	static std::unique_ptr<Sandbox> restoreSnapshot(const std::string &path);
+
+private:
+	/* the clone constructor */
+	Sandbox(Sandbox &tmpl, MemfdHostMemoryMapper &memfd);
+
+	/* the restore constructor */
+	explicit Sandbox(const std::string &path);
+
+	void boot(const KernelImage &kernel);
+};
+
+using SandboxPtr = std::unique_ptr<Sandbox>;
+
+/* Keeps a number of booted sandboxes ready in the background.
+ * Released sandboxes are scrubbed and recycled by the same thread. */
+class SandboxPool {
+private:
+	static constexpr size_t latencySamples = 4096;
+
+	size_t target;
+	size_t memorySize;
+	KernelImage kernel;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<SandboxPtr> ready;
+	std::deque<SandboxPtr> dirty;
+	bool stopping;
+	std::thread worker;
+
+	/* acquire() latencies in microseconds, a ring buffer */
+	std::vector<double> latencies;
+	size_t nLatencies;
+public:
+	SandboxPool(size_t _target, size_t _memorySize,
+		const std::string &kernelPath);
+
+	SandboxPool(SandboxPool &) = delete;
+
+	~SandboxPool();
+
+	/* never blocks on the worker, boots a sandbox
+	 * in the caller if none is ready */
+	SandboxPtr acquire();
+
+	void release(SandboxPtr sandbox);
+
+	/* p in [0, 100] over the recent acquire() calls */
+	double getLatencyPercentile(double p);
+
+	/* booted sandboxes waiting for acquire() */
+	size_t readyCount();
+
+private:
+	void run();
+};
+
+#endif
@@ -0,0 +1,341 @@
+#include "sandbox.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "compress.hpp"
+#include "log.hpp"
+
+#define SNAPSHOT_MAGIC 0x313050414e53564cULL	/* "LVSNAP01" */
+#define SNAPSHOT_VERSION 4
+
+/* followed by the pool and space state, the parent's path and the
+ * list of saved pages, then guest memory at memoryOffset. a full
+ * snapshot has no parent and leaves all-zero pages as holes. an
+ * incremental one holds only the listed pages, back to back */
+struct SnapshotHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t physBase;
+	uint64_t memorySize;
+	/* what the pool may grow to, the file covers all of it */
+	uint64_t maxMemorySize;
+	uint64_t memoryOffset;
+	/* in uint64_t entries */
+	uint64_t poolStateLen;
+	uint64_t spaceStateLen;
+	/* in bytes, 0 for a full snapshot */
+	uint64_t parentLen;
+	uint64_t nPages;
+	struct kvm_regs regs;
+	struct kvm_sregs sregs;
+};
+
+static void writeFull(int fd, const void *buf, size_t len, off_t offset)
+{
+	const char *p = static_cast<const char *>(buf);
+
+	while (len) {
+		ssize_t ret = pwrite(fd, p, len, offset);
+		if (ret < 0) {
+			console->error("Cannot write snapshot at offset {}", offset);
+			std::abort();
+		}
+
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+}
+
+static void readFull(int fd, void *buf, size_t len, off_t offset)
+{
+	char *p = static_cast<char *>(buf);
+
+	while (len) {
+		ssize_t ret = pread(fd, p, len, offset);
+		if (ret <= 0) {
+			console->error("Cannot read snapshot at offset {}", offset);
+			std::abort();
+		}
+
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+}
+
+/* a snapshot file opened for restoring */
+struct SnapshotFile {
+	int fd;
+	SnapshotHeader header;
+	std::vector<uint64_t> poolState;
+	std::vector<uint64_t> spaceState;
+	std::string parent;
+	std::vector<uint64_t> pages;
+};
+
+static SnapshotFile openSnapshot(const std::string &path)
+{
+	SnapshotFile file;
+
+	file.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file.fd < 0) {
+		console->error("Cannot open snapshot {}", path);
+		std::abort();
+	}
+
+	SnapshotHeader &header = file.header;
+
+	readFull(file.fd, &header, sizeof(header), 0);
+	if (header.magic != SNAPSHOT_MAGIC ||
+		header.version != SNAPSHOT_VERSION) {
+		console->error("{} is not a snapshot, or a different version",
+				path);
+		std::abort();
+	}
+
+	file.poolState.resize(header.poolStateLen);
+	file.spaceState.resize(header.spaceStateLen);
+	file.parent.resize(header.parentLen);
+	file.pages.resize(header.nPages);
+
+	off_t offset = sizeof(header);
+	readFull(file.fd, file.poolState.data(),
+		file.poolState.size() * sizeof(uint64_t), offset);
+	offset += file.poolState.size() * sizeof(uint64_t);
+	readFull(file.fd, file.spaceState.data(),
+		file.spaceState.size() * sizeof(uint64_t), offset);
+	offset += file.spaceState.size() * sizeof(uint64_t);
+	readFull(file.fd, &file.parent[0], file.parent.size(), offset);
+	offset += file.parent.size();
+	readFull(file.fd, file.pages.data(),
+		file.pages.size() * sizeof(uint64_t), offset);
+
+	return file;
+}
+
+/* parents are recorded by absolute path. empty if
+ * the file does not exist */
+static std::string absolutePath(const std::string &path)
+{
+	char *real = realpath(path.c_str(), nullptr);
+
+	if (!real) return std::string();
+
+	std::string ret(real);
+	free(real);
+	return ret;
+}
+
+/* calls fn(start, nPages, index) for each run of consecutive pages,
+ * index being the position of the first page in the list */
+template<typename Fn>
+static void forEachRun(const std::vector<uint64_t> &pages, Fn fn)
+{
+	size_t first = 0;
+
+	for (size_t i = 1; i <= pages.size(); i++) {
+		if (i < pages.size() &&
+			pages[i] == pages[i - 1] + PAGE_SIZE) continue;
+
+		fn(pages[first], i - first, first);
+		first = i;
+	}
+}
+
+void Sandbox::saveSnapshot(const std::string &path, bool incremental)
+{
+	std::vector<uint64_t> poolState, spaceState;
+	SnapshotHeader header = {};
+
+	/* the chain's children name their parents by path */
+	std::string existing = absolutePath(path);
+	if (std::find(snapshotChain.begin(), snapshotChain.end(), existing) !=
+		snapshotChain.end()) {
+		console->error("Cannot overwrite snapshot {}, the sandbox "
+				"builds on it", path);
+		std::abort();
+	}
+
+	memoryPool->saveState(poolState);
+	memorySpace->saveState(spaceState);
+	vcpu_get_regfile(vcpu, &header.regs, &header.sregs);
+
+	/* restart the log, the next snapshot can build on this one */
+	MemoryPool::DirtyBitmap dirty;
+	memoryPool->startDirtyLog();
+	memoryPool->fetchDirtyLog(dirty);
+
+	incremental = incremental && !lastSnapshot.empty();
+
+	std::string parent;
+	std::vector<uint64_t> pages;
+	if (incremental) {
+		parent = lastSnapshot;
+
+		/* MemorySpace writes page tables and mailboxes in place */
+		addr_t physBase = memoryPool->getPhysicalBase();
+		for (addr_t page : spaceState) {
+			size_t index = (page - physBase) / PAGE_SIZE;
+			dirty[index / 64] |= 1ULL << (index % 64);
+		}
+
+		memoryPool->forEachDirtyPage(dirty, [&](addr_t page) {
+			pages.push_back(page);
+		});
+	}
+
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.physBase = memoryPool->getPhysicalBase();
+	header.memorySize = memoryPool->getSize();
+	header.maxMemorySize = memoryPool->getMaxSize();
+	header.poolStateLen = poolState.size();
+	header.spaceStateLen = spaceState.size();
+	header.parentLen = parent.size();
+	header.nPages = pages.size();
+
+	size_t metaLen = sizeof(header) + parent.size() +
+		(poolState.size() + spaceState.size() + pages.size()) *
+		sizeof(uint64_t);
+	header.memoryOffset = alignUp(metaLen, PAGE_SIZE);
+
+	/* written aside and renamed into place. a sandbox restored
+	 * from the file maps it, truncating it would take its memory */
+	std::string tmpPath = path + ".tmp";
+	int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0600);
+	if (fd < 0) {
+		console->error("Cannot create snapshot {}", tmpPath);
+		std::abort();
+	}
+
+	off_t offset = 0;
+	writeFull(fd, &header, sizeof(header), offset);
+	offset += sizeof(header);
+	writeFull(fd, poolState.data(), poolState.size() * sizeof(uint64_t), offset);
+	offset += poolState.size() * sizeof(uint64_t);
+	writeFull(fd, spaceState.data(), spaceState.size() * sizeof(uint64_t), offset);
+	offset += spaceState.size() * sizeof(uint64_t);
+	writeFull(fd, parent.data(), parent.size(), offset);
+	offset += parent.size();
+	writeFull(fd, pages.data(), pages.size() * sizeof(uint64_t), offset);
+
+	if (incremental) {
+		forEachRun(pages, [&](addr_t start, size_t n, size_t index) {
+			writeFull(fd, memoryPool->getHostVirtualFromPhysical(start),
+				n * PAGE_SIZE,
+				header.memoryOffset + index * PAGE_SIZE);
+		});
+	} else {
+		/* the file length makes the holes read back as zero,
+		 * including the room the restored pool can grow into */
+		if (ftruncate(fd, header.memoryOffset + header.maxMemorySize) < 0) {
+			console->error("Cannot size snapshot {}", tmpPath);
+			std::abort();
+		}
+
+		const char *memory = static_cast<const char *>(
+			memoryPool->getHostVirtualFromPhysical(header.physBase));
+		size_t runStart = 0, runLen = 0;
+
+		/* write runs of non-zero pages */
+		for (size_t off = 0; off <= header.memorySize; off += PAGE_SIZE) {
+			bool last = off == header.memorySize;
+
+			if (!last && !isZeroPage(memory + off)) {
+				if (!runLen) runStart = off;
+				runLen += PAGE_SIZE;
+				continue;
+			}
+
+			if (runLen)
+				writeFull(fd, memory + runStart, runLen,
+					header.memoryOffset + runStart);
+			runLen = 0;
+		}
+	}
+
+	close(fd);
+	if (rename(tmpPath.c_str(), path.c_str()) < 0) {
+		console->error("Cannot rename snapshot {} to {}: {}", tmpPath,
+				path, strerror(errno));
+		unlink(tmpPath.c_str());
+		std::abort();
+	}
+
+	lastSnapshot = absolutePath(path);
+	if (!incremental)
+		snapshotChain.clear();
+	snapshotChain.push_back(lastSnapshot);
+	console->debug("Saved {} snapshot {}, {} changed pages",
+			incremental ? "incremental" : "full", path, pages.size());
+}
+
+std::unique_ptr<Sandbox> Sandbox::restoreSnapshot(const std::string &path)
+{
+	return std::unique_ptr<Sandbox>(new Sandbox(path));
+}
+
+Sandbox::Sandbox(const std::string &path)
+	: snapshotFd(-1), running(false)
+{
+	/* newest first, down to the full snapshot */
+	std::vector<SnapshotFile> chain;
+
+	chain.push_back(openSnapshot(path));
+	while (!chain.back().parent.empty())
+		chain.push_back(openSnapshot(chain.back().parent));
+
+	SnapshotFile &top = chain.front();
+	SnapshotFile &base = chain.back();
+
+	if (top.header.physBase != base.header.physBase ||
+		top.header.maxMemorySize != base.header.maxMemorySize) {
+		console->error("Snapshot {} does not match its parents", path);
+		std::abort();
+	}
+
+	vm_init(&vm);
+
+	snapshotFd = base.fd;
+	mapper = std::make_unique<PrivateFileHostMemoryMapper>(base.fd,
+			base.header.memoryOffset);
+	memoryPool = std::make_unique<BuddyMemoryPool>(&vm, top.header.physBase,
+			top.header.memorySize, *mapper, top.header.maxMemorySize);
+
+	/* the full snapshot is mapped, the changes are read on top,
+	 * oldest first */
+	for (auto it = std::next(chain.rbegin()); it != chain.rend(); it++) {
+		forEachRun(it->pages, [&](addr_t start, size_t n, size_t index) {
+			readFull(it->fd, memoryPool->getHostVirtualFromPhysical(start),
+				n * PAGE_SIZE,
+				it->header.memoryOffset + index * PAGE_SIZE);
+		});
+		close(it->fd);
+	}
+
+	memoryPool->loadState(top.poolState);
+	memorySpace = std::make_unique<MemorySpace>(memoryPool.get(),
+			top.spaceState);
+
+	/* so that the next snapshot can be incremental. before the
+	 * vcpu, changing a slot costs milliseconds with one */
+	memoryPool->startDirtyLog();
+
+	vcpu = vcpu_init(&vm, 0);
+	vcpu_set_regfile(vcpu, &top.header.regs, &top.header.sregs);
+	memorySpace->adoptPcid(vcpu);
+	lastSnapshot = absolutePath(path);
+	snapshotChain.push_back(lastSnapshot);
+	for (SnapshotFile &file : chain)
+		if (!file.parent.empty())
+			snapshotChain.push_back(file.parent);
+}
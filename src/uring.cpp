@@ -0,0 +1,313 @@
+#include "uring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "log.hpp"
+
+/* slots in the registered file table, grown by re-registering */
+static constexpr unsigned initialFiles = 16;
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+		unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+			nullptr, 0);
+}
+
+static int ioUringRegister(int fd, unsigned opcode, const void *arg,
+		unsigned n)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static void *mapRing(int fd, size_t len, off_t offset)
+{
+	void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	if (p == MAP_FAILED) {
+		console->error("Cannot map io_uring queues: {}",
+				strerror(errno));
+		std::abort();
+	}
+	return p;
+}
+
+IoUring::IoUring(unsigned entries)
+	: sqLocalTail(0), sqSubmitted(0), inFlight(0), nextTag(0), stats()
+{
+	struct io_uring_params params = {};
+
+	ringFd = ioUringSetup(entries, &params);
+	if (ringFd < 0) {
+		console->error("io_uring_setup: {}", strerror(errno));
+		std::abort();
+	}
+
+	sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqMapLen = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* both queues in one mapping, since 5.4 */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sqMapLen = cqMapLen = std::max(sqMapLen, cqMapLen);
+		sqMap = cqMap = mapRing(ringFd, sqMapLen, IORING_OFF_SQ_RING);
+	} else {
+		sqMap = mapRing(ringFd, sqMapLen, IORING_OFF_SQ_RING);
+		cqMap = mapRing(ringFd, cqMapLen, IORING_OFF_CQ_RING);
+	}
+
+	sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<struct io_uring_sqe *>(
+			mapRing(ringFd, sqesLen, IORING_OFF_SQES));
+
+	char *sq = static_cast<char *>(sqMap);
+	char *cq = static_cast<char *>(cqMap);
+
+	sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sqEntries = params.sq_entries;
+	sqLocalTail = sqSubmitted = *sqTail;
+
+	/* sqes are always used in order, the array is the identity */
+	for (unsigned i = 0; i < sqEntries; i++)
+		sqArray[i] = i;
+
+	cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+	cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+}
+
+IoUring::~IoUring()
+{
+	munmap(sqes, sqesLen);
+	if (cqMap != sqMap)
+		munmap(cqMap, cqMapLen);
+	munmap(sqMap, sqMapLen);
+	close(ringFd);
+}
+
+struct io_uring_sqe *IoUring::prepare(uint8_t opcode, int fd,
+		const void *buf, uint32_t len, uint64_t off, uint64_t userData,
+		bool fixedFile)
+{
+	if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >=
+		sqEntries)
+		submit();
+
+	struct io_uring_sqe *sqe = &sqes[sqLocalTail & sqMask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buf);
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = userData;
+	if (fixedFile)
+		sqe->flags |= IOSQE_FIXED_FILE;
+
+	sqLocalTail++;
+	return sqe;
+}
+
+unsigned IoUring::submit(unsigned waitFor)
+{
+	unsigned n = queued();
+
+	/* the kernel reads the sqes once it sees the tail */
+	__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+	if (!n && !waitFor) return 0;
+
+	unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+	unsigned done = 0;
+
+	for (;;) {
+		int ret = ioUringEnter(ringFd, n - done, waitFor, flags);
+
+		stats.enters++;
+		if (ret >= 0) {
+			done += ret;
+			if (done >= n) break;
+			continue;
+		}
+		if (errno == EINTR) continue;
+
+		/* out of completion space, the rest goes next time */
+		if (errno == EBUSY || errno == EAGAIN) break;
+
+		console->error("io_uring_enter: {}", strerror(errno));
+		std::abort();
+	}
+
+	sqSubmitted += done;
+	stats.submitted += done;
+	inFlight += done;
+	return done;
+}
+
+size_t IoUring::reap(Completion *out, size_t max)
+{
+	size_t n = 0;
+
+	while (n < max && next(out[n]))
+		n++;
+
+	return n;
+}
+
+bool IoUring::next(Completion &completion)
+{
+	if (early.empty()) return take(completion);
+
+	completion = early.back();
+	early.pop_back();
+	return true;
+}
+
+bool IoUring::take(Completion &completion)
+{
+	unsigned head = *cqHead;
+
+	if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		return false;
+
+	struct io_uring_cqe *cqe = &cqes[head & cqMask];
+
+	completion.userData = cqe->user_data;
+	completion.res = cqe->res;
+	/* the kernel may reuse the entry once the head moves */
+	__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+	inFlight--;
+	stats.completed++;
+	return true;
+}
+
+int32_t IoUring::wait(uint64_t userData)
+{
+	auto it = std::find_if(early.begin(), early.end(),
+		[&](const Completion &c) { return c.userData == userData; });
+
+	if (it != early.end()) {
+		int32_t res = it->res;
+
+		early.erase(it);
+		return res;
+	}
+
+	if (queued()) submit();
+
+	for (;;) {
+		Completion completion;
+
+		if (!take(completion)) {
+			if (!inFlight && !queued()) {
+				console->error("Waiting for an io_uring request "
+						"that was never queued");
+				std::abort();
+			}
+			submit(1);
+			continue;
+		}
+
+		if (completion.userData == userData)
+			return completion.res;
+		early.push_back(completion);
+	}
+}
+
+bool IoUring::registerBuffers(const struct iovec *iov, unsigned n)
+{
+	if (!buffers.empty()) {
+		ioUringRegister(ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		buffers.clear();
+	}
+
+	if (!n) return true;
+	if (ioUringRegister(ringFd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+		return false;
+
+	buffers.assign(iov, iov + n);
+	return true;
+}
+
+int IoUring::findBuffer(const void *buf, size_t len) const
+{
+	uintptr_t start = reinterpret_cast<uintptr_t>(buf);
+
+	for (size_t i = 0; i < buffers.size(); i++) {
+		uintptr_t base = reinterpret_cast<uintptr_t>(buffers[i].iov_base);
+
+		if (start >= base && start - base <= buffers[i].iov_len &&
+			len <= buffers[i].iov_len - (start - base))
+			return i;
+	}
+
+	return NONE;
+}
+
+int IoUring::registerFile(int fd)
+{
+	auto slot = std::find(files.begin(), files.end(), NONE);
+
+	if (slot == files.end()) {
+		/* a bigger, sparse table with the old files in it */
+		size_t index = files.size();
+		std::vector<int> table(files);
+
+		table.resize(std::max<size_t>(initialFiles, index * 2), NONE);
+		if (!files.empty())
+			ioUringRegister(ringFd, IORING_UNREGISTER_FILES,
+					nullptr, 0);
+		if (ioUringRegister(ringFd, IORING_REGISTER_FILES, table.data(),
+				table.size()) < 0) {
+			if (!files.empty() &&
+				ioUringRegister(ringFd, IORING_REGISTER_FILES,
+					files.data(), files.size()) < 0)
+				files.clear();
+			return NONE;
+		}
+
+		files.swap(table);
+		slot = files.begin() + index;
+	}
+
+	int index = slot - files.begin();
+	struct io_uring_files_update update = {};
+
+	update.offset = index;
+	update.fds = reinterpret_cast<uint64_t>(&fd);
+	if (ioUringRegister(ringFd, IORING_REGISTER_FILES_UPDATE, &update,
+			1) < 0)
+		return NONE;
+
+	*slot = fd;
+	return index;
+}
+
+void IoUring::unregisterFile(int index)
+{
+	if (index < 0 || (size_t)index >= files.size()) return;
+
+	int none = NONE;
+	struct io_uring_files_update update = {};
+
+	update.offset = index;
+	update.fds = reinterpret_cast<uint64_t>(&none);
+	ioUringRegister(ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+	files[index] = NONE;
+}
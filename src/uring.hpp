@@ -0,0 +1,132 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <vector>
+
+/* An io_uring on the raw syscalls. Requests are queued with
+ * prepare() and reach the kernel together on submit(), one
+ * io_uring_enter() per batch. Completions are read straight off the
+ * mapped queue, a syscall is only made to wait for them. Not thread
+ * safe, each thread doing I/O should have its own */
+class IoUring {
+public:
+	struct Completion {
+		uint64_t userData;
+		int32_t res;
+	};
+
+	struct Stats {
+		/* requests handed to the kernel */
+		uint64_t submitted;
+		/* io_uring_enter() calls */
+		uint64_t enters;
+		uint64_t completed;
+	};
+
+	/* no registered buffer, or no registered file */
+	static constexpr int NONE = -1;
+
+	/* set in the userData of tag(), left clear by callers */
+	static constexpr uint64_t INTERNAL = 1ull << 63;
+
+private:
+	int ringFd;
+
+	void *sqMap;
+	size_t sqMapLen;
+	void *cqMap;
+	size_t cqMapLen;
+	struct io_uring_sqe *sqes;
+	size_t sqesLen;
+
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqArray;
+	unsigned sqMask;
+	unsigned sqEntries;
+	/* queued, and the part the kernel has taken */
+	unsigned sqLocalTail;
+	unsigned sqSubmitted;
+
+	unsigned *cqHead;
+	unsigned *cqTail;
+	struct io_uring_cqe *cqes;
+	unsigned cqMask;
+
+	/* taken off the queue while waiting for another one */
+	std::vector<Completion> early;
+	unsigned inFlight;
+	uint64_t nextTag;
+
+	std::vector<struct iovec> buffers;
+	/* registered fd table, NONE in free slots */
+	std::vector<int> files;
+	Stats stats;
+
+public:
+	IoUring(unsigned entries = 64);
+
+	IoUring(IoUring &) = delete;
+
+	~IoUring();
+
+	/* queue a request. the sqe is returned for more fields, e.g.
+	 * buf_index. submits what is queued first if the queue is
+	 * full. fd is a registered file index with fixedFile */
+	struct io_uring_sqe *prepare(uint8_t opcode, int fd, const void *buf,
+			uint32_t len, uint64_t off, uint64_t userData,
+			bool fixedFile = false);
+
+	/* queued but not submitted */
+	unsigned queued() const
+	{ return sqLocalTail - sqSubmitted; }
+
+	/* submitted but not reaped */
+	unsigned pending() const
+	{ return inFlight; }
+
+	/* hand the queued requests to the kernel and wait for at least
+	 * waitFor completions. returns the number submitted */
+	unsigned submit(unsigned waitFor = 0);
+
+	/* up to max completions already posted, no syscall */
+	size_t reap(Completion *out, size_t max);
+
+	/* a userData no caller picks, for a request waited on
+	 * right away */
+	uint64_t tag()
+	{ return INTERNAL | nextTag++; }
+
+	/* the result of the request with userData, submitting first.
+	 * other completions on the way are kept for reap() */
+	int32_t wait(uint64_t userData);
+
+	/* pin buffers for IORING_OP_READ_FIXED and WRITE_FIXED, replacing
+	 * those registered before. false if the kernel refuses */
+	bool registerBuffers(const struct iovec *iov, unsigned n);
+
+	/* the registered buffer holding [buf, buf + len), or NONE */
+	int findBuffer(const void *buf, size_t len) const;
+
+	/* add fd to the registered files. returns its index, or NONE */
+	int registerFile(int fd);
+
+	void unregisterFile(int index);
+
+	Stats getStats() const
+	{ return stats; }
+
+private:
+	/* the next completion, kept or posted. false if there is none */
+	bool next(Completion &completion);
+
+	/* the next one posted by the kernel */
+	bool take(Completion &completion);
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "vcpu.hpp"
+
+#include <signal.h>
+#include <pthread.h>
+#include "log.hpp"
+
+static void kickHandler(int)
+{
+	/* only here to make KVM_RUN return EINTR */
+}
+
+static void installKickHandler()
+{
+	static std::once_flag once;
+
+	std::call_once(once, [] {
+		struct sigaction action = {};
+
+		/* no SA_RESTART, KVM_RUN has to come back */
+		action.sa_handler = kickHandler;
+		sigemptyset(&action.sa_mask);
+		if (sigaction(VCPU_KICK_SIGNAL, &action, nullptr) < 0) {
+			console->error("Cannot install vcpu kick handler");
+			std::abort();
+		}
+	});
+}
+
+VcpuManager::VcpuManager(vm_t *_vm, size_t nVcpus)
+	: vm(_vm), stopping(false)
+{
+	installKickHandler();
+
+	for (size_t i = 0; i < nVcpus; i++) {
+		auto v = std::make_unique<Vcpu>();
+
+		v->vcpu = vcpu_init(vm, i);
+		vcpus.push_back(std::move(v));
+	}
+}
+
+VcpuManager::~VcpuManager()
+{
+	shutdown();
+
+	for (auto &v : vcpus)
+		vcpu_destroy(v->vcpu);
+}
+
+void VcpuManager::setExitHandler(size_t id, ExitHandler handler)
+{
+	vcpus.at(id)->handler = std::move(handler);
+}
+
+void VcpuManager::setEntryHandler(size_t id, EntryHandler handler)
+{
+	vcpus.at(id)->entryHandler = std::move(handler);
+}
+
+void VcpuManager::start()
+{
+	for (auto &v : vcpus) {
+		if (!v->handler) {
+			console->error("vcpu {} has no exit handler", v->vcpu->id);
+			std::abort();
+		}
+
+		Vcpu *raw = v.get();
+		v->thread = std::thread([this, raw] { run(*raw); });
+	}
+}
+
+void VcpuManager::run(Vcpu &v)
+{
+	console->debug("vcpu {} started", v.vcpu->id);
+
+	while (!stopping.load(std::memory_order_acquire)) {
+		if (v.entryHandler) v.entryHandler(v.vcpu);
+
+		enum vcpu_exit_reason reason = vcpu_run(v.vcpu);
+
+		/* a kick, go back and check whether we are stopping */
+		if (reason == VCPU_INTERRUPTED) {
+			v.vcpu->kvm_run->immediate_exit = 0;
+			continue;
+		}
+
+		if (!v.handler(v.vcpu, reason)) break;
+	}
+
+	console->debug("vcpu {} stopped", v.vcpu->id);
+}
+
+void VcpuManager::kick()
+{
+	for (auto &v : vcpus) {
+		if (v->thread.joinable())
+			kick(v->vcpu, v->thread.native_handle());
+	}
+}
+
+void VcpuManager::kick(vcpu_t *vcpu, pthread_t thread)
+{
+	installKickHandler();
+
+	/* immediate_exit covers a kick that lands before KVM_RUN.
+	 * the thread clears it once it is out */
+	vcpu->kvm_run->immediate_exit = 1;
+	pthread_kill(thread, VCPU_KICK_SIGNAL);
+}
+
+void VcpuManager::shutdown()
+{
+	stopping.store(true, std::memory_order_release);
+
+	for (auto &v : vcpus) {
+		if (!v->thread.joinable()) continue;
+
+		/* immediate_exit covers a kick that lands before KVM_RUN */
+		v->vcpu->kvm_run->immediate_exit = 1;
+		pthread_kill(v->thread.native_handle(), VCPU_KICK_SIGNAL);
+	}
+
+	join();
+}
+
+void VcpuManager::join()
+{
+	for (auto &v : vcpus) {
+		if (v->thread.joinable())
+			v->thread.join();
+	}
+}
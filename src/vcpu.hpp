@@ -0,0 +1,79 @@
+#ifndef VCPU_HPP
+#define VCPU_HPP
+
+#include <signal.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "kvm.h"
+
+/* signal used to kick a vcpu thread out of KVM_RUN */
+#define VCPU_KICK_SIGNAL SIGUSR1
+
+/* Owns the vcpus of one VM and runs each of them
+ * on a dedicated host thread */
+class VcpuManager {
+public:
+	/* called on every exit of a vcpu, on that vcpu's thread.
+	 * returning false stops the vcpu */
+	using ExitHandler =
+		std::function<bool(vcpu_t *vcpu, enum vcpu_exit_reason reason)>;
+
+	/* called before every entry, on that vcpu's thread */
+	using EntryHandler = std::function<void(vcpu_t *vcpu)>;
+
+private:
+	struct Vcpu {
+		vcpu_t *vcpu;
+		ExitHandler handler;
+		EntryHandler entryHandler;
+		std::thread thread;
+	};
+
+	vm_t *vm;
+	std::vector<std::unique_ptr<Vcpu>> vcpus;
+	std::atomic<bool> stopping;
+public:
+	/* creates nVcpus vcpus with ids 0 .. nVcpus - 1 */
+	VcpuManager(vm_t *_vm, size_t nVcpus);
+
+	VcpuManager(VcpuManager &) = delete;
+
+	~VcpuManager();
+
+	size_t size() const
+	{ return vcpus.size(); }
+
+	vcpu_t *getVcpu(size_t id)
+	{ return vcpus.at(id)->vcpu; }
+
+	/* must be set for every vcpu before start() */
+	void setExitHandler(size_t id, ExitHandler handler);
+
+	/* optional, e.g. MemorySpace::syncTlb */
+	void setEntryHandler(size_t id, EntryHandler handler);
+
+	void start();
+
+	/* bring the running vcpus out of the guest once, through
+	 * their entry handlers and back in */
+	void kick();
+
+	/* the same for a vcpu run by hand on thread */
+	static void kick(vcpu_t *vcpu, pthread_t thread);
+
+	/* stop all vcpus, kicking them out of the guest,
+	 * and wait for their threads */
+	void shutdown();
+
+	/* wait for all vcpus to stop on their own */
+	void join();
+
+private:
+	void run(Vcpu &vcpu);
+};
+
+#endif
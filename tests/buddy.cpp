@@ -0,0 +1,120 @@
+/* BuddyMemoryPool splits and merges blocks, and refuses frees
+ * of anything but a whole allocated block */
+
+#include "test.hpp"
+#include "memory.hpp"
+
+static constexpr size_t poolSize = 4 << 20;
+
+/* the free blocks as (address, order) pairs */
+static std::vector<std::pair<addr_t, unsigned>> freeBlocks(MemoryPool &pool)
+{
+	std::vector<uint64_t> state;
+	std::vector<std::pair<addr_t, unsigned>> blocks;
+
+	pool.saveState(state);
+	for (size_t i = 0; i + 1 < state.size(); i += 2)
+		if (!(state[i + 1] >> 63))
+			blocks.emplace_back(state[i], state[i + 1]);
+
+	return blocks;
+}
+
+static void testSplitMerge(vm_t *vm)
+{
+	BuddyMemoryPool pool(vm, 0, poolSize);
+
+	CHECK(freeBlocks(pool).size() == 1);
+
+	/* one page splits the 4 MiB block down to order 12 */
+	addr_t page = pool.getPhysicalMemoryBlock(PAGE_SIZE);
+	auto blocks = freeBlocks(pool);
+
+	CHECK(page == 0);
+	CHECK(blocks.size() == 22 - 12);
+	for (auto &block : blocks)
+		CHECK(block.first == 1ULL << block.second);
+
+	/* lengths round up to a power of two, naturally aligned */
+	addr_t three = pool.getPhysicalMemoryBlock(3 * PAGE_SIZE);
+	addr_t aligned = pool.getAlignedPhysicalMemoryBlock(PAGE_SIZE,
+			PAGE_SIZE_2M);
+
+	CHECK(three % (4 * PAGE_SIZE) == 0);
+	CHECK(aligned % PAGE_SIZE_2M == 0);
+	CHECK(aligned != page && three != page && aligned != three);
+
+	/* and it all merges back */
+	pool.freePhysicalMemoryBlock(aligned, PAGE_SIZE);
+	pool.freePhysicalMemoryBlock(page, PAGE_SIZE);
+	pool.freePhysicalMemoryBlock(three, 3 * PAGE_SIZE);
+
+	blocks = freeBlocks(pool);
+	CHECK(blocks.size() == 1);
+	CHECK(!blocks.empty() && blocks[0].first == 0 && blocks[0].second == 22);
+}
+
+static void testInvalidFree(vm_t *vm)
+{
+	BuddyMemoryPool pool(vm, 0, poolSize);
+	addr_t page = pool.getPhysicalMemoryBlock(PAGE_SIZE);
+	addr_t pair = pool.getPhysicalMemoryBlock(2 * PAGE_SIZE);
+
+	pool.freePhysicalMemoryBlock(page, PAGE_SIZE);
+
+	/* a double free */
+	CHECK(aborts([&] { pool.freePhysicalMemoryBlock(page, PAGE_SIZE); }));
+
+	/* part of a larger free block */
+	CHECK(aborts([&] { pool.freePhysicalMemoryBlock(1 << 20, PAGE_SIZE); }));
+
+	/* part of an allocated block, or the block with another size */
+	CHECK(aborts([&] {
+		pool.freePhysicalMemoryBlock(pair + PAGE_SIZE, PAGE_SIZE);
+	}));
+	CHECK(aborts([&] { pool.freePhysicalMemoryBlock(pair, PAGE_SIZE); }));
+	CHECK(aborts([&] {
+		pool.freePhysicalMemoryBlock(pair, 4 * PAGE_SIZE);
+	}));
+
+	/* still fine the right way */
+	CHECK(!aborts([&] {
+		pool.freePhysicalMemoryBlock(pair, 2 * PAGE_SIZE);
+	}));
+}
+
+static void testSaveState(vm_t *vm)
+{
+	BuddyMemoryPool pool(vm, 0, poolSize);
+	BuddyMemoryPool restored(vm, poolSize, poolSize);
+	addr_t pair = pool.getPhysicalMemoryBlock(2 * PAGE_SIZE);
+	std::vector<uint64_t> state;
+
+	/* the same layout, at another base for the second slot */
+	pool.saveState(state);
+	for (size_t i = 0; i + 1 < state.size(); i += 2)
+		state[i] += poolSize;
+	restored.loadState(state);
+
+	CHECK(aborts([&] {
+		restored.freePhysicalMemoryBlock(poolSize + pair, PAGE_SIZE);
+	}));
+
+	restored.freePhysicalMemoryBlock(poolSize + pair, 2 * PAGE_SIZE);
+	CHECK(freeBlocks(restored).size() == 1);
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	testSplitMerge(&vm);
+	testInvalidFree(&vm);
+	testSaveState(&vm);
+
+	vm_destroy(&vm);
+	return testResult();
+}
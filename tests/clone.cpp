@@ -0,0 +1,141 @@
+/* Clones share the template's memory until they write it, the
+ * template does not give memory back under them, and the memfd
+ * behind a cloneable sandbox is not leaked */
+
+#include <cstring>
+#include <dirent.h>
+#include "test.hpp"
+#include "abi.h"
+#include "archflags.h"
+#include "sandbox.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+
+static size_t openFds()
+{
+	DIR *dir = opendir("/proc/self/fd");
+	size_t n = 0;
+
+	while (readdir(dir)) n++;
+	closedir(dir);
+	return n;
+}
+
+static void testMemfdLeak()
+{
+	MemfdHostMemoryMapper mapper;
+	size_t before = openFds();
+
+	/* too large for the file */
+	CHECK(mapper(~(size_t)0 & ~(PAGE_SIZE - 1)) == nullptr);
+	CHECK(openFds() == before);
+	CHECK(mapper.getFd() < 0);
+}
+
+static void testCopyOnWrite(const KernelImage &kernel)
+{
+	Sandbox tmpl(memorySize, kernel, true);
+	MemoryPool *pool = tmpl.getMemoryPool();
+	addr_t page = pool->getPhysicalMemoryBlock(PAGE_SIZE);
+	char *host = static_cast<char *>(pool->getHostVirtualFromPhysical(page));
+
+	strcpy(host, "template");
+
+	SandboxPtr a = tmpl.clone();
+	SandboxPtr b = tmpl.clone();
+	char *hostA = static_cast<char *>(
+		a->getMemoryPool()->getHostVirtualFromPhysical(page));
+	char *hostB = static_cast<char *>(
+		b->getMemoryPool()->getHostVirtualFromPhysical(page));
+
+	CHECK(!strcmp(hostA, "template"));
+	strcpy(hostA, "clone");
+	CHECK(!strcmp(hostA, "clone"));
+	CHECK(!strcmp(hostB, "template"));
+	CHECK(!strcmp(host, "template"));
+
+	/* the clone runs from the template's registers */
+	CHECK(a->run() == VCPU_HYPERCALL);
+	CHECK(VCPU_REG_GET(a->getVcpu(), rax) == HYPERCALL_NONE);
+}
+
+static void testReclaim(const KernelImage &kernel)
+{
+	Sandbox tmpl(memorySize, kernel, true);
+	MemoryPool *pool = tmpl.getMemoryPool();
+	size_t len = 4 << 20;
+	addr_t block = pool->getPhysicalMemoryBlock(len);
+	char *host = static_cast<char *>(pool->getHostVirtualFromPhysical(block));
+
+	/* reclaimed before the clone, so nothing shared is punched */
+	pool->setReclaimThresholds(0, 0);
+	memset(host, 'x', len);
+	pool->freePhysicalMemoryBlock(block, len);
+	pool->reclaim();
+	CHECK(pool->getReclaimStats().reclaimedBytes > 0);
+
+	block = pool->getPhysicalMemoryBlock(len);
+	host = static_cast<char *>(pool->getHostVirtualFromPhysical(block));
+	strcpy(host, "template");
+
+	SandboxPtr a = tmpl.clone();
+	char *hostA = static_cast<char *>(
+		a->getMemoryPool()->getHostVirtualFromPhysical(block));
+	uint64_t reclaimed = pool->getReclaimStats().reclaimedBytes;
+
+	/* freed in the template, still in use in the clone */
+	pool->freePhysicalMemoryBlock(block, len);
+	pool->reclaim();
+	CHECK(pool->getReclaimStats().reclaimedBytes == reclaimed);
+	CHECK(!strcmp(hostA, "template"));
+
+	/* and the guest has to ask somewhere else */
+	CHECK(!pool->balloon(block, PAGE_SIZE));
+
+	/* with the clone gone, reclaiming goes on */
+	a.reset();
+	block = pool->getPhysicalMemoryBlock(len);
+	host = static_cast<char *>(pool->getHostVirtualFromPhysical(block));
+	memset(host, 'y', len);
+	pool->freePhysicalMemoryBlock(block, len);
+	pool->reclaim();
+	CHECK(pool->getReclaimStats().reclaimedBytes > reclaimed);
+	CHECK(host[0] == 0);
+}
+
+static void testPcid(const KernelImage &kernel)
+{
+	Sandbox tmpl(memorySize, kernel, true);
+	vcpu_t *vcpu = tmpl.getVcpu();
+
+	if (!vcpu->pcid) {
+		printf("no PCIDs, skipped\n");
+		return;
+	}
+
+	uint32_t tag = VCPU_SREG_GET(vcpu, cr3) & CR3_PCID_MASK;
+	CHECK(tag != 0);
+
+	SandboxPtr a = tmpl.clone();
+
+	/* the tag its CR3 came with is held in the clone's VM */
+	CHECK((VCPU_SREG_GET(a->getVcpu(), cr3) & CR3_PCID_MASK) == tag);
+	CHECK(!vm_reserve_pcid(a->getVm(), tag));
+	CHECK(vm_alloc_pcid(a->getVm()) != tag);
+
+	CHECK(a->run() == VCPU_HYPERCALL);
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	testMemfdLeak();
+	testCopyOnWrite(kernel);
+	testReclaim(kernel);
+	testPcid(kernel);
+
+	return testResult();
+}
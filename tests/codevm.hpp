@@ -0,0 +1,61 @@
+#ifndef CODEVM_HPP
+#define CODEVM_HPP
+
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "kvm.h"
+#include "memory.hpp"
+#include "vcpu.hpp"
+
+/* where the code is mapped, clear of the kernel layout in abi.h */
+#define CODE_BASE 0x10000000
+
+/* A VM whose vcpus all start on the same few bytes of code,
+ * without the guest kernel */
+class CodeVm {
+private:
+	vm_t vm;
+	std::unique_ptr<BuddyMemoryPool> pool;
+	std::unique_ptr<MemorySpace> space;
+	std::unique_ptr<VcpuManager> vcpus;
+public:
+	CodeVm(size_t nVcpus, const std::vector<uint8_t> &code)
+	{
+		vm_init(&vm);
+		pool = std::make_unique<BuddyMemoryPool>(&vm, 0, 4 << 20);
+		space = std::make_unique<MemorySpace>(pool.get());
+
+		addr_t page = pool->getPhysicalMemoryBlock(PAGE_SIZE);
+
+		memcpy(pool->getHostVirtualFromPhysical(page), code.data(),
+				code.size());
+		space->mapPage(CODE_BASE, page, PAGE_SIZE, false, false);
+
+		vcpus = std::make_unique<VcpuManager>(&vm, nVcpus);
+		for (size_t i = 0; i < nVcpus; i++) {
+			vcpu_t *vcpu = vcpus->getVcpu(i);
+
+			space->apply(vcpu);
+			VCPU_REG(vcpu, rip) = CODE_BASE;
+		}
+	}
+
+	CodeVm(CodeVm &) = delete;
+
+	~CodeVm()
+	{
+		vcpus.reset();
+		space.reset();
+		pool.reset();
+		vm_destroy(&vm);
+	}
+
+	VcpuManager &getVcpus()
+	{ return *vcpus; }
+
+	MemorySpace *getMemorySpace()
+	{ return space.get(); }
+};
+
+#endif
@@ -0,0 +1,64 @@
+/* Page faults of a guest program are resolved by its regions, and
+ * those that are not allowed are refused rather than reported as
+ * resolved, which would have the guest fault on them forever */
+
+#include "test.hpp"
+#include "guest.hpp"
+#include "region.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr addr_t anonymousBase = 0x20000000;
+
+static void testReadOnlySegment(const KernelImage &kernel)
+{
+	Sandbox sandbox(memorySize, kernel);
+	addr_t entry = loadGuest(sandbox, GUEST_ELF("rodata"));
+	uint64_t result;
+
+	startGuest(sandbox, entry);
+
+	/* text, rodata and bss are all faulted in */
+	CHECK(resumeGuest(sandbox, result) == GUEST_REPORT);
+	CHECK(result == 43);
+
+	/* the write to rodata is refused */
+	CHECK(resumeGuest(sandbox, result) == GUEST_FAULT);
+	CHECK(result != 0);
+
+	/* and stays refused */
+	uint64_t again;
+	CHECK(resumeGuest(sandbox, again) == GUEST_FAULT);
+	CHECK(again == result);
+
+	/* reading it is fine */
+	MemorySpace *space = sandbox.getMemorySpace();
+	CHECK(space->fault(result & ~(PAGE_SIZE - 1), PF_PRESENT));
+	CHECK(!space->fault(result & ~(PAGE_SIZE - 1), PF_PRESENT | PF_WRITE));
+}
+
+static void testErrorCode(const KernelImage &kernel)
+{
+	Sandbox sandbox(memorySize, kernel);
+	MemorySpace *space = sandbox.getMemorySpace();
+
+	space->addRegion(std::make_shared<AnonymousMemoryRegion>(
+			sandbox.getMemoryPool(), anonymousBase, 16 * PAGE_SIZE));
+
+	CHECK(space->fault(anonymousBase, PF_WRITE));
+	/* present and writable already */
+	CHECK(space->fault(anonymousBase, PF_PRESENT | PF_WRITE));
+	/* outside any region */
+	CHECK(!space->fault(anonymousBase + 16 * PAGE_SIZE, 0));
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	testReadOnlySegment(kernel);
+	testErrorCode(kernel);
+
+	return testResult();
+}
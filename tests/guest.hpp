@@ -0,0 +1,64 @@
+#ifndef GUEST_HPP
+#define GUEST_HPP
+
+#include "abi.h"
+#include "elf.hpp"
+#include "sandbox.hpp"
+
+/* Running the programs in tests/guest on top of the guest kernel.
+ * A program starts with up to three arguments and reports back with
+ * HYPERCALL_NONE, a value in rdi. It can be resumed after that */
+
+enum GuestStop {
+	/* HYPERCALL_NONE */
+	GUEST_REPORT,
+	/* a page fault the host refused */
+	GUEST_FAULT,
+	/* any other exit, or a hypercall the sandbox does not know */
+	GUEST_ERROR,
+};
+
+/* load the program and let the kernel set up its tables.
+ * returns the entry point */
+static inline addr_t loadGuest(Sandbox &sandbox, const char *path)
+{
+	ElfLoader loader(sandbox.getVm(), sandbox.getMemorySpace(),
+			sandbox.getMemoryPool(), FILE_WINDOW_BASE);
+	addr_t entry = loader.load(path);
+
+	sandbox.run();
+	return entry;
+}
+
+static inline void startGuest(Sandbox &sandbox, addr_t entry,
+		uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0)
+{
+	vcpu_t *vcpu = sandbox.getVcpu();
+
+	VCPU_REG(vcpu, rip) = entry;
+	VCPU_REG(vcpu, rdi) = arg0;
+	VCPU_REG(vcpu, rsi) = arg1;
+	VCPU_REG(vcpu, rdx) = arg2;
+}
+
+/* run until the program reports, with the value in result, or
+ * stops. for a refused fault, result is the address */
+static inline GuestStop resumeGuest(Sandbox &sandbox, uint64_t &result)
+{
+	vcpu_t *vcpu = sandbox.getVcpu();
+
+	for (;;) {
+		if (sandbox.run() != VCPU_HYPERCALL) return GUEST_ERROR;
+
+		uint64_t nr = VCPU_REG_GET(vcpu, rax);
+
+		result = VCPU_REG_GET(vcpu, rdi);
+		if (nr == HYPERCALL_NONE) return GUEST_REPORT;
+
+		if (!sandbox.handleHypercall()) return GUEST_ERROR;
+		if (nr == HYPERCALL_FAULT && VCPU_REG_GET(vcpu, rax))
+			return GUEST_FAULT;
+	}
+}
+
+#endif
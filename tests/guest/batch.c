@@ -0,0 +1,27 @@
+/* submits total NOPs in batches of batch with one ring_enter()
+ * each, reaps them in order and reports the number completed,
+ * or -1 if a completion came back out of order or failed */
+
+#include "kernel.h"
+
+void _start(uint64_t batch, uint64_t total)
+{
+	struct ring_cqe cqe;
+	uint64_t sent = 0, done = 0, i;
+	int ok = 1;
+
+	while (sent < total) {
+		for (i = 0; i < batch && sent < total; i++, sent++)
+			ring_submit(RING_NOP, 0, 0, 0, 0, sent);
+		ring_enter();
+
+		while (done < sent) {
+			ring_wait(&cqe);
+			ok = ok && cqe.user_data == done && cqe.res == 0;
+			done++;
+		}
+	}
+
+	for (;;)
+		hypercall(HYPERCALL_NONE, ok ? done : (uint64_t)-1, 0);
+}
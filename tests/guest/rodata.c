@@ -0,0 +1,19 @@
+/* reads its read-only data and writes its bss, then writes
+ * to the read-only data */
+
+#include "kernel.h"
+
+static const uint64_t constant = 42;
+static volatile uint64_t variable;
+
+void _start(void)
+{
+	volatile uint64_t *p = (volatile uint64_t *)&constant;
+
+	variable = *p + 1;
+	hypercall(HYPERCALL_NONE, variable, 0);
+
+	*p = 0;
+	for (;;)
+		hypercall(HYPERCALL_NONE, *p, 0);
+}
@@ -0,0 +1,24 @@
+/* touches n pages from base and reports 0, then keeps reading
+ * them without ever leaving the guest until the first word of
+ * the first page is set, and reports the number of rounds */
+
+#include "kernel.h"
+
+void _start(uint64_t base, uint64_t n)
+{
+	volatile uint64_t *stop = (volatile uint64_t *)base;
+	uint64_t rounds = 0, i, sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += *(volatile uint64_t *)(base + i * 4096);
+	hypercall(HYPERCALL_NONE, sum, 0);
+
+	while (!*stop) {
+		for (i = 1; i < n; i++)
+			sum += *(volatile uint64_t *)(base + i * 4096);
+		rounds++;
+	}
+
+	for (;;)
+		hypercall(HYPERCALL_NONE, rounds, 0);
+}
@@ -0,0 +1,33 @@
+/* writes total records of len bytes to fd, batch of them per
+ * ring_enter(), and reports the number written, or -1 if a write
+ * came back short or failed */
+
+#include "kernel.h"
+
+static char record[256];
+
+void _start(uint64_t batch, uint64_t total, uint64_t fd)
+{
+	struct ring_cqe cqe;
+	uint64_t sent = 0, done = 0, i;
+	int ok = 1;
+
+	for (i = 0; i < sizeof(record); i++)
+		record[i] = 'a' + i % 26;
+
+	while (sent < total) {
+		for (i = 0; i < batch && sent < total; i++, sent++)
+			ring_submit(RING_WRITE, fd, (uint64_t)record,
+					sizeof(record), 0, sent);
+		ring_enter();
+
+		while (done < sent) {
+			ring_wait(&cqe);
+			ok = ok && cqe.res == sizeof(record);
+			done++;
+		}
+	}
+
+	for (;;)
+		hypercall(HYPERCALL_NONE, ok ? done : (uint64_t)-1, 0);
+}
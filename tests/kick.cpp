@@ -0,0 +1,48 @@
+/* shutdown() brings every vcpu thread out of the guest, also vcpus
+ * that never exit on their own and kicks that land before KVM_RUN */
+
+#include <atomic>
+#include <thread>
+#include "test.hpp"
+#include "codevm.hpp"
+
+/* jmp . */
+static const std::vector<uint8_t> spin = { 0xeb, 0xfe };
+
+static constexpr int rounds = 20;
+static constexpr size_t nVcpus = 4;
+
+int main()
+{
+	testInit();
+
+	for (int round = 0; round < rounds; round++) {
+		CodeVm vm(nVcpus, spin);
+		VcpuManager &vcpus = vm.getVcpus();
+		std::atomic<size_t> entries(0);
+		std::atomic<size_t> exits(0);
+
+		for (size_t i = 0; i < nVcpus; i++) {
+			vcpus.setEntryHandler(i, [&](vcpu_t *) { entries++; });
+			vcpus.setExitHandler(i,
+				[&](vcpu_t *, enum vcpu_exit_reason) {
+					exits++;
+					return true;
+				});
+		}
+
+		vcpus.start();
+
+		/* every other round kicks before the vcpus are in */
+		if (round % 2)
+			while (entries < nVcpus)
+				std::this_thread::yield();
+
+		vcpus.shutdown();
+
+		/* spinning, they never exit by themselves */
+		CHECK(exits == 0);
+	}
+
+	return testResult();
+}
@@ -0,0 +1,115 @@
+/* Sandboxes running the same program map its read-only segments
+ * from one cached mapping, which outlives them until trimmed. A
+ * file changed on disk is not served from the old mapping */
+
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include "test.hpp"
+#include "guest.hpp"
+#include "pagecache.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+
+static std::string copyPath()
+{
+	return "/tmp/lightvirt-test-" + std::to_string(getpid()) + "-rodata";
+}
+
+static void runGuest(Sandbox &sandbox, const char *path)
+{
+	addr_t entry = loadGuest(sandbox, path);
+	uint64_t result;
+
+	startGuest(sandbox, entry);
+	CHECK(resumeGuest(sandbox, result) == GUEST_REPORT);
+	CHECK(result == 43);
+}
+
+static void testShared(const KernelImage &kernel)
+{
+	PageCache &cache = PageCache::instance();
+	PageCache::Stats before = cache.getStats();
+
+	{
+		Sandbox a(memorySize, kernel);
+		Sandbox b(memorySize, kernel);
+
+		runGuest(a, GUEST_ELF("rodata"));
+		PageCache::Stats first = cache.getStats();
+
+		runGuest(b, GUEST_ELF("rodata"));
+		PageCache::Stats second = cache.getStats();
+
+		printf("first: %lu misses, second: %lu hits, %lu bytes cached\n",
+				first.misses - before.misses,
+				second.hits - first.hits,
+				second.cachedBytes - before.cachedBytes);
+
+		/* the second sandbox maps nothing of its own */
+		CHECK(first.misses > before.misses);
+		CHECK(second.misses == first.misses);
+		CHECK(second.hits > first.hits);
+		CHECK(second.cachedBytes == first.cachedBytes);
+
+		uint64_t sharedA = cache.getVmStats(a.getVm()).sharedBytes;
+
+		CHECK(sharedA > 0);
+		CHECK(cache.getVmStats(b.getVm()).sharedBytes == sharedA);
+		CHECK(second.sharedBytes - before.sharedBytes == 2 * sharedA);
+	}
+
+	/* kept for the next sandbox until trimmed */
+	PageCache::Stats after = cache.getStats();
+	CHECK(after.sharedBytes == before.sharedBytes);
+	CHECK(after.cachedBytes > before.cachedBytes);
+
+	cache.trim();
+	after = cache.getStats();
+	CHECK(after.cachedBytes == before.cachedBytes);
+	CHECK(after.evictions > before.evictions);
+}
+
+static void testChanged(const KernelImage &kernel)
+{
+	PageCache &cache = PageCache::instance();
+	std::string path = copyPath();
+
+	{
+		std::ifstream in(GUEST_ELF("rodata"), std::ios::binary);
+		std::ofstream out(path, std::ios::binary);
+
+		out << in.rdbuf();
+	}
+
+	Sandbox a(memorySize, kernel);
+	runGuest(a, path.c_str());
+
+	/* as if rewritten with the same size */
+	struct timespec times[2] = { { 0, UTIME_OMIT }, { 1, 0 } };
+	CHECK(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+
+	PageCache::Stats before = cache.getStats();
+	Sandbox b(memorySize, kernel);
+
+	runGuest(b, path.c_str());
+	PageCache::Stats after = cache.getStats();
+
+	/* a new mapping, not the one a still holds */
+	CHECK(after.misses > before.misses);
+	CHECK(after.cachedBytes > before.cachedBytes);
+
+	unlink(path.c_str());
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	testShared(kernel);
+	testChanged(kernel);
+
+	return testResult();
+}
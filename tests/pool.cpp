@@ -0,0 +1,87 @@
+/* A pool translates addresses without its lock while another thread
+ * grows it, and a huge page pool only backs what it has grown to */
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <sys/mman.h>
+#include "test.hpp"
+#include "memory.hpp"
+
+static constexpr size_t initialSize = 4 << 20;
+static constexpr size_t maxSize = 1ULL << 30;
+
+static void testGrowRace(vm_t *vm)
+{
+	BuddyMemoryPool pool(vm, 0, initialSize,
+			DefaultHostMemoryMapper::instance, maxSize);
+	std::atomic<size_t> published(0);
+	std::atomic<bool> done(false);
+	int mismatches = 0;
+
+	/* translates every block the other thread has handed over */
+	std::thread reader([&] {
+		while (!done) {
+			size_t n = published;
+
+			for (size_t i = 0; i < n; i++) {
+				addr_t addr = i * PAGE_SIZE_2M;
+				auto *host = static_cast<uint64_t *>(
+					pool.getHostVirtualFromPhysical(addr));
+
+				if (*host != addr ||
+					pool.getPhysicalFromHostVirtual(host) != addr)
+					mismatches++;
+			}
+		}
+	});
+
+	for (size_t i = 0; i < maxSize / PAGE_SIZE_2M / 4; i++) {
+		addr_t addr = pool.getAlignedPhysicalMemoryBlock(PAGE_SIZE_2M,
+				PAGE_SIZE_2M);
+		if (addr != i * PAGE_SIZE_2M) break;
+
+		*static_cast<uint64_t *>(pool.getHostVirtualFromPhysical(addr)) =
+			addr;
+		published = i + 1;
+	}
+
+	done = true;
+	reader.join();
+
+	CHECK(published == maxSize / PAGE_SIZE_2M / 4);
+	CHECK(pool.getSize() > initialSize);
+	CHECK(mismatches == 0);
+}
+
+static void testHugePageCommit(vm_t *vm)
+{
+	BuddyMemoryPool pool(vm, 0, initialSize,
+			HugePageHostMemoryMapper::instance, maxSize);
+	size_t len = 3 * initialSize;
+	addr_t block = pool.getPhysicalMemoryBlock(len);
+	char *host = static_cast<char *>(pool.getHostVirtualFromPhysical(block));
+
+	memset(host, 0xa5, len);
+	CHECK(host[len - 1] == (char)0xa5);
+
+	/* beyond the grown chunks there is no memory, only address space */
+	unsigned char resident;
+	char *past = host + alignUp(pool.getSize(), PAGE_SIZE_2M);
+	CHECK(mincore(past, PAGE_SIZE, &resident) == 0);
+	CHECK(!(resident & 1));
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	testGrowRace(&vm);
+	testHugePageCommit(&vm);
+
+	vm_destroy(&vm);
+	return testResult();
+}
@@ -0,0 +1,111 @@
+/* Faults look regions up without a lock while other threads add and
+ * remove regions, and a removed region is gone for good */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "test.hpp"
+#include "memory.hpp"
+#include "region.hpp"
+
+static constexpr addr_t stableBase = 0x10000000;
+static constexpr addr_t churnBase = 0x40000000;
+static constexpr size_t regionLen = 1 << 20;
+static constexpr int nThreads = 4;
+
+static void testConcurrentLookup(MemorySpace &space, AbstractMemoryPool *pool)
+{
+	for (int t = 0; t < nThreads; t++)
+		space.addRegion(std::make_shared<AnonymousMemoryRegion>(pool,
+				stableBase + t * regionLen, regionLen));
+
+	std::atomic<bool> done(false);
+	std::atomic<int> failures(0);
+	std::vector<std::thread> threads;
+	int churned = 0;
+
+	for (int t = 0; t < nThreads; t++) {
+		threads.emplace_back([&, t] {
+			addr_t base = stableBase + t * regionLen;
+
+			for (int round = 0; !done || round < 4; round++)
+				for (size_t off = 0; off < regionLen;
+						off += PAGE_SIZE)
+					if (!space.fault(base + off, PF_WRITE))
+						failures++;
+		});
+	}
+
+	/* regions come and go on either side of the stable ones */
+	for (int i = 0; i < 200; i++) {
+		addr_t below = stableBase - (i % 8 + 1) * regionLen;
+		addr_t above = churnBase + (i % 8) * regionLen;
+
+		space.addRegion(std::make_shared<AnonymousMemoryRegion>(pool,
+				below, regionLen));
+		space.addRegion(std::make_shared<AnonymousMemoryRegion>(pool,
+				above, regionLen));
+		space.fault(above, PF_WRITE);
+		space.removeRegion(below);
+		space.removeRegion(above);
+		churned++;
+	}
+
+	done = true;
+	for (auto &thread : threads)
+		thread.join();
+
+	CHECK(churned == 200);
+	CHECK(failures == 0);
+}
+
+static void testRemoveWhileFaulting(MemorySpace &space,
+		AbstractMemoryPool *pool)
+{
+	for (int i = 0; i < 20; i++) {
+		std::atomic<bool> started(false);
+
+		space.addRegion(std::make_shared<AnonymousMemoryRegion>(pool,
+				churnBase, regionLen));
+
+		std::thread faulter([&] {
+			started = true;
+			for (size_t off = 0; off < regionLen; off += PAGE_SIZE)
+				space.fault(churnBase + off, PF_WRITE);
+		});
+
+		while (!started)
+			std::this_thread::yield();
+		space.removeRegion(churnBase);
+		faulter.join();
+
+		/* nothing resolves or stays mapped in it */
+		uint64_t value;
+		CHECK(!space.fault(churnBase, PF_WRITE));
+		CHECK(!space.readGuest(churnBase + regionLen - PAGE_SIZE,
+				&value, sizeof(value)));
+	}
+}
+
+int main()
+{
+	testInit();
+
+	vm_t vm;
+	vm_init(&vm);
+
+	{
+		BuddyMemoryPool pool(&vm, 0, 16 << 20,
+				DefaultHostMemoryMapper::instance, 256 << 20);
+		MemorySpace space(&pool);
+
+		/* the refused faults are expected */
+		console->set_level(spdlog::level::err);
+
+		testConcurrentLookup(space, &pool);
+		testRemoveWhileFaulting(space, &pool);
+	}
+
+	vm_destroy(&vm);
+	return testResult();
+}
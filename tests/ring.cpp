@@ -0,0 +1,66 @@
+/* Requests queued together on the syscall ring cost the guest one
+ * HYPERCALL_RING per batch, and complete in order. Rings sharing a
+ * VM each get their own doorbells from the IoThread */
+
+#include "test.hpp"
+#include "guest.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr uint64_t total = 256;
+
+static void testBatch(const KernelImage &kernel, uint64_t batch)
+{
+	Sandbox sandbox(memorySize, kernel);
+	SyscallRing *ring = sandbox.enableSyscallRing();
+	addr_t entry = loadGuest(sandbox, GUEST_ELF("batch"));
+	uint64_t result;
+
+	startGuest(sandbox, entry, batch, total);
+	CHECK(resumeGuest(sandbox, result) == GUEST_REPORT);
+	CHECK(result == total);
+
+	auto stats = ring->getStats();
+	printf("batch %lu: %lu requests, %lu exits\n", batch,
+			stats.completed, stats.enters);
+	CHECK(stats.completed == total);
+	CHECK(stats.enters == total / batch);
+}
+
+static void testDoorbells(const KernelImage &kernel)
+{
+	Sandbox sandbox(memorySize, kernel);
+	/* takes the first doorbell value of the VM */
+	MemorySpace otherSpace(sandbox.getMemoryPool());
+	SyscallRing other(&otherSpace, sandbox.getMemoryPool());
+
+	other.attachIoThread(sandbox.getVm());
+
+	SyscallRing *ring = sandbox.enableIoThread();
+	addr_t entry = loadGuest(sandbox, GUEST_ELF("batch"));
+	uint64_t result;
+
+	startGuest(sandbox, entry, 8, total);
+	CHECK(resumeGuest(sandbox, result) == GUEST_REPORT);
+	CHECK(result == total);
+
+	auto stats = ring->getStats();
+	printf("doorbells: %lu for this ring, %lu for the other\n",
+			stats.doorbells, other.getStats().doorbells);
+	CHECK(stats.completed == total);
+	CHECK(stats.doorbells > 0);
+	CHECK(other.getStats().doorbells == 0);
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	testBatch(kernel, 1);
+	testBatch(kernel, 8);
+	testBatch(kernel, SYSCALL_RING_ENTRIES);
+	testDoorbells(kernel);
+
+	return testResult();
+}
@@ -0,0 +1,68 @@
+/* SandboxPool hands out booted sandboxes faster than one can be
+ * booted, and recycles released ones */
+
+#include <thread>
+#include "test.hpp"
+#include "abi.h"
+#include "sandbox.hpp"
+
+static constexpr size_t target = 4;
+static constexpr size_t memorySize = 64 << 20;
+
+static bool waitReady(SandboxPool &pool)
+{
+	for (int i = 0; i < 1000; i++) {
+		if (pool.readyCount() == target) return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	return false;
+}
+
+/* the kernel comes up and makes its first hypercall */
+static bool boots(Sandbox &sandbox)
+{
+	return sandbox.run() == VCPU_HYPERCALL &&
+		VCPU_REG_GET(sandbox.getVcpu(), rax) == HYPERCALL_NONE;
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+	auto start = TestClock::now();
+
+	for (size_t i = 0; i < target; i++)
+		Sandbox sandbox(memorySize, kernel);
+
+	double cold = secondsSince(start) / target * 1e6;
+
+	SandboxPool pool(target, memorySize, KERNEL_IMAGE);
+	std::vector<SandboxPtr> sandboxes;
+
+	CHECK(waitReady(pool));
+
+	for (size_t i = 0; i < target; i++)
+		sandboxes.push_back(pool.acquire());
+	for (auto &sandbox : sandboxes)
+		CHECK(boots(*sandbox));
+
+	double warm = pool.getLatencyPercentile(50);
+
+	printf("boot %.0f us, acquire p50 %.0f us p99 %.0f us\n", cold, warm,
+			pool.getLatencyPercentile(99));
+	CHECK(warm < cold);
+
+	/* released ones are scrubbed and booted again */
+	for (auto &sandbox : sandboxes)
+		pool.release(std::move(sandbox));
+	sandboxes.clear();
+
+	CHECK(waitReady(pool));
+
+	SandboxPtr recycled = pool.acquire();
+	CHECK(boots(*recycled));
+
+	return testResult();
+}
@@ -0,0 +1,128 @@
+/* KVM slot accounting under concurrent mapping and unmapping in one
+ * VM, and with VMs created and destroyed concurrently */
+
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include "test.hpp"
+#include "memory.hpp"
+
+static constexpr int nThreads = 8;
+static constexpr int rounds = 500;
+/* mappings each thread holds at once */
+static constexpr int depth = 4;
+
+static void testOneVm(void *host)
+{
+	vm_t vm;
+	std::mutex lock;
+	std::set<uint32_t> live;
+	std::vector<std::thread> threads;
+	int failures = 0;
+
+	vm_init(&vm);
+
+	for (int t = 0; t < nThreads; t++) {
+		threads.emplace_back([&, t] {
+			for (int r = 0; r < rounds; r++) {
+				mem_t *mems[depth];
+
+				for (int k = 0; k < depth; k++) {
+					addr_t guest = (t * depth + k) * PAGE_SIZE;
+
+					mems[k] = vm_map_guest_physical(&vm,
+						(char *)host + guest, guest,
+						PAGE_SIZE);
+
+					std::lock_guard<std::mutex> guard(lock);
+					if (!mems[k] ||
+						!live.insert(mems[k]->slot).second)
+						failures++;
+				}
+
+				for (int k = 0; k < depth; k++) {
+					if (!mems[k]) continue;
+					{
+						std::lock_guard<std::mutex>
+							guard(lock);
+						live.erase(mems[k]->slot);
+					}
+					vm_unmap_guest_physical(&vm, mems[k]);
+				}
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	/* no slot handed out twice, and none leaked */
+	CHECK(failures == 0);
+	for (uint32_t i = 0; i < vm.max_slots / 64; i++)
+		CHECK(vm.slot_bitmap[i] == 0);
+
+	vm_destroy(&vm);
+}
+
+static void testManyVms(void *host)
+{
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	int failures = 0;
+
+	for (int t = 0; t < nThreads; t++) {
+		threads.emplace_back([&] {
+			for (int r = 0; r < rounds / 10; r++) {
+				vm_t vm;
+				mem_t *mems[depth];
+				bool ok = true;
+
+				vm_init(&vm);
+
+				/* each VM counts its slots from 0 */
+				for (int k = 0; k < depth; k++) {
+					mems[k] = vm_map_guest_physical(&vm,
+						(char *)host + k * PAGE_SIZE,
+						k * PAGE_SIZE, PAGE_SIZE);
+					ok = ok && mems[k] &&
+						mems[k]->slot == (uint32_t)k;
+				}
+
+				for (int k = depth - 1; k >= 0; k--)
+					if (mems[k])
+						vm_unmap_guest_physical(&vm,
+								mems[k]);
+
+				vm_destroy(&vm);
+
+				std::lock_guard<std::mutex> guard(lock);
+				if (!ok) failures++;
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	CHECK(failures == 0);
+}
+
+int main()
+{
+	testInit();
+
+	size_t len = nThreads * depth * PAGE_SIZE;
+	void *host = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	CHECK(host != MAP_FAILED);
+	if (host == MAP_FAILED) return testResult();
+
+	testOneVm(host);
+	testManyVms(host);
+
+	munmap(host, len);
+	return testResult();
+}
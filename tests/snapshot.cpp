@@ -0,0 +1,239 @@
+/* Snapshots restore lazily: guest memory is faulted in from the
+ * file as it is touched, not read up front. Incremental snapshots
+ * hold the changed pages only. Saving over a snapshot does not
+ * change the memory of a sandbox restored from it, and a sandbox
+ * does not save over the snapshots it builds on */
+
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "test.hpp"
+#include "abi.h"
+#include "sandbox.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr size_t dataLen = 16 << 20;
+
+static long minorFaults()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+static std::string snapshotPath(const char *name)
+{
+	return "/tmp/lightvirt-test-" + std::to_string(getpid()) + "-" + name;
+}
+
+static void fill(uint64_t *data, size_t len, uint64_t seed)
+{
+	for (size_t i = 0; i < len / sizeof(uint64_t); i++)
+		data[i] = seed + i;
+}
+
+static void testLazyRestore(const KernelImage &kernel)
+{
+	std::string path = snapshotPath("full");
+	addr_t data;
+
+	{
+		Sandbox sandbox(memorySize, kernel);
+		MemoryPool *pool = sandbox.getMemoryPool();
+
+		data = pool->getPhysicalMemoryBlock(dataLen);
+		fill(static_cast<uint64_t *>(
+			pool->getHostVirtualFromPhysical(data)), dataLen, 1);
+		sandbox.saveSnapshot(path);
+	}
+
+	long before = minorFaults();
+	auto sandbox = Sandbox::restoreSnapshot(path);
+	long restoreFaults = minorFaults() - before;
+
+	/* far fewer than the data pages */
+	printf("restore: %ld faults for %zu data pages\n", restoreFaults,
+			dataLen / PAGE_SIZE);
+	CHECK(restoreFaults < (long)(dataLen / PAGE_SIZE / 4));
+
+	CHECK(sandbox->run() == VCPU_HYPERCALL);
+	CHECK(VCPU_REG_GET(sandbox->getVcpu(), rax) == HYPERCALL_NONE);
+
+	/* one page in every 64. the host may map a large folio
+	 * of the file at once, so some of them share a fault */
+	MemoryPool *pool = sandbox->getMemoryPool();
+	auto *restored = static_cast<volatile uint64_t *>(
+		pool->getHostVirtualFromPhysical(data));
+	size_t stride = 64 * PAGE_SIZE / sizeof(uint64_t);
+	size_t touched = 0;
+	bool intact = true;
+
+	before = minorFaults();
+	for (size_t i = 0; i < dataLen / sizeof(uint64_t); i += stride) {
+		intact = intact && restored[i] == 1 + i;
+		touched++;
+	}
+	long touchFaults = minorFaults() - before;
+
+	printf("touch: %ld faults for %zu pages\n", touchFaults, touched);
+	CHECK(intact);
+	CHECK(touchFaults > 0);
+
+	unlink(path.c_str());
+}
+
+/* bytes on disk, snapshots may be sparse */
+static size_t fileBytes(const std::string &path)
+{
+	struct stat st;
+
+	if (stat(path.c_str(), &st) < 0) return 0;
+	return st.st_blocks * 512;
+}
+
+static void testIncremental(const KernelImage &kernel)
+{
+	std::string full = snapshotPath("base");
+	std::string incremental = snapshotPath("incremental");
+	constexpr size_t changedPages = 16;
+	addr_t data;
+
+	{
+		Sandbox sandbox(memorySize, kernel);
+		MemoryPool *pool = sandbox.getMemoryPool();
+
+		data = pool->getPhysicalMemoryBlock(dataLen);
+		auto *host = static_cast<uint64_t *>(
+			pool->getHostVirtualFromPhysical(data));
+
+		fill(host, dataLen, 1);
+		sandbox.saveSnapshot(full);
+
+		/* spread out, one page every 64. KVM does not see
+		 * writes through the host mapping */
+		for (size_t i = 0; i < changedPages; i++) {
+			fill(host + i * 64 * PAGE_SIZE / sizeof(uint64_t),
+				PAGE_SIZE, 1000000 + i);
+			pool->markDirty(data + i * 64 * PAGE_SIZE, PAGE_SIZE);
+		}
+		sandbox.saveSnapshot(incremental, true);
+	}
+
+	size_t fullBytes = fileBytes(full);
+	size_t incrementalBytes = fileBytes(incremental);
+
+	printf("full: %zu bytes, incremental: %zu bytes for %zu pages\n",
+			fullBytes, incrementalBytes, changedPages);
+	CHECK(fullBytes >= dataLen);
+	CHECK(incrementalBytes > 0);
+	CHECK(incrementalBytes < fullBytes / 16);
+
+	/* the changed pages come from the increment, the rest from the base */
+	auto sandbox = Sandbox::restoreSnapshot(incremental);
+	auto *restored = static_cast<uint64_t *>(
+		sandbox->getMemoryPool()->getHostVirtualFromPhysical(data));
+	size_t words = PAGE_SIZE / sizeof(uint64_t);
+	bool intact = true;
+
+	for (size_t page = 0; page < dataLen / PAGE_SIZE; page++) {
+		uint64_t *p = restored + page * words;
+		bool changed = page % 64 == 0 && page / 64 < changedPages;
+		uint64_t first = changed ? 1000000 + page / 64 :
+			1 + page * words;
+
+		intact = intact && p[0] == first && p[words - 1] ==
+			first + words - 1;
+	}
+
+	CHECK(intact);
+	CHECK(sandbox->run() == VCPU_HYPERCALL);
+
+	unlink(incremental.c_str());
+	unlink(full.c_str());
+}
+
+static void testOverwriteMapped(const KernelImage &kernel)
+{
+	std::string path = snapshotPath("mapped");
+	addr_t data;
+
+	{
+		Sandbox sandbox(memorySize, kernel);
+		MemoryPool *pool = sandbox.getMemoryPool();
+
+		data = pool->getPhysicalMemoryBlock(dataLen);
+		fill(static_cast<uint64_t *>(
+			pool->getHostVirtualFromPhysical(data)), dataLen, 1);
+		sandbox.saveSnapshot(path);
+	}
+
+	/* its memory is a private mapping of the file */
+	auto restored = Sandbox::restoreSnapshot(path);
+
+	{
+		Sandbox other(memorySize, kernel);
+		other.saveSnapshot(path);
+	}
+
+	auto *p = static_cast<volatile uint64_t *>(
+		restored->getMemoryPool()->getHostVirtualFromPhysical(data));
+	size_t words = dataLen / sizeof(uint64_t);
+
+	CHECK(p[0] == 1);
+	CHECK(p[words - 1] == words);
+	CHECK(restored->run() == VCPU_HYPERCALL);
+
+	unlink(path.c_str());
+}
+
+static void testOverwriteChain(const KernelImage &kernel)
+{
+	std::string base = snapshotPath("chain-base");
+	std::string middle = snapshotPath("chain-middle");
+	std::string top = snapshotPath("chain-top");
+	std::string other = snapshotPath("chain-other");
+
+	{
+		Sandbox sandbox(memorySize, kernel);
+
+		sandbox.saveSnapshot(base);
+		sandbox.saveSnapshot(middle, true);
+		sandbox.saveSnapshot(top, true);
+	}
+
+	auto restored = Sandbox::restoreSnapshot(top);
+
+	/* the restored file and its parents, whatever the mode */
+	for (const std::string &path : { top, middle, base }) {
+		CHECK(aborts([&] { restored->saveSnapshot(path); }));
+		CHECK(aborts([&] { restored->saveSnapshot(path, true); }));
+	}
+
+	/* a full save starts a new chain */
+	restored->saveSnapshot(other);
+	restored->saveSnapshot(base);
+	CHECK(aborts([&] { restored->saveSnapshot(other, true); }));
+
+	auto again = Sandbox::restoreSnapshot(base);
+	CHECK(again->run() == VCPU_HYPERCALL);
+
+	unlink(other.c_str());
+	unlink(top.c_str());
+	unlink(middle.c_str());
+	unlink(base.c_str());
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	testLazyRestore(kernel);
+	testIncremental(kernel);
+	testOverwriteMapped(kernel);
+	testOverwriteChain(kernel);
+
+	return testResult();
+}
@@ -0,0 +1,77 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+/* Each test and benchmark is a program of its own, built by make test
+ * and make bench and run from the top of the tree. A test exits with
+ * 1 if any CHECK() failed, a benchmark prints what it measured */
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "log.hpp"
+
+std::shared_ptr<spdlog::logger> console = spdlog::stdout_color_mt("console");
+
+#define KERNEL_IMAGE "kernel.bin"
+/* a guest program built from tests/guest/name.c */
+#define GUEST_ELF(name) "build/tests/guest/" name ".elf"
+
+static int checksFailed;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n",	\
+				__FILE__, __LINE__, #cond);		\
+			checksFailed++;					\
+		}							\
+	} while (0)
+
+static inline void testInit()
+{
+	log_init();
+	console->set_level(spdlog::level::warn);
+
+	/* a guest spinning on a fault, or a vcpu thread that does
+	 * not come back, fails the program instead of hanging */
+	alarm(120);
+}
+
+static inline int testResult()
+{
+	if (checksFailed)
+		fprintf(stderr, "%d checks failed\n", checksFailed);
+
+	return checksFailed ? 1 : 0;
+}
+
+/* fn() in a child process, true if it ends in std::abort() */
+template <typename Fn>
+static bool aborts(Fn fn)
+{
+	fflush(nullptr);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		console->set_level(spdlog::level::off);
+		fn();
+		_exit(0);
+	}
+
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) != pid) return false;
+
+	return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+using TestClock = std::chrono::steady_clock;
+
+static inline double secondsSince(TestClock::time_point start)
+{
+	return std::chrono::duration<double>(TestClock::now() - start).count();
+}
+
+#endif
@@ -0,0 +1,115 @@
+/* Memory unmapped from a space goes back to the pool only after the
+ * vcpus have flushed it from their TLBs, and right away when no vcpu
+ * runs in the space */
+
+#include "test.hpp"
+#include "sandbox.hpp"
+#include "region.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr addr_t anonymousBase = 0x20000000;
+
+/* the region page's frame, populated by a write */
+static FrameIndex populate(Sandbox &sandbox)
+{
+	MemorySpace *space = sandbox.getMemorySpace();
+	std::vector<GuestExtent> extents;
+	uint64_t value = 1;
+
+	CHECK(space->writeGuest(anonymousBase, &value, sizeof(value)));
+	CHECK(space->getGuestExtents(anonymousBase, PAGE_SIZE, false, extents));
+
+	return sandbox.getMemoryPool()->getFrameIndex(extents[0].guestPhysical);
+}
+
+static uint32_t refcount(Sandbox &sandbox, FrameIndex frame)
+{
+	return sandbox.getMemoryPool()->getFrame(frame).refcount;
+}
+
+static void testRemoveRegion(const KernelImage &kernel)
+{
+	Sandbox sandbox(memorySize, kernel);
+	MemorySpace *space = sandbox.getMemorySpace();
+
+	space->addRegion(std::make_shared<AnonymousMemoryRegion>(
+			sandbox.getMemoryPool(), anonymousBase, 16 * PAGE_SIZE));
+	FrameIndex frame = populate(sandbox);
+
+	/* the vcpu has been in the space */
+	CHECK(sandbox.run() == VCPU_HYPERCALL);
+
+	space->removeRegion(anonymousBase);
+	CHECK(refcount(sandbox, frame) == 1);
+
+	/* the flush is delivered on this entry and acked on the next */
+	CHECK(sandbox.run() == VCPU_HYPERCALL);
+	CHECK(refcount(sandbox, frame) == 1);
+	CHECK(sandbox.run() == VCPU_HYPERCALL);
+	CHECK(refcount(sandbox, frame) == 0);
+}
+
+static void testSwapOut(const KernelImage &kernel)
+{
+	Sandbox sandbox(memorySize, kernel);
+	MemorySpace *space = sandbox.getMemorySpace();
+
+	space->addRegion(std::make_shared<AnonymousMemoryRegion>(
+			sandbox.getMemoryPool(), anonymousBase, 16 * PAGE_SIZE));
+	FrameIndex frame = populate(sandbox);
+
+	CHECK(sandbox.run() == VCPU_HYPERCALL);
+
+	space->scanAccessed();
+	space->scanAccessed();
+	CHECK(sandbox.swapOut(1) > 0);
+	CHECK(refcount(sandbox, frame) == 1);
+
+	CHECK(sandbox.run() == VCPU_HYPERCALL);
+	CHECK(sandbox.run() == VCPU_HYPERCALL);
+	CHECK(refcount(sandbox, frame) == 0);
+
+	/* and the page comes back as it was */
+	uint64_t value = 0;
+	CHECK(space->readGuest(anonymousBase, &value, sizeof(value)));
+	CHECK(value == 1);
+	CHECK(space->getSwapStats().pagesIn == 1);
+}
+
+static void testNoVcpus()
+{
+	vm_t vm;
+	vm_init(&vm);
+
+	{
+		BuddyMemoryPool pool(&vm, 0, 16 << 20);
+		MemorySpace space(&pool);
+		std::vector<GuestExtent> extents;
+		uint64_t value = 1;
+
+		space.addRegion(std::make_shared<AnonymousMemoryRegion>(
+				&pool, anonymousBase, 16 * PAGE_SIZE));
+		CHECK(space.writeGuest(anonymousBase, &value, sizeof(value)));
+		CHECK(space.getGuestExtents(anonymousBase, PAGE_SIZE, false,
+					extents));
+
+		FrameIndex frame = pool.getFrameIndex(extents[0].guestPhysical);
+		space.removeRegion(anonymousBase);
+		CHECK(pool.getFrame(frame).refcount == 0);
+	}
+
+	vm_destroy(&vm);
+}
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+
+	testRemoveRegion(kernel);
+	testSwapOut(kernel);
+	testNoVcpus();
+
+	return testResult();
+}
@@ -0,0 +1,67 @@
+/* Requests a file waits for itself do not take, or hand out, the
+ * completions of those queued with a caller's userData on the same
+ * ring */
+
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include "test.hpp"
+#include "fs.hpp"
+#include "memory.hpp"
+#include "uring.hpp"
+
+static std::string filePath()
+{
+	return "/tmp/lightvirt-test-" + std::to_string(getpid()) + "-uring";
+}
+
+static void testTags()
+{
+	std::string path = filePath();
+	IoUring uring;
+	AsyncHostFile file(&uring, path, O_RDWR | O_CREAT | O_TRUNC);
+	std::vector<char> data(PAGE_SIZE, 'x');
+	std::vector<char> queued(PAGE_SIZE), waited(PAGE_SIZE);
+
+	CHECK(file.pwrite(data.data(), data.size(), 0) == (ssize_t)data.size());
+
+	/* every userData the ring's own requests could have, but
+	 * for the reserved bit */
+	for (uint64_t userData = 0; userData < 4; userData++)
+		file.submitRead(queued.data(), 100 + userData, 0, userData);
+	CHECK(file.pread(waited.data(), 200, 0) == 200);
+	CHECK(file.pread(waited.data(), 300, 0) == 300);
+
+	IoUring::Completion completions[8];
+	size_t n = 0;
+
+	uring.submit();
+	while (n < 4) {
+		n += uring.reap(completions + n, 8 - n);
+		if (n < 4) uring.submit(1);
+	}
+
+	bool mine = true;
+	for (size_t i = 0; i < n; i++)
+		mine = mine && completions[i].userData < 4 &&
+			completions[i].res == (int32_t)(100 +
+					completions[i].userData);
+	CHECK(n == 4);
+	CHECK(mine);
+	CHECK(uring.pending() == 0);
+
+	CHECK(aborts([&] {
+		file.submitRead(queued.data(), 100, 0, IoUring::INTERNAL);
+	}));
+
+	unlink(path.c_str());
+}
+
+int main()
+{
+	testInit();
+
+	testTags();
+
+	return testResult();
+}
@@ -0,0 +1,63 @@
+/* A guest that never leaves the guest stays in the working set:
+ * each scan kicks the vcpu so that its TLB drops the translations
+ * whose accessed bits were cleared */
+
+#include <thread>
+#include "test.hpp"
+#include "guest.hpp"
+#include "region.hpp"
+
+static constexpr size_t memorySize = 64 << 20;
+static constexpr addr_t base = 0x20000000;
+static constexpr size_t pages = 16;
+static constexpr int scans = 4;
+
+int main()
+{
+	testInit();
+
+	KernelImage kernel = readKernelImage(KERNEL_IMAGE);
+	Sandbox sandbox(memorySize, kernel);
+	MemorySpace *space = sandbox.getMemorySpace();
+	uint64_t result;
+
+	auto region = std::make_shared<AnonymousMemoryRegion>(
+			sandbox.getMemoryPool(), base, pages * PAGE_SIZE);
+	space->addRegion(region);
+
+	addr_t entry = loadGuest(sandbox, GUEST_ELF("touch"));
+	startGuest(sandbox, entry, base, pages);
+	CHECK(resumeGuest(sandbox, result) == GUEST_REPORT);
+
+	/* scans by hand only */
+	WorkingSetScanner::instance().setInterval(std::chrono::hours(1));
+	sandbox.trackWorkingSet();
+
+	GuestStop stop;
+	uint64_t rounds = 0;
+	std::thread vcpu([&] { stop = resumeGuest(sandbox, rounds); });
+
+	for (int i = 0; i < scans; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		space->scanAccessed();
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	space->scanAccessed();
+
+	/* every page was read since the last scan */
+	size_t workingSet = region->getWorkingSetSize(1);
+	printf("working set: %zu of %zu bytes, %lu host flushes\n",
+			workingSet, pages * PAGE_SIZE,
+			space->getTlbStats().hostFlushes);
+	CHECK(workingSet == pages * PAGE_SIZE);
+	CHECK(space->getTlbStats().hostFlushes > 0);
+
+	uint64_t one = 1;
+	CHECK(space->writeGuest(base, &one, sizeof(one)));
+	vcpu.join();
+
+	CHECK(stop == GUEST_REPORT);
+	CHECK(rounds > 0);
+
+	return testResult();
+}